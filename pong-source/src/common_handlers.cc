@@ -1,33 +1,32 @@
 ﻿#include "common_handlers.h"
 
+#include <boost/uuid/string_generator.hpp>
 #include <funapi.h>
 
+#include "match_room.h"
+#include "peer_directory.h"
 #include "pong_loggers.h"
 #include "pong_messages.pb.h"
+#include "redirect_state.h"
+#include "session_state.h"
+#include "user_prefetch.h"
+#include "user_record_cache.h"
 
 
-namespace pong {
+DECLARE_string(app_flavor);
 
-// 클라이언트를 다른 서버로 이동시킵니다.
-void MoveServerByTag(const Ptr<Session> session, const string &tag) {
-  // 아이디를 가져옵니다.
-  string id;
-  session->GetFromContext("id", &id);
 
-  // tag 에 해당하는 서버중 하나를 무작위로 고릅니다.
-  Rpc::PeerId target = PickServerRandomly(tag);
-  if (target.is_nil()) {
-    LOG(ERROR) << "Client redirecting failure. No target server: id=" << id
-               << ", tag=" << tag;
-    return;
-  }
+namespace pong {
 
-  // session context 를 JSON string 으로 저장합니다. 서버 이동 후
-  // 새로운 session 으로 옮기기 위함입니다.
-  string extra_data;
-  {
-    boost::mutex::scoped_lock lock(*session);
-    extra_data = session->GetContext().ToString();
+namespace {
+
+// 모아 둔 전적을 commit 한 뒤에 불립니다. target 서버가 User 를 읽어 두게
+// 하고 클라이언트를 옮깁니다.
+void RedirectToTarget(const Ptr<Session> &session, const Rpc::PeerId &target,
+                      const string &tag, const string &id,
+                      const string &extra_data) {
+  if (not id.empty()) {
+    UserPrefetch::Request(target, id);
   }
 
   // session 을 target 서버로 이동시키며 extra_data 를 함께 전달합니다.
@@ -42,6 +41,69 @@ void MoveServerByTag(const Ptr<Session> session, const string &tag) {
 }
 
 
+// 클라이언트를 target 서버로 이동시킵니다.
+void MoveServer(const Ptr<Session> &session, const Rpc::PeerId &target,
+                const string &tag) {
+  Ptr<PongSessionState> state = PongSessionState::Find(session);
+  if (not state) {
+    state.reset(new PongSessionState);
+  }
+
+  // 아이디를 가져옵니다.
+  const string id = state->id();
+
+  if (target.is_nil()) {
+    LOG(ERROR) << "Client redirecting failure. No target server: id=" << id
+               << ", tag=" << tag;
+    return;
+  }
+
+  // session 상태를 extra_data 로 바꿉니다. 서버 이동 후
+  // 새로운 session 으로 옮기기 위함입니다.
+  const string extra_data = EncodeRedirectState(*state);
+
+  // target 서버가 예전 전적을 읽지 않도록 모아 둔 전적이 commit 된 뒤에
+  // 옮깁니다. 쓸 전적이 없으면 바로 옮깁니다.
+  if (id.empty()) {
+    RedirectToTarget(session, target, tag, id, extra_data);
+    return;
+  }
+  UserRecordCache::Flush(
+      id, bind(&RedirectToTarget, session, target, tag, id, extra_data));
+}
+
+}  // unnamed namespace
+
+
+// 클라이언트를 다른 서버로 이동시킵니다.
+void MoveServerByTag(const Ptr<Session> session, const string &tag) {
+  // tag 에 해당하는 서버중 하나를 고릅니다.
+  MoveServer(session, PeerDirectory::Pick(tag), tag);
+}
+
+
+void MoveServerToPeer(const Ptr<Session> session, const string &peer_id,
+                      const string &tag) {
+  Rpc::PeerId target;
+  try {
+    target = boost::uuids::string_generator()(peer_id);
+  } catch (const std::runtime_error &) {
+    LOG(ERROR) << "Invalid peer id: peer_id=" << peer_id;
+    MoveServerByTag(session, tag);
+    return;
+  }
+
+  // 고른 뒤에 서버가 빠졌을 수 있습니다.
+  if (not PeerDirectory::Contains(tag, target)) {
+    LOG(WARNING) << "Assigned server is gone: peer_id=" << peer_id
+                 << ", tag=" << tag;
+    MoveServerByTag(session, tag);
+    return;
+  }
+  MoveServer(session, target, tag);
+}
+
+
 // 클라이언트가 다른 서버에서 이동해 왔을 때 불립니다.
 void OnClientRedirected(
     const std::string &account_id, const Ptr<Session> &session, bool success,
@@ -53,12 +115,21 @@ void OnClientRedirected(
     return;
   }
 
-  // 이전 서버의 Session Context 를 적용합니다.
-  Json context;
-  context.FromString(extra_data);
-  {
-    boost::mutex::scoped_lock lock(*session);
-    session->SetContext(context);
+  // 이전 서버의 session 상태를 적용합니다.
+  Ptr<PongSessionState> state(new PongSessionState);
+  if (not DecodeRedirectState(extra_data, state.get())) {
+    LOG(ERROR) << "Client redirecting failure. Invalid session state: id="
+               << account_id;
+    session->Close();
+    return;
+  }
+  state->MarkRedirected();
+  PongSessionState::Set(session, state);
+
+  // game 서버에서는 상대와 같은 MatchRoom 에 넣습니다.
+  const string opponent = state->opponent();
+  if (FLAGS_app_flavor == "game" && not opponent.empty()) {
+    MatchRoom::Join(session, account_id, opponent);
   }
 
   LOG(INFO) << "Client redirected: id=" << account_id;
@@ -76,6 +147,8 @@ void OnLoggedOutRemotely(const string &id, const Ptr<Session> &session) {
 void RegisterCommonHandlers() {
   AccountManager::RegisterRedirectionHandler(OnClientRedirected);
   AccountManager::RegisterRemoteLogoutHandler(OnLoggedOutRemotely);
+  UserPrefetch::Install();
+  UserRecordCache::Install();
 }
 
 }  // namespace pong
@@ -11,6 +11,10 @@
 namespace pong {
 
 void MoveServerByTag(const Ptr<Session> session, const string &tag);
+// peer_id 서버로 이동시킵니다. peer_id 가 tag 서버 목록에 없으면 tag 서버
+// 중 하나를 무작위로 고릅니다.
+void MoveServerToPeer(const Ptr<Session> session, const string &peer_id,
+                      const string &tag);
 void RegisterCommonHandlers();
 
 }  // namespace pong
@@ -0,0 +1,253 @@
+﻿#include "facebook_token_cache.h"
+
+#include <list>
+#include <utility>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+#include <openssl/sha.h>
+
+
+DEFINE_int32(facebook_token_cache_size, 10000,
+             "Maximum number of Facebook token validations to remember");
+DEFINE_int32(facebook_token_cache_ttl_in_sec, 300,
+             "Remembers a successful Facebook token validation this long");
+DEFINE_int32(facebook_token_negative_ttl_in_sec, 30,
+             "Remembers a rejected Facebook token this long");
+DEFINE_bool(use_stub_facebook_authenticator, false,
+            "Validates Facebook tokens locally, accepting any non-empty "
+            "token. For local testing only");
+
+
+namespace pong {
+
+namespace {
+
+const char kServiceProvider[] = "Facebook";
+
+
+struct CachedValidation {
+  AccountAuthenticationResponse response;
+  WallClock::Value expire_time;
+  // the_cache_order 에서의 위치입니다.
+  std::list<string>::iterator order;
+};
+
+typedef boost::unordered_map<string, CachedValidation> ValidationMap;
+typedef boost::unordered_map<string,
+                             std::vector<AuthenticationResponseHandler> >
+    InFlightMap;
+
+boost::mutex the_cache_mutex;
+ValidationMap the_validations;
+// 먼저 넣은 것부터 지웁니다.
+std::list<string> the_cache_order;
+// 검증 중인 key 와 결과를 기다리는 handler 들입니다.
+InFlightMap the_in_flights;
+
+Authenticator the_authenticator;
+
+
+struct TokenCacheStats {
+  TokenCacheStats()
+      : hits(0), negative_hits(0), misses(0), coalesced(0), errors(0),
+        evictions(0) {
+  }
+
+  boost::atomic<int64_t> hits;
+  boost::atomic<int64_t> negative_hits;
+  boost::atomic<int64_t> misses;
+  // 검증 중인 요청에 합친 수입니다.
+  boost::atomic<int64_t> coalesced;
+  boost::atomic<int64_t> errors;
+  boost::atomic<int64_t> evictions;
+};
+
+TokenCacheStats the_stats;
+
+
+// token 을 그대로 들고 있지 않도록 SHA-256 digest 로 바꿉니다. 다른 token 이
+// 같은 key 가 되면 서로의 검증 결과로 로그인하므로 충돌에 강한 해시를
+// 써야 합니다.
+string MakeCacheKey(const string &uid, const string &access_token) {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char *>(access_token.data()),
+         access_token.size(), digest);
+  string key = uid;
+  key += ':';
+  key.append(reinterpret_cast<const char *>(digest), sizeof(digest));
+  return key;
+}
+
+
+// the_cache_mutex 를 잡고 불러야 합니다.
+void EraseValidation(ValidationMap::iterator itr) {
+  the_cache_order.erase(itr->second.order);
+  the_validations.erase(itr);
+}
+
+
+// the_cache_mutex 를 잡고 불러야 합니다.
+void InsertValidation(const string &key,
+                      const AccountAuthenticationResponse &response) {
+  ValidationMap::iterator itr = the_validations.find(key);
+  if (itr != the_validations.end()) {
+    EraseValidation(itr);
+  }
+
+  while (not the_cache_order.empty() &&
+         the_validations.size() >=
+             static_cast<size_t>(FLAGS_facebook_token_cache_size)) {
+    EraseValidation(the_validations.find(the_cache_order.front()));
+    the_stats.evictions.fetch_add(1, boost::memory_order_relaxed);
+  }
+
+  const int64_t ttl_in_sec = response.success ?
+      FLAGS_facebook_token_cache_ttl_in_sec :
+      FLAGS_facebook_token_negative_ttl_in_sec;
+  CachedValidation &validation = the_validations[key];
+  validation.response = response;
+  validation.expire_time = WallClock::Now() + WallClock::FromSec(ttl_in_sec);
+  validation.order = the_cache_order.insert(the_cache_order.end(), key);
+}
+
+
+void OnAuthenticated(const string &key,
+                     const AccountAuthenticationRequest &request,
+                     const AccountAuthenticationResponse &response,
+                     const bool &error) {
+  std::vector<AuthenticationResponseHandler> waiters;
+  {
+    boost::mutex::scoped_lock lock(the_cache_mutex);
+    InFlightMap::iterator itr = the_in_flights.find(key);
+    if (itr != the_in_flights.end()) {
+      waiters.swap(itr->second);
+      the_in_flights.erase(itr);
+    }
+    if (error) {
+      // 인증 서버 장애는 다음 요청에서 다시 시도합니다.
+      the_stats.errors.fetch_add(1, boost::memory_order_relaxed);
+    } else if (FLAGS_facebook_token_cache_size > 0) {
+      InsertValidation(key, response);
+    }
+  }
+
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    waiters[i](request, response, error);
+  }
+}
+
+
+void AuthenticateByEngine(const AccountAuthenticationRequest &request,
+                          const AuthenticationResponseHandler &handler) {
+  Authenticate(request, handler);
+}
+
+
+// --use_stub_facebook_authenticator 에서 씁니다.
+void AuthenticateLocally(const AccountAuthenticationRequest &request,
+                         const AuthenticationResponseHandler &handler) {
+  AccountAuthenticationResponse response;
+  response.success = not request.key.empty();
+  response.reason_description = response.success ? "" : "empty token";
+  handler(request, response, false);
+}
+
+
+// GET /v1/facebook_token_cache/
+void OnTokenCacheRequested(Ptr<http::Response> response,
+                           const http::Request &/*request*/,
+                           const ApiService::MatchResult &/*params*/) {
+  response->status_code = http::kOk;
+  response->body = FacebookTokenCache::Dump().ToString();
+}
+
+}  // unnamed namespace
+
+
+void FacebookTokenCache::Install() {
+  if (FLAGS_use_stub_facebook_authenticator) {
+    LOG(WARNING) << "Facebook tokens are validated by the local stub";
+    SetAuthenticator(AuthenticateLocally);
+  } else {
+    SetAuthenticator(AuthenticateByEngine);
+  }
+  ApiService::RegisterHandler(
+      http::kGet, boost::regex("/v1/facebook_token_cache/"),
+      OnTokenCacheRequested);
+}
+
+
+void FacebookTokenCache::SetAuthenticator(
+    const Authenticator &authenticator) {
+  BOOST_ASSERT(authenticator);
+  the_authenticator = authenticator;
+}
+
+
+void FacebookTokenCache::Authenticate(
+    const string &uid, const string &access_token,
+    const AuthenticationResponseHandler &handler) {
+  AccountAuthenticationRequest request(
+      kServiceProvider, uid, MakeFacebookAuthenticationKey(access_token));
+  const string key = MakeCacheKey(uid, access_token);
+
+  bool hit = false;
+  AccountAuthenticationResponse cached;
+  {
+    boost::mutex::scoped_lock lock(the_cache_mutex);
+    ValidationMap::iterator itr = the_validations.find(key);
+    if (itr != the_validations.end() &&
+        itr->second.expire_time <= WallClock::Now()) {
+      EraseValidation(itr);
+      itr = the_validations.end();
+    }
+
+    if (itr != the_validations.end()) {
+      hit = true;
+      cached = itr->second.response;
+    } else {
+      std::pair<InFlightMap::iterator, bool> inserted =
+          the_in_flights.insert(std::make_pair(
+              key, std::vector<AuthenticationResponseHandler>()));
+      inserted.first->second.push_back(handler);
+      if (not inserted.second) {
+        the_stats.coalesced.fetch_add(1, boost::memory_order_relaxed);
+        return;
+      }
+    }
+  }
+
+  if (hit) {
+    the_stats.hits.fetch_add(1, boost::memory_order_relaxed);
+    if (not cached.success) {
+      the_stats.negative_hits.fetch_add(1, boost::memory_order_relaxed);
+    }
+    handler(request, cached, false);
+    return;
+  }
+
+  the_stats.misses.fetch_add(1, boost::memory_order_relaxed);
+  the_authenticator(request, bind(&OnAuthenticated, key, _1, _2, _3));
+}
+
+
+Json FacebookTokenCache::Dump() {
+  Json dump;
+  dump["hits"] = the_stats.hits.load();
+  dump["negative_hits"] = the_stats.negative_hits.load();
+  dump["misses"] = the_stats.misses.load();
+  dump["coalesced"] = the_stats.coalesced.load();
+  dump["errors"] = the_stats.errors.load();
+  dump["evictions"] = the_stats.evictions.load();
+  {
+    boost::mutex::scoped_lock lock(the_cache_mutex);
+    dump["size"] = static_cast<int64_t>(the_validations.size());
+    dump["in_flight"] = static_cast<int64_t>(the_in_flights.size());
+  }
+  return dump;
+}
+
+}  // namespace pong
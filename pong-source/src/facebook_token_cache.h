@@ -0,0 +1,45 @@
+﻿#ifndef SRC_FACEBOOK_TOKEN_CACHE_H_
+#define SRC_FACEBOOK_TOKEN_CACHE_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 엔진의 Authenticate() 와 같은 모양의 인증 함수입니다.
+typedef boost::function<void(const AccountAuthenticationRequest &,
+                             const AuthenticationResponseHandler &)>
+    Authenticator;
+
+
+// Facebook access token 검증 결과를 캐시합니다.
+//
+// 다시 접속하거나 서버를 오가는 클라이언트가 같은 token 으로 로그인할
+// 때마다 외부 HTTP 요청을 보내지 않도록, uid 와 token 의 SHA-256 을 key 로
+// 성공은 --facebook_token_cache_ttl_in_sec 동안, 실패는
+// --facebook_token_negative_ttl_in_sec 동안 기억합니다. 인증 서버 오류는
+// 기억하지 않습니다. 같은 token 으로 검증 중인 요청이 있으면 새로 보내지
+// 않고 그 결과를 함께 받습니다.
+//
+// 통계는 API 서비스의 GET /v1/facebook_token_cache/ 로 볼 수 있습니다.
+class FacebookTokenCache {
+ public:
+  static void Install();
+
+  // 기본값은 엔진의 Authenticate() 입니다. --use_stub_facebook_authenticator
+  // 를 켜면 비어 있지 않은 token 을 모두 받아들이는 로컬 인증을 씁니다.
+  static void SetAuthenticator(const Authenticator &authenticator);
+
+  // Authenticate() 대신 부릅니다. 캐시에 있으면 그 자리에서 handler 를
+  // 부릅니다.
+  static void Authenticate(const string &uid, const string &access_token,
+                           const AuthenticationResponseHandler &handler);
+
+  static Json Dump();
+};
+
+}  // namespace pong
+
+#endif  // SRC_FACEBOOK_TOKEN_CACHE_H_
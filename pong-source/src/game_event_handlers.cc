@@ -1,13 +1,31 @@
 ﻿#include "game_event_handlers.h"
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
 #include <funapi.h>
 #include <glog/logging.h>
 
 #include "common_handlers.h"
+#include "game_server_load.h"
+#include "latency_estimator.h"
 #include "leaderboard.h"
+#include "match_room.h"
+#include "match_ticker.h"
 #include "matchmaking.h"
+#include "pong_codec.h"
 #include "pong_loggers.h"
+#include "pong_simulation.h"
 #include "pong_types.h"
+#include "relay_bridge.h"
+#include "relay_channel.h"
+#include "relay_trace.h"
+#include "replay_reader.h"
+#include "replay_recorder.h"
+#include "session_state.h"
+#include "user_prefetch.h"
+#include "user_record_cache.h"
 
 #include "pong_messages.pb.h"
 
@@ -23,27 +41,52 @@ DECLARE_uint64(udp_protobuf_port);
 DECLARE_uint64(http_protobuf_port);
 DECLARE_uint64(websocket_protobuf_port);
 
+DEFINE_bool(authoritative_simulation, false,
+            "Runs the pong simulation on the game server and takes only "
+            "paddle inputs from clients");
+DEFINE_int32(simulation_tick_in_ms, 33,
+             "Fixed tick interval of the authoritative simulation and of "
+             "relay coalescing");
+DEFINE_int32(snapshot_interval_in_ticks, 2,
+             "Sends a state snapshot to clients every N simulation ticks");
+DEFINE_bool(relay_coalescing, false,
+            "Keeps only the newest unsent relay per session and flushes "
+            "it once per tick");
+DEFINE_bool(relay_pass_through, false,
+            "Forwards relay messages to the opponent as received, without "
+            "looking at the payload");
+DEFINE_int32(ready_check_timeout_in_sec, 10,
+             "Ends a match if both players have not sent ready within this "
+             "time after the first one arrives. 0 disables the deadline");
+DEFINE_bool(use_relay_codec, false,
+            "Sends authoritative snapshots in the packed relay codec format "
+            "(protobuf only)");
+DEFINE_bool(spectator_mode, false,
+            "Lets clients watch a match by sending spectate with a player id");
+DEFINE_int32(max_spectators_per_match, 500,
+             "Maximum number of spectators of a match");
+DEFINE_int32(split_match_check_delay_in_ms, 1000,
+             "If the opponent has not arrived this long after a match room "
+             "is created, looks for the opponent on other game servers and "
+             "bridges the match over RPC. 0 disables bridging");
+DEFINE_string(replay_benchmark_file, "",
+              "Replay recording (without .dat/.idx) that POST "
+              "/v1/replay_benchmark/ feeds through the relay handlers to "
+              "measure throughput. Empty disables the endpoint");
 
-namespace pong {
-
-// Player 들의 승/패를 1 증가 시킵니다.
-void FetchAndUpdateMatchRecord(const string& winner_id,
-                               const string& loser_id) {
-  Ptr<User> winner = User::FetchById(winner_id);
-  Ptr<User> loser = User::FetchById(loser_id);
 
-  if(not winner) {
-    LOG(ERROR) << "Cannot find winner's id in db: id=" << winner_id;
-    return;
-  }
+namespace pong {
 
-  if(not loser) {
-    LOG(ERROR) << "Cannot find loser's id in db: id=" << loser_id;
-    return;
-  }
+// Player 들의 승/패를 1 증가 시킵니다. ORM 에는 UserRecordCache 가 모아서
+// 씁니다.
+void UpdateMatchRecord(const string& winner_id, const string& loser_id) {
+  UserRecordDelta win;
+  win.win_count = 1;
+  UserRecordCache::Add(winner_id, win);
 
-  winner->SetWinCount(winner->GetWinCount() + 1);
-  loser->SetLoseCount(loser->GetLoseCount() + 1);
+  UserRecordDelta lose;
+  lose.lose_count = 1;
+  UserRecordCache::Add(loser_id, lose);
 }
 
 
@@ -51,57 +94,61 @@ void FetchAndUpdateMatchRecord(const string& winner_id,
 // unnamed namespace 로 감쌉니다.
 namespace {
 
-void FreeUser(const Ptr<Session> &session, EncodingScheme encoding);
+template <EncodingScheme kEncoding>
+void FreeUser(const Ptr<Session> &session);
+template <EncodingScheme kEncoding>
+void ForfeitMatch(const Ptr<MatchRoom> &room, PongSide side);
 
 // 새 클라이언트가 접속하여 세션이 열릴 때 불리는 함수
 void OnSessionOpened(const Ptr<Session> &session) {
   // 세션 접속  Activity Log 를 남깁니다.
   logger::SessionOpened(to_string(session->id()), WallClock::Now());
+  GameServerLoad::AddSession();
 }
 
 
 // 세션이 닫혔을 때 불리는 함수
-void OnSessionClosed(const Ptr<Session> &session, SessionCloseReason reason,
-                     EncodingScheme encoding) {
+template <EncodingScheme kEncoding>
+void OnSessionClosed(const Ptr<Session> &session, SessionCloseReason reason) {
   // 세션 닫힘 Activity Log 를 남깁니다.
   logger::SessionClosed(to_string(session->id()), WallClock::Now());
+  GameServerLoad::RemoveSession();
   // 세션을 초기화 합니다.
-  FreeUser(session, encoding);
+  FreeUser<kEncoding>(session);
 }
 
 
 // TCP 연결이 끊기면 불립니다.
-void OnTransportTcpDetached(const Ptr<Session> &session,
-                            EncodingScheme encoding) {
-  string id;
-  session->GetFromContext("id", &id);
+template <EncodingScheme kEncoding>
+void OnTransportTcpDetached(const Ptr<Session> &session) {
+  const string id = PongSessionState::GetId(session);
   LOG_IF(INFO, not id.empty()) << "TCP disconnected: id=" << id;
   // 세션을 초기화 합니다.
-  FreeUser(session, encoding);
+  FreeUser<kEncoding>(session);
 }
 
 
 // Websocket 연결이 끊기면 불립니다.
-void OnTransportWebsocketDetached(const Ptr<Session> &session,
-                            EncodingScheme encoding) {
-  string id;
-  session->GetFromContext("id", &id);
+template <EncodingScheme kEncoding>
+void OnTransportWebsocketDetached(const Ptr<Session> &session) {
+  const string id = PongSessionState::GetId(session);
   LOG_IF(INFO, not id.empty()) << "Websocket disconnected: id=" << id;
   // 세션을 초기화 합니다.
-  FreeUser(session, encoding);
+  FreeUser<kEncoding>(session);
 }
 
 
 // 세션을 정리합니다.
-void FreeUser(const Ptr<Session> &session, EncodingScheme encoding) {
-  // 유저를 정리하기 위한 Context 를 읽어옵니다.
-  string opponent_id;
-  string my_id;
-  session->GetFromContext("opponent", &opponent_id);
-  session->GetFromContext("id", &my_id);
+template <EncodingScheme kEncoding>
+void FreeUser(const Ptr<Session> &session) {
+  // 유저를 정리하기 위한 상태를 떼어 냅니다.
+  Ptr<PongSessionState> state = PongSessionState::Remove(session);
+  const string my_id = state ? state->id() : string();
 
-  // Session Context 를 초기화 합니다.
-  session->SetContext(Json());
+  // 매치에서 빠집니다.
+  PongSide side = kSideA;
+  Ptr<MatchRoom> room = MatchRoom::Find(session, &side);
+  MatchRoom::Leave(session);
 
   // 로그아웃하고 세션을 종료합니다.
   if (not my_id.empty()) {
@@ -114,126 +161,952 @@ void FreeUser(const Ptr<Session> &session, EncodingScheme encoding) {
     AccountManager::SetLoggedOutAsync(my_id, logout_cb);
   }
 
-  // 대전 상대가 있는 경우, 상대가 승리한 것으로 처리하고 로비서버로 보냅니다.
-  if (opponent_id.empty()) {
+  // 대전 중인 경우, 상대가 승리한 것으로 처리하고 로비서버로 보냅니다.
+  if (room) {
+    Event::Invoke(bind(&ForfeitMatch<kEncoding>, room, side), room->tag());
+  }
+}
+
+
+// 매치가 끝난 세션에서 상대 정보를 지웁니다.
+void ClearOpponent(const Ptr<Session> &session) {
+  if (Ptr<PongSessionState> state = PongSessionState::Find(session)) {
+    state->set_opponent(string());
+  }
+}
+
+
+// side 가 나간 매치를 상대의 승리로 끝냅니다. 매치의 event tag 에서
+// 불립니다.
+template <EncodingScheme kEncoding>
+void ForfeitMatch(const Ptr<MatchRoom> &room, PongSide side) {
+  // 이미 결과가 난 매치면 Finish() 가 false 를 반환합니다.
+  if (not room->Finish()) {
+    return;
+  }
+  const PongSide opponent_side = GetOpponentSide(side);
+  const string &opponent_id = room->GetPlayerId(opponent_side);
+  ReplayRecorder::Record(*room, opponent_side, kReplayFinish, opponent_id);
+
+  // 상대가 다른 서버에 있으면 그 서버에서 전적을 기록하고 승리를 알립니다.
+  Rpc::PeerId remote_peer;
+  if (room->GetRemotePeer(opponent_side, &remote_peer)) {
+    RelayBridge::Send(remote_peer, PongBridgeItem::FORFEIT, opponent_id);
     return;
   }
-  Ptr<Session> opponent_session = AccountManager::FindLocalSession(opponent_id);
+
+  Ptr<Session> opponent_session = room->GetSession(opponent_side);
   if (not opponent_session || not opponent_session->IsTransportAttached()) {
     return;
   }
 
-  Event::Invoke(bind(&FetchAndUpdateMatchRecord, opponent_id, my_id));
+  UpdateMatchRecord(opponent_id, room->GetPlayerId(side));
 
   IncreaseCurWinCount(opponent_id);
-  ResetCurWinCount(my_id);
+  ResetCurWinCount(room->GetPlayerId(side));
 
-  if (encoding == kJsonEncoding) {
-    opponent_session->SendMessage("result", MakeResponse("win"),
-                                  kDefaultEncryption);
-  } else {
-    Ptr<FunMessage> msg(new FunMessage);
-    GameResultMessage *result_msg = msg->MutableExtension(game_result);
-    result_msg->set_result("win");
-    opponent_session->SendMessage("result", msg);
-  }
+  opponent_session->SendMessage(
+      "result", PongCodec<kEncoding>::GameResult(true), kDefaultEncryption,
+      GetControlProtocol());
 
+  ClearOpponent(opponent_session);
   MoveServerByTag(opponent_session, "lobby");
 }
 
-}  // unnamed namesapce
 
+// 승패를 기록하고 두 플레이어에게 결과를 알린 후 lobby 서버로 보냅니다.
+template <EncodingScheme kEncoding>
+void FinishMatch(const Ptr<Session> &winner_session, const string &winner_id,
+                 const Ptr<Session> &loser_session, const string &loser_id) {
+  UpdateMatchRecord(winner_id, loser_id);
 
-void HandleReadySignal(const Ptr<Session> &session, EncodingScheme encoding) {
-  session->AddToContext("ready", 1);
-  string opponent_id;
-  session->GetFromContext("opponent", &opponent_id);
-  Ptr<Session> opponent_session = AccountManager::FindLocalSession(opponent_id);
-  // 상대의 상태를 확인합니다.
-  if (opponent_session && opponent_session->IsTransportAttached()) {
-    int64_t is_opponent_ready = 0;
-    opponent_session->GetFromContext("ready", &is_opponent_ready);
-    if (is_opponent_ready == 1) {
-      // 둘 다 준비가 되었습니다. 시작 신호를 보냅니다.
-
-      if (encoding == kJsonEncoding) {
-        Json response = MakeResponse("ok");
-        session->SendMessage("start", response);
-        opponent_session->SendMessage("start", response);
-      } else {
-        Ptr<FunMessage> msg(new FunMessage);
-        GameStartMessage *start_msg = msg->MutableExtension(game_start);
-        start_msg->set_result("ok");
-        session->SendMessage("start", msg);
-        opponent_session->SendMessage("start", msg);
+  if (winner_session && winner_session->IsTransportAttached()) {
+    // 상대에게 승리했음을 알립니다.
+    winner_session->SendMessage(
+        "result", PongCodec<kEncoding>::GameResult(true), kDefaultEncryption,
+        GetControlProtocol());
+    IncreaseCurWinCount(winner_id);
+  }
+
+  // 패배 확인 메세지를 보냅니다.
+  if (loser_session) {
+    loser_session->SendMessage(
+        "result", PongCodec<kEncoding>::GameResult(false), kDefaultEncryption,
+        GetControlProtocol());
+  }
+  ResetCurWinCount(loser_id);
+
+  // 각각 상대방에 대한 정보를 삭제하고 lobby 서버로 이동시킵니다.
+  if (winner_session) {
+    ClearOpponent(winner_session);
+    MoveServerByTag(winner_session, "lobby");
+  }
+  if (loser_session) {
+    ClearOpponent(loser_session);
+    MoveServerByTag(loser_session, "lobby");
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Ready check
+//
+// 첫 플레이어가 도착해 방이 만들어지면 마감 시간을 겁니다. 그때까지 두
+// 플레이어가 모두 ready 를 보내지 않으면, 한 쪽만 ready 였다면 그 쪽의
+// 승리로, 아무도 ready 가 아니었다면 승패 없이 끝내고 lobby 로 보냅니다.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+int64_t GetReadyCheckElapsedInMsec(const Ptr<MatchRoom> &room) {
+  return (WallClock::Now() - room->created_time()).total_milliseconds();
+}
+
+
+// 매치의 event tag 에서 불립니다.
+template <EncodingScheme kEncoding>
+void ResolveExpiredReadyCheck(const Ptr<MatchRoom> &room) {
+  // 이미 시작했거나 끝난 매치입니다.
+  if (not room->ExpireReadyCheck()) {
+    return;
+  }
+
+  Ptr<Session> sessions[2] = {
+      room->GetSession(kSideA), room->GetSession(kSideB) };
+  const bool ready_a = room->IsReady(kSideA);
+  const bool ready_b = room->IsReady(kSideB);
+
+  if (ready_a != ready_b) {
+    const PongSide winner = ready_a ? kSideA : kSideB;
+    const PongSide loser = GetOpponentSide(winner);
+    LOG(INFO) << "Ready check expired. Forfeit: winner="
+              << room->GetPlayerId(winner) << ", loser="
+              << room->GetPlayerId(loser) << ", elapsed_ms="
+              << GetReadyCheckElapsedInMsec(room);
+    ReplayRecorder::Record(*room, winner, kReplayFinish,
+                           room->GetPlayerId(winner));
+    FinishMatch<kEncoding>(sessions[winner], room->GetPlayerId(winner),
+                           sessions[loser], room->GetPlayerId(loser));
+    return;
+  }
+
+  LOG(INFO) << "Ready check expired. Match voided: a="
+            << room->GetPlayerId(kSideA) << ", b="
+            << room->GetPlayerId(kSideB) << ", elapsed_ms="
+            << GetReadyCheckElapsedInMsec(room);
+  ReplayRecorder::Record(*room, kSideA, kReplayFinish);
+  for (int i = kSideA; i <= kSideB; ++i) {
+    if (not sessions[i]) {
+      continue;
+    }
+    if (sessions[i]->IsTransportAttached()) {
+      sessions[i]->SendMessage("result", PongCodec<kEncoding>::GameVoided(),
+                               kDefaultEncryption, GetControlProtocol());
+    }
+    ClearOpponent(sessions[i]);
+    MoveServerByTag(sessions[i], "lobby");
+  }
+}
+
+
+template <EncodingScheme kEncoding>
+void OnReadyCheckTimerExpired(const Ptr<MatchRoom> &room,
+                              const Timer::Id &/*timer_id*/,
+                              const WallClock::Value &/*now*/) {
+  Event::Invoke(bind(&ResolveExpiredReadyCheck<kEncoding>, room),
+                room->tag());
+}
+
+
+template <EncodingScheme kEncoding>
+void StartReadyCheck(const Ptr<MatchRoom> &room) {
+  if (FLAGS_ready_check_timeout_in_sec <= 0) {
+    return;
+  }
+  Timer::ExpireAfter(WallClock::FromSec(FLAGS_ready_check_timeout_in_sec),
+                     bind(&OnReadyCheckTimerExpired<kEncoding>, room, _1, _2));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 서버 권한 모드
+//
+// 서버가 공과 막대를 고정 주기로 시뮬레이션 합니다. 클라이언트는 막대 위치만
+// 보내고, 서버는 각 클라이언트 시점의 상태를 relay 메시지로 보냅니다.
+// 승패도 서버가 판정합니다.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// side 시점의 상태를 relay 메시지로 보냅니다. barX 는 상대의 막대입니다.
+// packed 가 있으면 압축한 상태만 보냅니다.
+template <EncodingScheme kEncoding>
+void SendSnapshot(const Ptr<Session> &session, const PongState &view,
+                  int64_t tick, const string &packed) {
+  if (not session->IsTransportAttached()) {
+    return;
+  }
+
+  if (not packed.empty()) {
+    session->SendMessage("relay",
+                         PongCodec<kProtobufEncoding>::PackedSnapshot(packed),
+                         kDefaultEncryption, GetRelayProtocol(session));
+  } else {
+    session->SendMessage("relay", PongCodec<kEncoding>::Snapshot(view, tick),
+                         kDefaultEncryption, GetRelayProtocol(session));
+  }
+}
+
+
+// MatchTicker 에서 매 tick 마다 불립니다.
+template <EncodingScheme kEncoding>
+bool TickAuthoritativeMatch(const Ptr<MatchRoom> &room, int64_t tick) {
+  if (room->finished()) {
+    return false;
+  }
+
+  Ptr<Session> sessions[2] = {
+      room->GetSession(kSideA), room->GetSession(kSideB) };
+  if (not sessions[kSideA] || not sessions[kSideB]) {
+    // 세션이 닫힌 쪽의 패배 처리는 FreeUser() 에서 합니다.
+    return false;
+  }
+
+  PongStepResult result = kInPlay;
+  PongState views[2];
+  string packed[2];
+  {
+    boost::mutex::scoped_lock lock(room->mutex());
+    result = room->simulation().Step(MatchTicker::interval_in_sec());
+    if (result == kInPlay && tick % FLAGS_snapshot_interval_in_ticks != 0) {
+      return true;
+    }
+    room->simulation().GetView(kSideA, &views[kSideA]);
+    room->simulation().GetView(kSideB, &views[kSideB]);
+
+    if (FLAGS_use_relay_codec && kEncoding == kProtobufEncoding) {
+      for (int side = kSideA; side <= kSideB; ++side) {
+        const PongState &view = views[side];
+        // 아직 입력을 받지 못했으면 ack 를 보내지 않습니다.
+        const RelayDecoder &decoder =
+            room->input_decoder(static_cast<PongSide>(side));
+        room->snapshot_encoder(static_cast<PongSide>(side)).Encode(
+            RelayState::Quantize(view.ball_x, view.ball_y, view.ball_vx,
+                                 view.ball_vy, view.bar_x[1]),
+            decoder.has_last(), decoder.last_sequence(), &packed[side]);
       }
     }
   }
-  /*
-  //TODO : 상대가 나간건지 아직 접속 전인지 알 수 없기 때문에
-  //ready 상태를 동기화는 방법을 변경하던가, 5초 후에 다시 확인하자
-  else {
-    // 상대가 접속을 종료했습니다.
-    if (encoding == kJsonEncoding) {
-      session->SendMessage("match", MakeResponse("opponent disconnected"),
-                           kDefaultEncryption);
+
+  SendSnapshot<kEncoding>(sessions[kSideA], views[kSideA], tick,
+                          packed[kSideA]);
+  SendSnapshot<kEncoding>(sessions[kSideB], views[kSideB], tick,
+                          packed[kSideB]);
+  if (room->spectators().subscriber_count() > 0) {
+    room->spectators().SetLatest(
+        kSideA, PongCodec<kEncoding>::Snapshot(views[kSideA], tick));
+  }
+
+  if (result == kInPlay) {
+    return true;
+  }
+
+  if (not room->Finish()) {
+    return false;
+  }
+
+  const PongSide loser = result == kSideAMissed ? kSideA : kSideB;
+  const PongSide winner = GetOpponentSide(loser);
+  LOG(INFO) << "Match decided by server: winner="
+            << room->GetPlayerId(winner) << ", loser="
+            << room->GetPlayerId(loser);
+  ReplayRecorder::Record(*room, winner, kReplayFinish,
+                         room->GetPlayerId(winner));
+  FinishMatch<kEncoding>(sessions[winner], room->GetPlayerId(winner),
+                         sessions[loser], room->GetPlayerId(loser));
+  return false;
+}
+
+
+template <EncodingScheme kEncoding>
+void StartAuthoritativeMatch(const Ptr<MatchRoom> &room) {
+  {
+    boost::mutex::scoped_lock lock(room->mutex());
+    room->simulation().Reset(static_cast<uint32_t>(
+        RandomGenerator::GenerateNumber(1, 0x7fffffff)));
+  }
+  MatchTicker::Add(bind(&TickAuthoritativeMatch<kEncoding>, room, _1),
+                   room->tag());
+}
+
+
+// 클라이언트가 보낸 막대 위치를 시뮬레이션에 반영합니다.
+void ApplyBarInput(const Ptr<MatchRoom> &room, PongSide side, float bar_x) {
+  boost::mutex::scoped_lock lock(room->mutex());
+  room->simulation().SetBarInput(side, bar_x);
+}
+
+
+// 압축된 입력을 풀어 막대 위치와 snapshot 수신 확인을 반영합니다.
+void ApplyPackedInput(const Ptr<MatchRoom> &room, PongSide side,
+                      const string &packed) {
+  boost::mutex::scoped_lock lock(room->mutex());
+  RelayState state;
+  bool has_ack = false;
+  uint16_t ack = 0;
+  if (not room->input_decoder(side).Decode(packed, &state, &has_ack, &ack)) {
+    return;
+  }
+  if (has_ack) {
+    room->snapshot_encoder(side).Acknowledge(ack);
+  }
+  room->simulation().SetBarInput(side, state.Dequantize(kRelayBarX));
+}
+
+
+
+// relay_coalescing 모드에서 매 tick 마다 맡겨 둔 relay 를 보냅니다.
+bool FlushPendingRelays(const Ptr<MatchRoom> &room, int64_t /*tick*/) {
+  if (room->finished()) {
+    return false;
+  }
+
+  for (int i = kSideA; i <= kSideB; ++i) {
+    const PongSide to = static_cast<PongSide>(i);
+    Ptr<FunMessage> pbuf_message;
+    Json json_message;
+    if (not room->TakePendingRelay(to, &pbuf_message, &json_message)) {
+      continue;
+    }
+
+    Ptr<Session> session = room->GetSession(to);
+    if (not session || not session->IsTransportAttached()) {
+      RelayTrace::CountDrop(room->relay_stats());
+      continue;
+    }
+    if (pbuf_message) {
+      session->SendMessage("relay", pbuf_message, kDefaultEncryption,
+                           GetRelayProtocol(session));
     } else {
-      Ptr<FunMessage> msg(new FunMessage);
-      LobbyMatchReply *match_msg = msg->MutableExtension(lobby_match_repl);
-      match_msg->set_result("opponent disconnected");
-      session->SendMessage("match", msg);
+      session->SendMessage("relay", json_message, kDefaultEncryption,
+                           GetRelayProtocol(session));
+    }
+  }
+  return true;
+}
+
+
+// relay 를 상대에게 보냅니다. relay_coalescing 모드면 다음 tick 에 보내도록
+// 맡깁니다.
+template <typename MessageType>
+void RelayToOpponent(const Ptr<MatchRoom> &room, PongSide side,
+                     const Ptr<Session> &session, const MessageType &message) {
+  const PongSide opponent_side = GetOpponentSide(side);
+  room->spectators().SetLatest(side, message);
+
+  Rpc::PeerId remote_peer;
+  if (room->GetRemotePeer(opponent_side, &remote_peer)) {
+    RelayBridge::SendRelay(remote_peer, room->GetPlayerId(opponent_side),
+                           message);
+    RelayTrace::Record(room->relay_stats(), session, message, false);
+    return;
+  }
+
+  if (FLAGS_relay_coalescing) {
+    RelayTrace::Record(room->relay_stats(), session, message, false);
+    if (room->SetPendingRelay(opponent_side, message)) {
+      RelayTrace::CountMerge(room->relay_stats());
+    }
+    return;
+  }
+
+  // 보낸 뒤에는 엔진이 메시지를 고치므로 보내기 전에 기록합니다.
+  Ptr<Session> opponent_session = room->GetSession(opponent_side);
+  const bool attached =
+      opponent_session && opponent_session->IsTransportAttached();
+  RelayTrace::Record(room->relay_stats(), session, message, not attached);
+  if (attached) {
+    opponent_session->SendMessage("relay", message, kDefaultEncryption,
+                                  GetRelayProtocol(opponent_session));
+  }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 관전
+//
+// 관전자는 game 서버에 바로 접속해서 spectate 로 볼 플레이어의 id 를
+// 보냅니다. 플레이어 쪽은 최신 relay 를 한 번 직렬화해서 SpectatorChannel 에
+// 맡기고, 관전자 채널의 event tag 에서 tick 마다 그 바이트를 모든 관전자에게
+// 보냅니다.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// MatchTicker 에서 매 tick 마다 관전자 채널의 event tag 로 불립니다.
+template <EncodingScheme kEncoding>
+bool PublishSpectatorFrames(const Ptr<MatchRoom> &room, int64_t /*tick*/) {
+  SpectatorChannel &spectators = room->spectators();
+  if (room->finished()) {
+    if (spectators.subscriber_count() > 0) {
+      spectators.Publish("spectate",
+                         PongCodec<kEncoding>::SpectateResult("Finished"));
+    }
+    spectators.Close();
+    return false;
+  }
+  if (spectators.subscriber_count() == 0) {
+    return true;
+  }
+
+  for (int i = kSideA; i <= kSideB; ++i) {
+    const PongSide side = static_cast<PongSide>(i);
+    string relay;
+    if (not spectators.TakeLatest(side, &relay)) {
+      continue;
+    }
+    spectators.PublishRelay(kEncoding, side, relay);
+  }
+  return true;
+}
+
+
+template <EncodingScheme kEncoding>
+void HandleSpectateRequest(const Ptr<Session> &session,
+                           const string &player_id) {
+  if (not FLAGS_spectator_mode) {
+    session->SendMessage("spectate",
+                         PongCodec<kEncoding>::SpectateResult("Disabled"),
+                         kDefaultEncryption, GetControlProtocol());
+    return;
+  }
+
+  Ptr<MatchRoom> room = MatchRoom::FindByPlayerId(player_id);
+  if (not room || room->finished()) {
+    session->SendMessage("spectate",
+                         PongCodec<kEncoding>::SpectateResult("NotFound"),
+                         kDefaultEncryption, GetControlProtocol());
+    return;
+  }
+
+  if (not room->spectators().Subscribe(session,
+                                       FLAGS_max_spectators_per_match)) {
+    session->SendMessage("spectate",
+                         PongCodec<kEncoding>::SpectateResult("Full"),
+                         kDefaultEncryption, GetControlProtocol());
+    return;
+  }
+
+  LOG(INFO) << "Spectator joined: player_id=" << player_id
+            << ", session_id=" << session->id()
+            << ", spectators=" << room->spectators().subscriber_count();
+  session->SendMessage("spectate",
+                       PongCodec<kEncoding>::SpectateSucceeded(
+                           room->GetPlayerId(kSideA),
+                           room->GetPlayerId(kSideB)),
+                       kDefaultEncryption, GetControlProtocol());
+}
+
+
+
+// 세션 핸들러들을 인코딩에 맞춰 등록합니다.
+template <EncodingScheme kEncoding>
+void InstallSessionHandlers() {
+  HandlerRegistry::Install2(OnSessionOpened, OnSessionClosed<kEncoding>);
+  HandlerRegistry::RegisterTcpTransportDetachedHandler(
+      OnTransportTcpDetached<kEncoding>);
+  HandlerRegistry::RegisterWebSocketTransportDetachedHandler(
+      OnTransportWebsocketDetached<kEncoding>);
+}
+
+
+
+// latency_probe_interval_in_ms 가 지났으면 RTT 측정 메시지를 relay 와 같은
+// 채널로 보냅니다.
+template <EncodingScheme kEncoding>
+void MaybeSendLatencyProbe(const Ptr<MatchRoom> &room, PongSide side,
+                           const Ptr<Session> &session) {
+  const WallClock::Value now = WallClock::Now();
+  if (not room->latency(side).StartProbe(now)) {
+    return;
+  }
+  session->SendMessage(
+      "latency",
+      PongCodec<kEncoding>::LatencyProbe(LatencyEstimator::ToProbeTime(now)),
+      kDefaultEncryption, GetRelayProtocol(session));
+}
+
+
+// 받은 relay 를 걸러서 시뮬레이션에 반영하거나 상대에게 보냅니다. replay
+// benchmark 에서는 session 이 NULL 입니다.
+void ProcessRelay(const Ptr<MatchRoom> &room, PongSide side,
+                  const Ptr<Session> &session, const Json &message) {
+  // 받은 메시지를 그대로 넘깁니다. 내용은 보지 않습니다.
+  if (FLAGS_relay_pass_through) {
+    RelayToOpponent(room, side, session, message);
+    return;
+  }
+
+  // UDP 로 늦게 왔거나 중복된 relay 는 버립니다.
+  if (message.HasAttribute("seq") && message["seq"].IsInteger() &&
+      IsUnreliableRelay(session) &&
+      not room->relay_filter(side).Accept(message["seq"].GetInteger())) {
+    return;
+  }
+
+  if (FLAGS_authoritative_simulation) {
+    // 서버 권한 모드에서는 막대 위치만 입력으로 받습니다.
+    if (message.HasAttribute("barX")) {
+      ApplyBarInput(room, side, message["barX"].GetDouble());
+    }
+    return;
+  }
+
+  RelayToOpponent(room, side, session, message);
+}
+
+
+void ProcessRelay(const Ptr<MatchRoom> &room, PongSide side,
+                  const Ptr<Session> &session,
+                  const Ptr<FunMessage> &message) {
+  // 받은 메시지를 그대로 넘깁니다. 내용은 보지 않습니다.
+  if (FLAGS_relay_pass_through) {
+    RelayToOpponent(room, side, session, message);
+    return;
+  }
+
+  if (not message->HasExtension(game_relay)) {
+    return;
+  }
+  const GameRelayMessage &relay_msg = message->GetExtension(game_relay);
+
+  // 압축된 relay 는 sequence 검사도 클라이언트가 하므로 풀지 않고 그대로
+  // 넘깁니다.
+  if (relay_msg.has_packed() && not FLAGS_authoritative_simulation) {
+    RelayToOpponent(room, side, session, message);
+    return;
+  }
+
+  // UDP 로 늦게 왔거나 중복된 relay 는 버립니다.
+  if (relay_msg.has_seq() && IsUnreliableRelay(session) &&
+      not room->relay_filter(side).Accept(relay_msg.seq())) {
+    return;
+  }
+
+  if (FLAGS_authoritative_simulation) {
+    // 서버 권한 모드에서는 막대 위치만 입력으로 받습니다.
+    if (relay_msg.has_packed()) {
+      ApplyPackedInput(room, side, relay_msg.packed());
+    } else if (relay_msg.has_barx()) {
+      ApplyBarInput(room, side, relay_msg.barx());
+    }
+    return;
+  }
+
+  RelayToOpponent(room, side, session, message);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Replay benchmark
+//
+// 기록된 매치들의 relay 를 세션 없는 MatchRoom 으로 ProcessRelay() 에
+// 넣어서 처리량을 잽니다. 상대에게 보내는 비용은 빠집니다. 서버가 뜰 때가
+// 아니라 POST /v1/replay_benchmark/ 를 받을 때 API 스레드에서 돌리므로
+// 이벤트 스레드를 막지 않습니다.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+bool ParseRelay(const string &payload, Json *message) {
+  return message->FromString(payload);
+}
+
+
+bool ParseRelay(const string &payload, Ptr<FunMessage> *message) {
+  message->reset(new FunMessage);
+  return (*message)->ParseFromString(payload);
+}
+
+
+// POST /v1/replay_benchmark/
+template <EncodingScheme kEncoding>
+void OnReplayBenchmarkRequested(Ptr<http::Response> response,
+                                const http::Request &/*request*/,
+                                const ApiService::MatchResult &/*params*/) {
+  typedef typename PongCodec<kEncoding>::Message Message;
+
+  response->status_code = http::kBadRequest;
+  ReplayReader reader;
+  if (not reader.Open(FLAGS_replay_benchmark_file)) {
+    response->body = "cannot open the replay file";
+    return;
+  }
+  std::vector<Uuid> match_ids;
+  reader.GetMatchIds(&match_ids);
+
+  // 파일 읽기와 메시지 파싱은 재는 시간에서 뺍니다.
+  std::vector<std::vector<std::pair<PongSide, Message> > > matches;
+  size_t relay_count = 0;
+  for (size_t i = 0; i < match_ids.size(); ++i) {
+    std::vector<ReplayEvent> events;
+    if (not reader.ReadMatch(match_ids[i], &events)) {
+      response->body = "corrupted replay file";
+      return;
+    }
+    matches.push_back(std::vector<std::pair<PongSide, Message> >());
+    for (size_t j = 0; j < events.size(); ++j) {
+      if (events[j].type != kReplayRelay || events[j].encoding != kEncoding) {
+        continue;
+      }
+      Message message;
+      if (not ParseRelay(events[j].payload, &message)) {
+        continue;
+      }
+      matches.back().push_back(std::make_pair(events[j].side, message));
+      ++relay_count;
+    }
+  }
+
+  const WallClock::Value start = WallClock::Now();
+  for (size_t i = 0; i < matches.size(); ++i) {
+    Ptr<MatchRoom> room(new MatchRoom("replay_a", "replay_b"));
+    for (size_t j = 0; j < matches[i].size(); ++j) {
+      ProcessRelay(room, matches[i][j].first, Ptr<Session>(),
+                   matches[i][j].second);
+    }
+  }
+  const int64_t elapsed_us =
+      std::max<int64_t>((WallClock::Now() - start).total_microseconds(), 1);
+
+  LOG(INFO) << "Replay benchmark: file=" << FLAGS_replay_benchmark_file
+            << ", matches=" << matches.size() << ", relays=" << relay_count
+            << ", elapsed_ms=" << elapsed_us / 1000
+            << ", relays_per_sec=" << relay_count * 1000000 / elapsed_us;
+
+  Json result;
+  result["matches"] = static_cast<int64_t>(matches.size());
+  result["relays"] = static_cast<int64_t>(relay_count);
+  result["elapsed_ms"] = elapsed_us / 1000;
+  result["relays_per_sec"] =
+      static_cast<int64_t>(relay_count * 1000000 / elapsed_us);
+  response->status_code = http::kOk;
+  response->body = result.ToString();
+}
+
+}  // unnamed namesapce
+
+
+// 두 플레이어가 모두 준비되면 매치의 event tag 에서 불립니다. side 는
+// 마지막으로 준비된 쪽입니다.
+template <EncodingScheme kEncoding>
+void StartMatch(const Ptr<MatchRoom> &room, PongSide side) {
+  ReplayRecorder::Record(*room, side, kReplayStart);
+  LOG(INFO) << "Ready check passed: a=" << room->GetPlayerId(kSideA)
+            << ", b=" << room->GetPlayerId(kSideB) << ", elapsed_ms="
+            << GetReadyCheckElapsedInMsec(room);
+
+  // 다른 서버에 있는 플레이어에게는 그 서버가 시작 신호를 보냅니다.
+  Ptr<Session> sessions[2];
+  for (int i = kSideA; i <= kSideB; ++i) {
+    Rpc::PeerId remote_peer;
+    if (room->GetRemotePeer(static_cast<PongSide>(i), &remote_peer)) {
+      continue;
+    }
+    sessions[i] = room->GetSession(static_cast<PongSide>(i));
+    if (not sessions[i] || not sessions[i]->IsTransportAttached()) {
+      return;
     }
+  }
+
+  // 둘 다 준비가 되었습니다. 시작 신호를 보냅니다.
+  for (int i = kSideA; i <= kSideB; ++i) {
+    if (sessions[i]) {
+      sessions[i]->SendMessage("start", PongCodec<kEncoding>::GameStart(),
+                               kDefaultEncryption, GetControlProtocol());
+    }
+  }
+
+  if (FLAGS_authoritative_simulation) {
+    StartAuthoritativeMatch<kEncoding>(room);
+  } else if (FLAGS_relay_coalescing) {
+    MatchTicker::Add(bind(&FlushPendingRelays, room, _1), room->tag());
+  }
+  if (FLAGS_spectator_mode) {
+    MatchTicker::Add(bind(&PublishSpectatorFrames<kEncoding>, room, _1),
+                     room->spectators().tag());
+  }
+}
+
+
+template <EncodingScheme kEncoding>
+void HandleReadySignal(const Ptr<Session> &session) {
+  PongSide side = kSideA;
+  Ptr<MatchRoom> room = MatchRoom::Find(session, &side);
+  if (not room) {
+    LOG(WARNING) << "Ready signal without a match: session_id="
+                 << session->id();
     return;
   }
-  */
+
+  // 두 플레이어의 상태를 함께 바꾸므로 매치의 event tag 에서 처리합니다.
+  if (Event::GetCurrentEventTag() != room->tag()) {
+    Event::Invoke(bind(&HandleReadySignal<kEncoding>, session), room->tag());
+    return;
+  }
+
+  ReplayRecorder::Record(*room, side, kReplayReady);
+
+  // 상대가 다른 서버에 있으면 그 서버에도 알립니다.
+  const PongSide opponent_side = GetOpponentSide(side);
+  Rpc::PeerId remote_peer;
+  if (room->GetRemotePeer(opponent_side, &remote_peer)) {
+    RelayBridge::Send(remote_peer, PongBridgeItem::READY,
+                      room->GetPlayerId(opponent_side));
+  }
+
+  // 상대의 상태를 확인합니다.
+  if (not room->SetReady(side)) {
+    return;
+  }
+  StartMatch<kEncoding>(room, side);
 }
 
 
-void HandleResultRequest(const Ptr<Session> &session, EncodingScheme encoding) {
+template <EncodingScheme kEncoding>
+void HandleResultRequest(const Ptr<Session> &session) {
   // 패배한 쪽만 result를 보내도록 되어있습니다.
+  PongSide side = kSideA;
+  Ptr<MatchRoom> room = MatchRoom::Find(session, &side);
+  if (not room) {
+    LOG(WARNING) << "Result request without a match: session_id="
+                 << session->id();
+    return;
+  }
+
+  // 두 플레이어의 상태를 함께 바꾸므로 매치의 event tag 에서 처리합니다.
+  if (Event::GetCurrentEventTag() != room->tag()) {
+    Event::Invoke(bind(&HandleResultRequest<kEncoding>, session), room->tag());
+    return;
+  }
+
+  if (FLAGS_authoritative_simulation) {
+    // 서버 권한 모드에서는 서버가 승패를 판정합니다.
+    LOG(WARNING) << "Ignoring client result in authoritative mode: id="
+                 << room->GetPlayerId(side);
+    return;
+  }
 
-  // 내 아이디를 가져옵니다.
-  string my_id;
-  session->GetFromContext("id", &my_id);
+  // 이미 결과가 난 매치입니다.
+  if (not room->Finish()) {
+    return;
+  }
 
-  // 상대방의 아이디와 세션을 가져옵니다.
-  string opponent_id;
-  session->GetFromContext("opponent", &opponent_id);
-  Ptr<Session> opponent_session = AccountManager::FindLocalSession(opponent_id);
+  const PongSide opponent_side = GetOpponentSide(side);
+  ReplayRecorder::Record(*room, opponent_side, kReplayFinish,
+                         room->GetPlayerId(opponent_side));
+  FinishMatch<kEncoding>(room->GetSession(opponent_side),
+                         room->GetPlayerId(opponent_side),
+                         session, room->GetPlayerId(side));
+
+  // 상대가 다른 서버에 있으면 승리는 그 서버에서 알립니다.
+  Rpc::PeerId remote_peer;
+  if (room->GetRemotePeer(opponent_side, &remote_peer)) {
+    RelayBridge::Send(remote_peer, PongBridgeItem::RESULT,
+                      room->GetPlayerId(opponent_side));
+  }
+}
 
-  FetchAndUpdateMatchRecord(opponent_id, my_id);
 
-  if (opponent_session && opponent_session->IsTransportAttached()) {
-    // 상대에게 승리했음을 알립니다.
-    if (encoding == kJsonEncoding) {
-      opponent_session->SendMessage("result", MakeResponse("win"));
-    } else {
-      Ptr<FunMessage> msg(new FunMessage);
-      GameResultMessage *result_msg = msg->MutableExtension(game_result);
-      result_msg->set_result("win");
-      opponent_session->SendMessage("result", msg);
+////////////////////////////////////////////////////////////////////////////////
+//
+// 서버가 나뉜 매치
+//
+// 장애 후 재접속이나 redirect 경합으로 두 플레이어가 서로 다른 game 서버로
+// 가면 각 서버에 상대를 기다리는 방이 하나씩 생깁니다. 방이 만들어지고
+// split_match_check_delay_in_ms 가 지나도 상대가 오지 않으면 상대가 로그인한
+// 서버를 찾고, 다른 서버라면 RelayBridge 로 relay, ready, result 를
+// 주고받습니다. 서버 권한 모드는 시뮬레이션을 한 서버에서 해야 하므로
+// 이어 주지 않습니다.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+template <EncodingScheme kEncoding>
+void ScheduleSplitMatchCheck(const Ptr<MatchRoom> &room);
+
+
+template <EncodingScheme kEncoding>
+void OnOpponentLocated(const Ptr<MatchRoom> &room, PongSide side,
+                       const string &id, const Rpc::PeerId &peer_id) {
+  if (peer_id.is_nil() || peer_id == Rpc::GetSelfId()) {
+    // 아직 이 서버로 오는 중일 수 있습니다.
+    ScheduleSplitMatchCheck<kEncoding>(room);
+    return;
+  }
+  if (room->GetSession(side)) {
+    return;
+  }
+  room->SetRemotePeer(side, peer_id);
+  LOG(INFO) << "Split match bridged: id=" << id << ", peer_id=" << peer_id;
+}
+
+
+// 매치의 event tag 에서 불립니다.
+template <EncodingScheme kEncoding>
+void CheckSplitMatch(const Ptr<MatchRoom> &room) {
+  if (room->state() != kRoomReadyCheck) {
+    return;
+  }
+
+  // 한 쪽만 이 서버에 있고 다른 쪽은 아직 어디 있는지 모르는 방만 봅니다.
+  int local_count = 0;
+  int missing_side = -1;
+  for (int i = kSideA; i <= kSideB; ++i) {
+    const PongSide side = static_cast<PongSide>(i);
+    Rpc::PeerId remote_peer;
+    if (room->GetSession(side)) {
+      ++local_count;
+    } else if (not room->GetRemotePeer(side, &remote_peer)) {
+      missing_side = i;
     }
-    IncreaseCurWinCount(opponent_id);
+  }
+  if (local_count != 1 || missing_side < 0) {
+    return;
   }
 
-  // 패배 확인 메세지를 보냅니다.
-  if (encoding == kJsonEncoding) {
-    session->SendMessage("result", MakeResponse("lose"));
-  } else {
-    Ptr<FunMessage> msg(new FunMessage);
-    GameResultMessage *result_msg = msg->MutableExtension(game_result);
-    result_msg->set_result("lose");
-    session->SendMessage("result", msg);
+  const PongSide side = static_cast<PongSide>(missing_side);
+  AccountManager::LocateAsync(
+      room->GetPlayerId(side),
+      bind(&OnOpponentLocated<kEncoding>, room, side, _1, _2));
+}
+
+
+template <EncodingScheme kEncoding>
+void OnSplitMatchCheckTimerExpired(const Ptr<MatchRoom> &room,
+                                   const Timer::Id &/*timer_id*/,
+                                   const WallClock::Value &/*now*/) {
+  Event::Invoke(bind(&CheckSplitMatch<kEncoding>, room), room->tag());
+}
+
+
+template <EncodingScheme kEncoding>
+void ScheduleSplitMatchCheck(const Ptr<MatchRoom> &room) {
+  if (FLAGS_split_match_check_delay_in_ms <= 0 ||
+      FLAGS_authoritative_simulation) {
+    return;
   }
-  ResetCurWinCount(my_id);
+  Timer::ExpireAfter(
+      WallClock::FromMsec(FLAGS_split_match_check_delay_in_ms),
+      bind(&OnSplitMatchCheckTimerExpired<kEncoding>, room, _1, _2));
+}
 
-  // 각각 상대방에 대한 정보를 삭제합니다.
-  opponent_session->DeleteFromContext("opponent");
-  session->DeleteFromContext("opponent");
 
-  // 두 플레이어를 lobby서버로 이동시킵니다.
-  MoveServerByTag(opponent_session, "lobby");
-  MoveServerByTag(session, "lobby");
+// 새 방이 만들어지면 MatchRoom 이 부릅니다.
+template <EncodingScheme kEncoding>
+void OnMatchRoomCreated(const Ptr<MatchRoom> &room) {
+  StartReadyCheck<kEncoding>(room);
+  ScheduleSplitMatchCheck<kEncoding>(room);
+}
+
+
+// 상대 서버의 플레이어가 ready 를 보냈습니다. 매치의 event tag 에서
+// 불립니다.
+template <EncodingScheme kEncoding>
+void HandleRemoteReady(const Ptr<MatchRoom> &room, PongSide side) {
+  ReplayRecorder::Record(*room, side, kReplayReady);
+  if (not room->SetReady(side)) {
+    return;
+  }
+  StartMatch<kEncoding>(room, side);
+}
+
+
+// 상대 서버의 플레이어가 져서 이 서버의 winner 가 이겼습니다. 전적은 상대
+// 서버에서 기록했습니다. 매치의 event tag 에서 불립니다.
+template <EncodingScheme kEncoding>
+void HandleRemoteResult(const Ptr<MatchRoom> &room, PongSide winner) {
+  if (not room->Finish()) {
+    return;
+  }
+  const string &winner_id = room->GetPlayerId(winner);
+  ReplayRecorder::Record(*room, winner, kReplayFinish, winner_id);
+
+  Ptr<Session> winner_session = room->GetSession(winner);
+  if (not winner_session) {
+    return;
+  }
+  if (winner_session->IsTransportAttached()) {
+    winner_session->SendMessage(
+        "result", PongCodec<kEncoding>::GameResult(true), kDefaultEncryption,
+        GetControlProtocol());
+    IncreaseCurWinCount(winner_id);
+  }
+  ClearOpponent(winner_session);
+  MoveServerByTag(winner_session, "lobby");
+}
+
+
+// 상대 서버의 플레이어가 보낸 relay 를 이 서버의 to 에게 보냅니다.
+template <EncodingScheme kEncoding>
+void DeliverRemoteRelay(const Ptr<MatchRoom> &room, PongSide to,
+                        const string &payload) {
+  typename PongCodec<kEncoding>::Message message;
+  if (not ParseRelay(payload, &message)) {
+    return;
+  }
+  room->spectators().SetLatest(GetOpponentSide(to), message);
+
+  Ptr<Session> session = room->GetSession(to);
+  if (not session || not session->IsTransportAttached()) {
+    RelayTrace::CountDrop(room->relay_stats());
+    return;
+  }
+  session->SendMessage("relay", message, kDefaultEncryption,
+                       GetRelayProtocol(session));
+}
+
+
+// RelayBridge 로 다른 서버에서 메시지가 오면 불립니다.
+template <EncodingScheme kEncoding>
+void OnBridgeItemReceived(const Rpc::PeerId &sender,
+                          const PongBridgeItem &item) {
+  Ptr<MatchRoom> room = MatchRoom::FindByPlayerId(item.to_id());
+  if (not room) {
+    LOG_EVERY_N(WARNING, 100) << "Bridged message without a match: id="
+                              << item.to_id() << ", peer_id=" << sender;
+    return;
+  }
+  const PongSide side =
+      room->GetPlayerId(kSideA) == item.to_id() ? kSideA : kSideB;
+  const PongSide remote_side = GetOpponentSide(side);
+
+  // 이 서버가 먼저 상대를 찾지 못했어도 받은 쪽으로 이어 줍니다.
+  Rpc::PeerId remote_peer;
+  if (not room->GetRemotePeer(remote_side, &remote_peer) &&
+      not room->GetSession(remote_side)) {
+    room->SetRemotePeer(remote_side, sender);
+    LOG(INFO) << "Split match bridged: id=" << room->GetPlayerId(remote_side)
+              << ", peer_id=" << sender;
+  }
+
+  switch (item.type()) {
+    case PongBridgeItem::RELAY:
+      DeliverRemoteRelay<kEncoding>(room, side, item.payload());
+      break;
+    case PongBridgeItem::READY:
+      Event::Invoke(bind(&HandleRemoteReady<kEncoding>, room, remote_side),
+                    room->tag());
+      break;
+    case PongBridgeItem::RESULT:
+      Event::Invoke(bind(&HandleRemoteResult<kEncoding>, room, side),
+                    room->tag());
+      break;
+    case PongBridgeItem::FORFEIT:
+      Event::Invoke(bind(&ForfeitMatch<kEncoding>, room, remote_side),
+                    room->tag());
+      break;
+  }
 }
 
 
@@ -245,25 +1118,47 @@ void HandleResultRequest(const Ptr<Session> &session, EncodingScheme encoding) {
 
 // 게임 플레이 준비 메시지를 받으면 불립니다.
 void OnReadySignal(const Ptr<Session> &session, const Json &/*message*/) {
-  HandleReadySignal(session, kJsonEncoding);
+  HandleReadySignal<kJsonEncoding>(session);
 }
 
 
 // 릴레이 메시지를 받으면 불립니다. TCP, UDP 둘 다 이 함수로 처리합니다.
+// 매치 상태는 MatchRoom 이 잠그고 접근하므로 매치의 event tag 로 옮기지
+// 않고 보낸 세션의 event 에서 바로 처리합니다.
 void OnRelayRequested(const Ptr<Session> &session, const Json &message) {
-  string opponent_id;
-  session->GetFromContext("opponent", &opponent_id);
-  Ptr<Session> opponent_session = AccountManager::FindLocalSession(opponent_id);
-  if (opponent_session && opponent_session->IsTransportAttached()) {
-    LOG(INFO) << "message relay: session_id=" << session->id();
-    opponent_session->SendMessage("relay", message);
+  PongSide side = kSideA;
+  Ptr<MatchRoom> room = MatchRoom::Find(session, &side);
+  if (not room) {
+    return;
   }
+  MaybeSendLatencyProbe<kJsonEncoding>(room, side, session);
+  ReplayRecorder::Record(*room, side, message);
+  ProcessRelay(room, side, session, message);
+}
+
+
+// RTT 측정 메시지를 클라이언트가 돌려보내면 불립니다.
+void OnLatencyReplied(const Ptr<Session> &session, const Json &message) {
+  PongSide side = kSideA;
+  Ptr<MatchRoom> room = MatchRoom::Find(session, &side);
+  if (not room) {
+    return;
+  }
+  room->latency(side).AddSample(message["serverTime"].GetInteger(),
+                                WallClock::Now());
 }
 
 
 // 결과 요청 메시지를 받으면 불립니다.
 void OnResultRequested(const Ptr<Session> &session, const Json &/*message*/) {
-  HandleResultRequest(session, kJsonEncoding);
+  HandleResultRequest<kJsonEncoding>(session);
+}
+
+
+// 관전 요청 메시지를 받으면 불립니다.
+void OnSpectateRequested(const Ptr<Session> &session, const Json &message) {
+  HandleSpectateRequest<kJsonEncoding>(session,
+                                       message["playerId"].GetString());
 }
 
 
@@ -276,28 +1171,54 @@ void OnResultRequested(const Ptr<Session> &session, const Json &/*message*/) {
 // 게임 플레이 준비 메시지를 받으면 불립니다.
 void OnReadySignal2(
     const Ptr<Session> &session, const Ptr<FunMessage> &/*message*/) {
-  HandleReadySignal(session, kProtobufEncoding);
+  HandleReadySignal<kProtobufEncoding>(session);
 }
 
 
 // 릴레이 메시지를 받으면 불립니다. TCP, UDP 둘 다 이 함수로 처리합니다.
+// 매치 상태는 MatchRoom 이 잠그고 접근하므로 매치의 event tag 로 옮기지
+// 않고 보낸 세션의 event 에서 바로 처리합니다.
 void OnRelayRequested2(
     const Ptr<Session> &session, const Ptr<FunMessage> &message) {
-  string opponent_id;
-  session->GetFromContext("opponent", &opponent_id);
-  Ptr<Session> opponent_session = AccountManager::FindLocalSession(opponent_id);
-  if (opponent_session && opponent_session->IsTransportAttached()) {
-    LOG(INFO) << "message relay: session_id=" << session->id();
-    opponent_session->SendMessage("relay", message);
+  PongSide side = kSideA;
+  Ptr<MatchRoom> room = MatchRoom::Find(session, &side);
+  if (not room) {
+    return;
   }
+  MaybeSendLatencyProbe<kProtobufEncoding>(room, side, session);
+  ReplayRecorder::Record(*room, side, message);
+  ProcessRelay(room, side, session, message);
+}
+
 
+// RTT 측정 메시지를 클라이언트가 돌려보내면 불립니다.
+void OnLatencyReplied2(
+    const Ptr<Session> &session, const Ptr<FunMessage> &message) {
+  PongSide side = kSideA;
+  Ptr<MatchRoom> room = MatchRoom::Find(session, &side);
+  if (not room || not message->HasExtension(game_latency)) {
+    return;
+  }
+  room->latency(side).AddSample(
+      message->GetExtension(game_latency).server_time(), WallClock::Now());
 }
 
 
 // 결과 요청 메시지를 받으면 불립니다.
 void OnResultRequested2(
     const Ptr<Session> &session, const Ptr<FunMessage> &/*message*/) {
-  HandleResultRequest(session, kProtobufEncoding);
+  HandleResultRequest<kProtobufEncoding>(session);
+}
+
+
+// 관전 요청 메시지를 받으면 불립니다.
+void OnSpectateRequested2(
+    const Ptr<Session> &session, const Ptr<FunMessage> &message) {
+  if (not message->HasExtension(game_spectate_req)) {
+    return;
+  }
+  HandleSpectateRequest<kProtobufEncoding>(
+      session, message->GetExtension(game_spectate_req).player_id());
 }
 
 
@@ -317,24 +1238,75 @@ void RegisterGameEventHandlers() {
   if (encoding == kUnknownEncoding) {
     LOG(FATAL) << "Either JSON or Protobuf must be enabled.";
   }
+  if (FLAGS_relay_pass_through && FLAGS_authoritative_simulation) {
+    LOG(FATAL) << "Cannot set both relay_pass_through and "
+               << "authoritative_simulation.";
+  }
+  if (FLAGS_simulation_tick_in_ms < 1) {
+    LOG(FATAL) << "simulation_tick_in_ms must be at least 1: "
+               << FLAGS_simulation_tick_in_ms;
+  }
+  if (FLAGS_snapshot_interval_in_ticks < 1) {
+    LOG(FATAL) << "snapshot_interval_in_ticks must be at least 1: "
+               << FLAGS_snapshot_interval_in_ticks;
+  }
 
-  HandlerRegistry::Install2(
-      OnSessionOpened, bind(&OnSessionClosed, _1, _2, encoding));
-  HandlerRegistry::RegisterTcpTransportDetachedHandler(
-      bind(&OnTransportTcpDetached, _1, encoding));
-  HandlerRegistry::RegisterWebSocketTransportDetachedHandler(
-      bind(&OnTransportWebsocketDetached, _1, encoding));
+  RelayTrace::Install();
+  LatencyStats::Install();
+  ReplayRecorder::Start();
+  GameServerLoad::StartReporting();
+
+  if (FLAGS_authoritative_simulation || FLAGS_relay_coalescing ||
+      FLAGS_spectator_mode) {
+    LOG(INFO) << "Authoritative simulation: "
+              << FLAGS_authoritative_simulation
+              << ", relay coalescing: " << FLAGS_relay_coalescing
+              << ", spectator mode: " << FLAGS_spectator_mode;
+    MatchTicker::Start(WallClock::FromMsec(FLAGS_simulation_tick_in_ms));
+  }
 
   if (encoding == kJsonEncoding) {
+    InstallSessionHandlers<kJsonEncoding>();
+    MatchRoom::RegisterCreatedHandler(OnMatchRoomCreated<kJsonEncoding>);
+    RelayBridge::Install(WallClock::FromMsec(FLAGS_simulation_tick_in_ms),
+                         OnBridgeItemReceived<kJsonEncoding>);
+
     // JSON 인 경우 메시지 핸들러.
     HandlerRegistry::Register("ready", OnReadySignal);
     HandlerRegistry::Register("relay", OnRelayRequested);
     HandlerRegistry::Register("result", OnResultRequested);
+    JsonSchema latency_msg(
+        JsonSchema::kObject,
+        JsonSchema("serverTime", JsonSchema::kInteger, true));
+    HandlerRegistry::Register("latency", OnLatencyReplied, latency_msg);
+    JsonSchema spectate_msg(
+        JsonSchema::kObject,
+        JsonSchema("playerId", JsonSchema::kString, true));
+    HandlerRegistry::Register("spectate", OnSpectateRequested, spectate_msg);
+
+    if (not FLAGS_replay_benchmark_file.empty()) {
+      ApiService::RegisterHandler(
+          http::kPost, boost::regex("/v1/replay_benchmark/"),
+          OnReplayBenchmarkRequested<kJsonEncoding>);
+    }
   } else if (encoding == kProtobufEncoding) {
+    InstallSessionHandlers<kProtobufEncoding>();
+    MatchRoom::RegisterCreatedHandler(OnMatchRoomCreated<kProtobufEncoding>);
+    RelayBridge::Install(WallClock::FromMsec(FLAGS_simulation_tick_in_ms),
+                         OnBridgeItemReceived<kProtobufEncoding>);
+
     // Protobuf 인 경우 메시지 핸들러 
     HandlerRegistry::Register2("ready", OnReadySignal2);
     HandlerRegistry::Register2("relay", OnRelayRequested2);
     HandlerRegistry::Register2("result", OnResultRequested2);
+    HandlerRegistry::Register2("latency", OnLatencyReplied2);
+    HandlerRegistry::Register2("spectate", OnSpectateRequested2);
+
+    if (not FLAGS_replay_benchmark_file.empty()) {
+      ApiService::RegisterHandler(
+          http::kPost, boost::regex("/v1/replay_benchmark/"),
+          OnReplayBenchmarkRequested<kProtobufEncoding>);
+    }
   }
 }
 
@@ -0,0 +1,245 @@
+﻿#include "game_server_load.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+
+#include "match_room.h"
+#include "peer_directory.h"
+
+#include "pong_rpc_messages.pb.h"
+
+
+DECLARE_string(app_flavor);
+
+DEFINE_int32(game_load_report_interval_in_ms, 1000,
+             "Game servers report their load to matchmakers at this "
+             "interval. Reports older than 3 intervals are ignored");
+
+
+namespace pong {
+
+namespace {
+
+const char kLoadReportType[] = "game_server_load";
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// game 서버
+//
+////////////////////////////////////////////////////////////////////////////////
+
+boost::atomic<int64_t> the_session_count(0);
+
+// 앞 보고 때의 CPU 시간과 시각입니다. 타이머에서만 씁니다.
+int64_t the_last_cpu_usec = 0;
+WallClock::Value the_last_report_time;
+
+
+int64_t GetProcessCpuTimeInUsec() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+
+// 앞 보고 이후 이 프로세스가 머신 전체 CPU 중 얼마를 썼는지 계산합니다.
+int32_t GetCpuPercent(const WallClock::Value &now) {
+  const int64_t cpu_usec = GetProcessCpuTimeInUsec();
+  const int64_t wall_usec = (now - the_last_report_time).total_microseconds();
+  const int64_t cores = std::max(boost::thread::hardware_concurrency(), 1u);
+  int32_t percent = 0;
+  if (the_last_cpu_usec > 0 && wall_usec > 0) {
+    percent = static_cast<int32_t>(
+        (cpu_usec - the_last_cpu_usec) * 100 / (wall_usec * cores));
+  }
+  the_last_cpu_usec = cpu_usec;
+  the_last_report_time = now;
+  return std::max(0, std::min(100, percent));
+}
+
+
+void ReportLoad(const Timer::Id &/*timer_id*/, const WallClock::Value &now) {
+  std::vector<Rpc::PeerId> targets;
+  std::vector<Rpc::PeerId> lobbies;
+  PeerDirectory::GetPeers("matchmaker", &targets);
+  PeerDirectory::GetPeers("lobby", &lobbies);
+  targets.insert(targets.end(), lobbies.begin(), lobbies.end());
+
+  GameServerLoadMessage load;
+  load.set_session_count(the_session_count.load());
+  load.set_match_count(MatchRoom::count());
+  load.set_cpu_percent(GetCpuPercent(now));
+
+  // 보낼 때 엔진이 메시지를 고치므로 대상마다 새로 만듭니다.
+  for (size_t i = 0; i < targets.size(); ++i) {
+    Ptr<FunRpcMessage> request(new FunRpcMessage);
+    request->set_type(kLoadReportType);
+    request->MutableExtension(game_server_load)->CopyFrom(load);
+    Rpc::Call(targets[i], request);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// matchmaker 서버
+//
+////////////////////////////////////////////////////////////////////////////////
+
+struct GameServerEntry {
+  Rpc::PeerId id;
+  int64_t session_count;
+  int64_t match_count;
+  int32_t cpu_percent;
+  // 마지막 보고 이후 이 서버에 배정한 매치 수입니다. 다음 보고까지는 보고된
+  // 값에 더해서 봅니다.
+  int64_t pending_match_count;
+  WallClock::Value updated_time;
+};
+
+// game 서버 수가 많지 않으므로 배열을 순회합니다.
+boost::mutex the_server_mutex;
+std::vector<GameServerEntry> the_game_servers;
+
+
+// 작을수록 여유가 있습니다. 매치는 시뮬레이션과 relay tick 이 있으므로 세션
+// 수에 더해 한 번 더 셉니다. 이를 CPU 사용률로 가중합니다.
+int64_t GetLoadScore(const GameServerEntry &entry) {
+  const int64_t matches = entry.match_count + entry.pending_match_count;
+  const int64_t sessions = entry.session_count + 2 * entry.pending_match_count;
+  return (sessions + 2 * matches) * (100 + entry.cpu_percent);
+}
+
+
+void OnLoadReported(const Rpc::PeerId &sender, const Rpc::Xid &/*xid*/,
+                    const Ptr<const FunRpcMessage> &request,
+                    const Rpc::ReadyBack &finisher) {
+  // 응답은 보내지 않습니다.
+  finisher(Ptr<FunRpcMessage>());
+
+  if (not request->HasExtension(game_server_load)) {
+    return;
+  }
+  const GameServerLoadMessage &load = request->GetExtension(game_server_load);
+
+  // lobby 서버는 PeerDirectory 에서 game 서버를 고를 때만 씁니다.
+  GameServerEntry reported;
+  reported.session_count = load.session_count();
+  reported.match_count = load.match_count();
+  reported.cpu_percent = load.cpu_percent();
+  reported.pending_match_count = 0;
+  PeerDirectory::UpdateLoad(sender, GetLoadScore(reported));
+  if (FLAGS_app_flavor != "matchmaker") {
+    return;
+  }
+
+  boost::mutex::scoped_lock lock(the_server_mutex);
+  GameServerEntry *entry = NULL;
+  for (size_t i = 0; i < the_game_servers.size(); ++i) {
+    if (the_game_servers[i].id == sender) {
+      entry = &the_game_servers[i];
+      break;
+    }
+  }
+  if (not entry) {
+    LOG(INFO) << "Game server joined: peer_id=" << sender;
+    the_game_servers.push_back(GameServerEntry());
+    entry = &the_game_servers.back();
+    entry->id = sender;
+  }
+  entry->session_count = load.session_count();
+  entry->match_count = load.match_count();
+  entry->cpu_percent = load.cpu_percent();
+  entry->pending_match_count = 0;
+  entry->updated_time = WallClock::Now();
+}
+
+}  // unnamed namespace
+
+
+void GameServerLoad::StartReporting() {
+  the_last_report_time = WallClock::Now();
+  Timer::ExpireRepeatedly(
+      WallClock::FromMsec(FLAGS_game_load_report_interval_in_ms), ReportLoad);
+}
+
+
+void GameServerLoad::AddSession() {
+  the_session_count.fetch_add(1, boost::memory_order_relaxed);
+}
+
+
+void GameServerLoad::RemoveSession() {
+  the_session_count.fetch_sub(1, boost::memory_order_relaxed);
+}
+
+
+void GameServerLoad::InstallCollector() {
+  Rpc::RegisterHandler(kLoadReportType, OnLoadReported);
+}
+
+
+Rpc::PeerId GameServerLoad::PickGameServer() {
+  const WallClock::Value now = WallClock::Now();
+  const WallClock::Duration expiry =
+      WallClock::FromMsec(FLAGS_game_load_report_interval_in_ms * 3);
+
+  {
+    boost::mutex::scoped_lock lock(the_server_mutex);
+    GameServerEntry *best = NULL;
+    int64_t best_score = 0;
+    int64_t ties = 0;
+    for (size_t i = 0; i < the_game_servers.size(); ++i) {
+      GameServerEntry &entry = the_game_servers[i];
+      if (now - entry.updated_time > expiry) {
+        continue;
+      }
+      const int64_t score = GetLoadScore(entry);
+      if (not best || score < best_score) {
+        best = &entry;
+        best_score = score;
+        ties = 1;
+      } else if (score == best_score &&
+                 RandomGenerator::GenerateNumber(0, ties++) == 0) {
+        // 부하가 같으면 고르게 나눕니다.
+        best = &entry;
+      }
+    }
+    if (best) {
+      ++best->pending_match_count;
+      return best->id;
+    }
+  }
+
+  LOG_EVERY_N(WARNING, 100) << "No game server load reports. "
+                            << "Picking a game server randomly";
+  return PeerDirectory::Pick("game");
+}
+
+
+void GameServerLoad::ReleaseGameServer(const Rpc::PeerId &server) {
+  boost::mutex::scoped_lock lock(the_server_mutex);
+  for (size_t i = 0; i < the_game_servers.size(); ++i) {
+    GameServerEntry &entry = the_game_servers[i];
+    if (entry.id != server) {
+      continue;
+    }
+    // 그 사이에 보고를 받았으면 이미 0 입니다.
+    if (entry.pending_match_count > 0) {
+      --entry.pending_match_count;
+    }
+    return;
+  }
+}
+
+}  // namespace pong
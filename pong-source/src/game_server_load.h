@@ -0,0 +1,39 @@
+﻿#ifndef SRC_GAME_SERVER_LOAD_H_
+#define SRC_GAME_SERVER_LOAD_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 매치를 어느 game 서버에서 할지 부하를 보고 정합니다.
+//
+// game 서버는 세션 수, 매치 수, CPU 사용률을 주기적으로 모든 matchmaker,
+// lobby 서버에 RPC 로 보냅니다. matchmaker 서버는 매치가 성사될 때 부하가
+// 가장 적은 game 서버를 한 번 고르고 매치 context 의 "server" 에 담습니다.
+// 두 플레이어의 lobby 서버는 그 값을 보고 같은 game 서버로 보냅니다.
+// lobby 서버는 받은 부하를 PeerDirectory 에 넘겨 game 서버를 직접 고를 때
+// 씁니다.
+class GameServerLoad {
+ public:
+  // game 서버에서 부릅니다.
+  static void StartReporting();
+  // game 서버에서 세션이 열리고 닫힐 때 부릅니다.
+  static void AddSession();
+  static void RemoveSession();
+
+  // matchmaker, lobby 서버에서 부릅니다.
+  static void InstallCollector();
+  // 부하가 가장 적은 game 서버를 고릅니다. 받은 보고가 없으면 무작위로
+  // 고릅니다. 고른 서버에는 다음 보고 때까지 매치 하나를 더 셉니다.
+  static Rpc::PeerId PickGameServer();
+  // 매치가 성사되지 않아 PickGameServer() 로 고른 서버를 쓰지 않게 되면
+  // 더해 둔 매치를 뺍니다.
+  static void ReleaseGameServer(const Rpc::PeerId &server);
+};
+
+}  // namespace pong
+
+#endif  // SRC_GAME_SERVER_LOAD_H_
@@ -0,0 +1,209 @@
+﻿#include "latency_estimator.h"
+
+#include <algorithm>
+
+#include <boost/atomic.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+
+
+DEFINE_int32(latency_probe_interval_in_ms, 1000,
+             "Sends an in-band latency probe to a session at most once per "
+             "this interval. 0 disables probing");
+
+
+namespace pong {
+
+namespace {
+
+const boost::posix_time::ptime kUnixEpoch(boost::gregorian::date(1970, 1, 1));
+
+// 이보다 큰 샘플은 오래 전 probe 의 응답이거나 잘못된 값이므로 버립니다.
+const int64_t kMaxRttInUsec = 10 * 1000 * 1000;
+
+boost::atomic<uint64_t> the_total_buckets[kLatencyBucketCount];
+boost::atomic<int64_t> the_total_rejected_count(0);
+
+
+// 4 미만은 값 그대로, 그 이상은 최상위 비트 위치(옥타브)와 그 아래 두
+// 비트로 칸을 정합니다.
+size_t GetBucketIndex(int64_t value) {
+  if (value < 4) {
+    return static_cast<size_t>(std::max<int64_t>(value, 0));
+  }
+  int octave = 0;
+  for (uint64_t v = value; v > 1; v >>= 1) {
+    ++octave;
+  }
+  const size_t index =
+      (octave - 1) * 4 + static_cast<size_t>((value >> (octave - 2)) & 3);
+  return std::min(index, kLatencyBucketCount - 1);
+}
+
+
+// 칸의 가운데 값입니다.
+int64_t GetBucketValue(size_t index) {
+  if (index < 4) {
+    return index;
+  }
+  const int octave = index / 4 + 1;
+  const int64_t width = 1LL << (octave - 2);
+  return (4 + index % 4) * width + width / 2;
+}
+
+
+template <typename Bucket>
+int64_t GetPercentile(const Bucket *buckets, int64_t count, double quantile) {
+  if (count <= 0) {
+    return 0;
+  }
+  const int64_t rank = std::max<int64_t>(
+      1, static_cast<int64_t>(quantile * count + 0.5));
+  int64_t seen = 0;
+  for (size_t i = 0; i < kLatencyBucketCount; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return GetBucketValue(i);
+    }
+  }
+  return GetBucketValue(kLatencyBucketCount - 1);
+}
+
+
+// GET /v1/latency/
+void OnLatencyRequested(Ptr<http::Response> response,
+                        const http::Request &/*request*/,
+                        const ApiService::MatchResult &/*params*/) {
+  response->status_code = http::kOk;
+  response->body = LatencyStats::Dump().ToString();
+}
+
+}  // unnamed namespace
+
+
+LatencyEstimator::LatencyEstimator()
+    : add_to_total_(true), smoothed_rtt_(0), rtt_variation_(0),
+      sample_count_(0) {
+  std::fill(buckets_, buckets_ + kLatencyBucketCount, 0);
+}
+
+
+LatencyEstimator::LatencyEstimator(bool add_to_total)
+    : add_to_total_(add_to_total), smoothed_rtt_(0), rtt_variation_(0),
+      sample_count_(0) {
+  std::fill(buckets_, buckets_ + kLatencyBucketCount, 0);
+}
+
+
+bool LatencyEstimator::StartProbe(const WallClock::Value &now) {
+  if (FLAGS_latency_probe_interval_in_ms <= 0) {
+    return false;
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  if (not last_probe_time_.is_not_a_date_time() &&
+      (now - last_probe_time_).total_milliseconds() <
+          FLAGS_latency_probe_interval_in_ms) {
+    return false;
+  }
+  last_probe_time_ = now;
+  return true;
+}
+
+
+void LatencyEstimator::AddSample(int64_t sent_time_in_usec,
+                                 const WallClock::Value &now) {
+  const int64_t rtt = ToProbeTime(now) - sent_time_in_usec;
+  if (rtt < 0 || rtt > kMaxRttInUsec) {
+    if (add_to_total_) {
+      the_total_rejected_count.fetch_add(1, boost::memory_order_relaxed);
+    }
+    return;
+  }
+
+  const size_t index = GetBucketIndex(rtt);
+  if (add_to_total_) {
+    the_total_buckets[index].fetch_add(1, boost::memory_order_relaxed);
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+  if (sample_count_ == 0) {
+    smoothed_rtt_ = rtt;
+    rtt_variation_ = rtt / 2;
+  } else {
+    // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+    const int64_t error = smoothed_rtt_ - rtt;
+    rtt_variation_ += ((error < 0 ? -error : error) - rtt_variation_) / 4;
+    smoothed_rtt_ += (rtt - smoothed_rtt_) / 8;
+  }
+  ++sample_count_;
+  ++buckets_[index];
+}
+
+
+int64_t LatencyEstimator::smoothed_rtt_in_usec() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return smoothed_rtt_;
+}
+
+
+int64_t LatencyEstimator::jitter_in_usec() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return rtt_variation_;
+}
+
+
+int64_t LatencyEstimator::GetPercentile(double quantile) const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return pong::GetPercentile(buckets_, sample_count_, quantile);
+}
+
+
+int64_t LatencyEstimator::sample_count() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return sample_count_;
+}
+
+
+Json LatencyEstimator::ToJson() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  Json json;
+  json["samples"] = sample_count_;
+  json["srtt_in_usec"] = smoothed_rtt_;
+  json["jitter_in_usec"] = rtt_variation_;
+  json["p50_in_usec"] = pong::GetPercentile(buckets_, sample_count_, 0.5);
+  json["p99_in_usec"] = pong::GetPercentile(buckets_, sample_count_, 0.99);
+  return json;
+}
+
+
+int64_t LatencyEstimator::ToProbeTime(const WallClock::Value &now) {
+  return (now - kUnixEpoch).total_microseconds();
+}
+
+
+void LatencyStats::Install() {
+  ApiService::RegisterHandler(
+      http::kGet, boost::regex("/v1/latency/"), OnLatencyRequested);
+}
+
+
+Json LatencyStats::Dump() {
+  uint64_t buckets[kLatencyBucketCount];
+  int64_t count = 0;
+  for (size_t i = 0; i < kLatencyBucketCount; ++i) {
+    buckets[i] = the_total_buckets[i].load(boost::memory_order_relaxed);
+    count += buckets[i];
+  }
+
+  Json dump;
+  dump["samples"] = count;
+  dump["rejected"] = the_total_rejected_count.load();
+  dump["probe_interval_in_ms"] = FLAGS_latency_probe_interval_in_ms;
+  dump["p50_in_usec"] = GetPercentile(buckets, count, 0.5);
+  dump["p90_in_usec"] = GetPercentile(buckets, count, 0.9);
+  dump["p99_in_usec"] = GetPercentile(buckets, count, 0.99);
+  dump["p999_in_usec"] = GetPercentile(buckets, count, 0.999);
+  return dump;
+}
+
+}  // namespace pong
@@ -0,0 +1,67 @@
+﻿#ifndef SRC_LATENCY_ESTIMATOR_H_
+#define SRC_LATENCY_ESTIMATOR_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 1us 부터 약 67 초까지를 옥타브마다 4 칸으로 나눈 히스토그램입니다.
+// 분위수의 상대 오차는 12.5% 이내입니다.
+const size_t kLatencyBucketCount = 104;
+
+
+// 세션 하나의 왕복 지연 시간(RTT) 추정기입니다.
+//
+// 서버가 relay 와 같은 채널로 "latency" 메시지에 서버 시각을 담아 보내고,
+// 클라이언트가 그 값을 그대로 돌려보내면 그 차이를 샘플로 씁니다. 평균과
+// 지터는 TCP 와 같은 EWMA(RFC 6298)로, 분위수는 히스토그램으로 구합니다.
+// 샘플은 전체 통계(GET /v1/latency/)에도 함께 더해집니다.
+class LatencyEstimator {
+ public:
+  LatencyEstimator();
+  // add_to_total 이 false 면 샘플을 전체 통계에 더하지 않습니다. 클라이언트가
+  // 아닌 서버 사이의 지연 시간을 잴 때 씁니다.
+  explicit LatencyEstimator(bool add_to_total);
+
+  // latency_probe_interval_in_ms 가 지났으면 probe 를 보낸 것으로 기록하고
+  // true 를 반환합니다. probe 는 유실될 수 있으므로 응답을 기다리지 않습니다.
+  bool StartProbe(const WallClock::Value &now);
+  // probe 에 담아 보낸 시각이 돌아오면 불립니다.
+  void AddSample(int64_t sent_time_in_usec, const WallClock::Value &now);
+
+  int64_t smoothed_rtt_in_usec() const;
+  int64_t jitter_in_usec() const;
+  // quantile 은 0 과 1 사이입니다. 샘플이 없으면 0 을 반환합니다.
+  int64_t GetPercentile(double quantile) const;
+  int64_t sample_count() const;
+
+  Json ToJson() const;
+
+  // probe 에 담을 서버 시각입니다.
+  static int64_t ToProbeTime(const WallClock::Value &now);
+
+ private:
+  const bool add_to_total_;
+  mutable boost::mutex mutex_;
+  WallClock::Value last_probe_time_;
+  int64_t smoothed_rtt_;
+  int64_t rtt_variation_;
+  int64_t sample_count_;
+  uint32_t buckets_[kLatencyBucketCount];
+};
+
+
+// 모든 세션의 RTT 샘플을 모은 통계입니다.
+class LatencyStats {
+ public:
+  // GET /v1/latency/ 를 등록합니다.
+  static void Install();
+  static Json Dump();
+};
+
+}  // namespace pong
+
+#endif  // SRC_LATENCY_ESTIMATOR_H_
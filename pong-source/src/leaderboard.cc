@@ -1,13 +1,26 @@
 ﻿#include "leaderboard.h"
 
+#include <utility>
+#include <vector>
+
+#include <boost/unordered_set.hpp>
 #include <funapi.h>
 #include <glog/logging.h>
 
+#include "pong_codec.h"
+
 #include "pong_messages.pb.h"
 
 
 DECLARE_string(app_flavor);
 
+DEFINE_int32(leaderboard_batch_window_in_ms, 20,
+             "Collects current streak lookups for this long and resolves "
+             "them in one leaderboard query. 0 queries each lookup alone");
+DEFINE_int32(leaderboard_batch_size, 100,
+             "Sends a batched streak lookup early once it has this many "
+             "players");
+
 
 // 현재 연승 기록
 static const char *kPlayerCurWinCount = "player_cur_wincount";
@@ -23,26 +36,132 @@ static const char *kServiceProvider = "test_kServiceProvider";
 
 namespace pong {
 
-// 리더보드에 기록된 최대 연승을 가져옵니다.
-int GetCurrentRecordById(const string &id, bool single) {
-  // 랭킹 조회 요청을 만듭니다.
+namespace {
+
+// 한 리더보드에 대해 모은 현재 연승 기록 조회입니다.
+struct RecordBatch {
+  explicit RecordBatch(bool _single) : single(_single) {}
+
+  const bool single;
+  std::vector<std::pair<string, CurrentRecordHandler> > waiters;
+};
+
+// 일반/싱글 모드 리더보드마다 모으는 중인 batch 입니다.
+boost::mutex the_batch_mutex;
+Ptr<RecordBatch> the_pending_batches[2];
+
+
+// 현재 연승 기록을 조회한 후 불립니다.
+void OnRecordBatchQueried(
+    const Ptr<RecordBatch> &batch, const LeaderboardQueryRequest &request,
+    const LeaderboardQueryResponse &response, const bool &error) {
+  if (error) {
+    LOG(ERROR) << "leaderboard system error: players="
+               << batch->waiters.size();
+    for (size_t i = 0; i < batch->waiters.size(); ++i) {
+      batch->waiters[i].second(false, 0);
+    }
+    return;
+  }
+
+  // 기록이 없는 플레이어는 응답에 없으므로 0 입니다.
+  boost::unordered_map<string, int> records;
+  for (size_t i = 0; i < response.records.size(); ++i) {
+    records[response.records[i].player_account.id()] =
+        response.records[i].score;
+  }
+
+  // 플레이어마다 현재 연승 수를 넘깁니다.
+  for (size_t i = 0; i < batch->waiters.size(); ++i) {
+    boost::unordered_map<string, int>::const_iterator itr =
+        records.find(batch->waiters[i].first);
+    batch->waiters[i].second(true, itr != records.end() ? itr->second : 0);
+  }
+}
+
+
+// 모은 플레이어들을 한 번에 조회합니다. 한 명이면 그 플레이어 주변을,
+// 여러 명이면 첫 플레이어의 친구 랭킹으로 나머지를 함께 조회합니다.
+void SendRecordBatch(const Ptr<RecordBatch> &batch) {
+  BOOST_ASSERT(not batch->waiters.empty());
+  const char *leaderboard_id =
+      batch->single ? kPlayerCurWinCountSingle : kPlayerCurWinCount;
+  const string &player_id = batch->waiters[0].first;
+
+  PlayerAccountVector friend_list;
+  boost::unordered_set<string> seen;
+  seen.insert(player_id);
+  for (size_t i = 1; i < batch->waiters.size(); ++i) {
+    if (seen.insert(batch->waiters[i].first).second) {
+      friend_list.push_back(
+          PlayerAccount(kServiceProvider, batch->waiters[i].first));
+    }
+  }
+
+  const LeaderboardQueryResponseHandler handler =
+      bind(&OnRecordBatchQueried, batch, _1, _2, _3);
+  if (friend_list.empty()) {
+    LeaderboardQueryRequest request(
+        leaderboard_id, kServiceProvider, player_id, kAllTime,
+        LeaderboardRange(LeaderboardRange::kNearby, 0, 0));
+    GetLeaderboard(request, handler);
+    return;
+  }
+
   LeaderboardQueryRequest request(
-      single ? kPlayerCurWinCountSingle : kPlayerCurWinCount, kServiceProvider, id, kAllTime,
-      LeaderboardRange(LeaderboardRange::kNearby, 0, 0));
+      leaderboard_id, kServiceProvider, player_id, friend_list, kAllTime,
+      LeaderboardRange(LeaderboardRange::kFriends, 0, friend_list.size()));
+  GetLeaderboard(request, handler);
+}
 
-  // 랭킹을 조회합니다.
-  // TODO: 비동기로 변경
-  LeaderboardQueryResponse response;
-  if (not GetLeaderboardSync(request, &response)) {
-    LOG(ERROR) << "leaderboard system error";
-    return 0;
+
+// batch 를 모으기 시작할 때 건 타이머입니다. 크기가 차서 먼저 보냈으면
+// 아무 것도 하지 않습니다.
+void OnRecordBatchExpired(const Ptr<RecordBatch> &batch,
+                          const Timer::Id &/*timer_id*/,
+                          const WallClock::Value &/*now*/) {
+  {
+    boost::mutex::scoped_lock lock(the_batch_mutex);
+    Ptr<RecordBatch> &pending = the_pending_batches[batch->single ? 1 : 0];
+    if (pending != batch) {
+      return;
+    }
+    pending.reset();
   }
+  SendRecordBatch(batch);
+}
+
+}  // unnamed namespace
 
-  // 현재 연승 수를 반환합니다.
-  if (response.records.empty()) {
-    return 0;
+
+// 리더보드에 기록된 최대 연승을 가져옵니다.
+void GetCurrentRecordById(const string &id, bool single,
+                          const CurrentRecordHandler &handler) {
+  Ptr<RecordBatch> batch;
+  Ptr<RecordBatch> full_batch;
+  {
+    boost::mutex::scoped_lock lock(the_batch_mutex);
+    Ptr<RecordBatch> &pending = the_pending_batches[single ? 1 : 0];
+    if (not pending) {
+      pending.reset(new RecordBatch(single));
+      batch = pending;
+    }
+    pending->waiters.push_back(std::make_pair(id, handler));
+    if (FLAGS_leaderboard_batch_window_in_ms <= 0 ||
+        pending->waiters.size() >=
+            static_cast<size_t>(FLAGS_leaderboard_batch_size)) {
+      full_batch.swap(pending);
+    }
+  }
+
+  // 랭킹을 조회합니다.
+  if (full_batch) {
+    SendRecordBatch(full_batch);
+  } else if (batch) {
+    Timer::ExpireAfter(
+        WallClock::FromMsec(FLAGS_leaderboard_batch_window_in_ms),
+        bind(&OnRecordBatchExpired, batch, _1, _2));
   }
-  return response.records[0].score;
 }
 
 
@@ -155,52 +274,36 @@ void ResetCurWinCount(const string &id, bool single) {
 
 
 // 1 일 최대 연승 기록 TOP 8 을 가져온 후 불립니다.
+template <EncodingScheme kEncoding>
 void OnGetTopEightList(
     const Ptr<Session> session, const LeaderboardQueryRequest &request,
-    const LeaderboardQueryResponse &response, const bool &error,
-    EncodingScheme encoding, bool single) {
+    const LeaderboardQueryResponse &response, const bool &error, bool single) {
   if (error) {
     LOG(ERROR) << "Failed to query top 8. Leaderboard system error.";
     return;
   }
 
   const string msgtype = single ? "ranklist_single" : "ranklist";
-
-  if (encoding == kJsonEncoding) {
-    Json msg;
-    for (size_t i = 0; i < response.records.size(); ++i) {
-      string index = std::to_string(i);
-      msg["ranks"][index]["rank"] = response.records[i].rank;
-      msg["ranks"][index]["score"] = response.records[i].score;
-      msg["ranks"][index]["id"] = response.records[i].player_account.id();
-    }
-
-    session->SendMessage(msgtype, msg, kDefaultEncryption);
-  } else {
-    Ptr<FunMessage> msg(new FunMessage);
-    LobbyRankListReply *rank_response
-        = msg->MutableExtension(lobby_rank_list_repl);
-    rank_response->set_result("Success");
-    for (size_t i = 0; i < response.records.size(); ++i) {
-      LobbyRankListReply::RankElement *elem = rank_response->add_rank();
-      elem->set_rank(response.records[i].rank);
-      elem->set_score(response.records[i].score);
-      elem->set_id(response.records[i].player_account.id());
-    }
-    session->SendMessage(msgtype, msg, kDefaultEncryption);
-  }
+  session->SendMessage(msgtype, PongCodec<kEncoding>::RankList(response),
+                       kDefaultEncryption);
 }
 
 
 // 1 일 최대 연승 기록 TOP 8 을 세션으로 전송합니다.
-void GetAndSendTopEightList(const Ptr<Session> session,
-                            EncodingScheme encoding, bool single) {
+template <EncodingScheme kEncoding>
+void GetAndSendTopEightList(const Ptr<Session> session, bool single) {
   LeaderboardQueryRequest request(
     single ? kPlayerRecordWinCountSingle : kPlayerRecordWinCount, kAllTime,
     LeaderboardRange(LeaderboardRange::kFromTop, 0, 7),
     LeaderboardQueryRequest::kStdCompetition);
   GetLeaderboard(
-      request, bind(&OnGetTopEightList, session, _1, _2, _3, encoding, single));
+      request, bind(&OnGetTopEightList<kEncoding>, session, _1, _2, _3, single));
 }
 
+
+template void GetAndSendTopEightList<kJsonEncoding>(
+    const Ptr<Session> session, bool single);
+template void GetAndSendTopEightList<kProtobufEncoding>(
+    const Ptr<Session> session, bool single);
+
 } // namespace pong
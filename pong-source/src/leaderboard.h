@@ -6,11 +6,19 @@
 
 namespace pong {
 
-int GetCurrentRecordById(const string &id, bool single = false);
+// 현재 연승 기록을 비동기로 가져옵니다. 리더보드 오류면 success 가 false
+// 이고 record 는 0 입니다. 짧은 시간 안에 들어온 요청은 모아서
+// 리더보드마다 한 번에 조회합니다.
+typedef boost::function<void(bool success, int record)> CurrentRecordHandler;
+void GetCurrentRecordById(const string &id, bool single,
+                          const CurrentRecordHandler &handler);
+
 void IncreaseCurWinCount(const string &id, bool single = false);
 void ResetCurWinCount(const string &id, bool single = false);
-void GetAndSendTopEightList(
-    const Ptr<Session> session, EncodingScheme encoding, bool single = false);
+
+// kJsonEncoding, kProtobufEncoding 으로 인스턴스화 되어 있습니다.
+template <EncodingScheme kEncoding>
+void GetAndSendTopEightList(const Ptr<Session> session, bool single = false);
 
 }  // namespace pong
 
@@ -1,13 +1,23 @@
 ﻿#include "lobby_event_handlers.h"
 
+#include <algorithm>
+#include <vector>
+
+#include <boost/atomic.hpp>
 #include <funapi.h>
 #include <glog/logging.h>
 
 #include "common_handlers.h"
+#include "facebook_token_cache.h"
 #include "leaderboard.h"
+#include "login_admission.h"
 #include "matchmaking.h"
+#include "pong_codec.h"
 #include "pong_loggers.h"
 #include "pong_types.h"
+#include "session_state.h"
+#include "user_prefetch.h"
+#include "user_record_cache.h"
 
 #include "pong_messages.pb.h"
 
@@ -20,6 +30,17 @@ DECLARE_uint64(udp_protobuf_port);
 DECLARE_uint64(http_protobuf_port);
 DECLARE_uint64(websocket_protobuf_port);
 
+DEFINE_int32(login_user_timeout_in_ms, 3000,
+             "Fails a login if the User object is not loaded within this "
+             "time. The load itself is not cancelled by the timeout");
+DEFINE_int32(login_user_fetch_tags, 2,
+             "Loads the User object of logins on this many event tags, so "
+             "blocking ORM reads for logins hold at most this many lobby "
+             "event threads. Keep it below event_threads_size");
+DEFINE_int32(login_record_timeout_in_ms, 1000,
+             "Replies to a login with a streak of 0 if the leaderboard does "
+             "not answer within this time");
+
 
 namespace pong {
 
@@ -27,7 +48,7 @@ namespace pong {
 // unnamed namespace 로 감쌉니다.
 namespace {
 
-void FreeUser(const Ptr<Session> &session, EncodingScheme encoding);
+void FreeUser(const Ptr<Session> &session);
 
 
 // 새 클라이언트가 접속하여 세션이 열릴 때 불리는 함수
@@ -38,46 +59,39 @@ void OnSessionOpened(const Ptr<Session> &session) {
 
 
 // 세션이 닫혔을 때 불리는 함수
-void OnSessionClosed(const Ptr<Session> &session, SessionCloseReason reason,
-                     EncodingScheme encoding) {
+void OnSessionClosed(const Ptr<Session> &session, SessionCloseReason reason) {
   // 세션 닫힘 Activity Log 를 남깁니다.
   logger::SessionClosed(to_string(session->id()), WallClock::Now());
   // 세션을 초기화 합니다.
-  FreeUser(session, encoding);
+  FreeUser(session);
 }
 
 
 // TCP 연결이 끊기면 불립니다.
-void OnTransportTcpDetached(const Ptr<Session> &session,
-                            EncodingScheme encoding) {
-  string id;
-  session->GetFromContext("id", &id);
+void OnTransportTcpDetached(const Ptr<Session> &session) {
+  const string id = PongSessionState::GetId(session);
   LOG_IF(INFO, not id.empty()) << "TCP disconnected: id=" << id;
   // 세션을 초기화 합니다.
-  FreeUser(session, encoding);
+  FreeUser(session);
 }
 
 // Websocket 연결이 끊기면 불립니다.
-void OnTransportWebsocketDetached(const Ptr<Session> &session,
-                            EncodingScheme encoding) {
+void OnTransportWebsocketDetached(const Ptr<Session> &session) {
   LOG(INFO) << "OnTransportWebsocketDetached";
-  string id;
-  session->GetFromContext("id", &id);
+  const string id = PongSessionState::GetId(session);
   LOG_IF(INFO, not id.empty()) << "Websocket disconnected: id=" << id;
   // 세션을 초기화 합니다.
-  FreeUser(session, encoding);
+  FreeUser(session);
 }
 
 // 세션을 정리합니다.
-void FreeUser(const Ptr<Session> &session, EncodingScheme encoding) {
-  // 유저를 정리하기 위한 Context 를 읽어옵니다.
-  string matching_state;
-  string id;
-  session->GetFromContext("matching", &matching_state);
-  session->GetFromContext("id", &id);
-
-  // Session Context 를 초기화 합니다.
-  session->SetContext(Json());
+void FreeUser(const Ptr<Session> &session) {
+  // 유저를 정리하기 위한 상태를 떼어 냅니다.
+  Ptr<PongSessionState> state = PongSessionState::Remove(session);
+  if (not state) {
+    return;
+  }
+  const string id = state->id();
 
   // 로그아웃하고 세션을 종료합니다.
   if (not id.empty()) {
@@ -91,7 +105,7 @@ void FreeUser(const Ptr<Session> &session, EncodingScheme encoding) {
   }
 
   // 매치메이킹이 진행 중이면 취소합니다.
-  if (matching_state == "doing") {
+  if (state->matching() == kMatchingDoing) {
     // Matchmaking cancel 결과를 처리할 람다 함수입니다.
     auto cancel_cb = [](const string &player_id,
                         MatchmakingClient::CancelResult result) {
@@ -108,28 +122,252 @@ void FreeUser(const Ptr<Session> &session, EncodingScheme encoding) {
   }
 }
 
+
+// 로그인 응답에 필요한 값을 가져오는 단계입니다. 서로 기다리지 않고 따로
+// 시작합니다. ORM 에 비동기 읽기가 없으므로 User 읽기는 이벤트 스레드를
+// 막지만, 로그인용 event tag 에서만 돌려서 막는 스레드 수를 제한합니다.
+enum LoginStage {
+  kLoginUser = 0,
+  kLoginRecord,
+  kLoginRecordSingle,
+  kLoginStageCount
+};
+
+const char *kLoginStageNames[kLoginStageCount] = {
+  "user", "record", "record_single"
+};
+
+
+// User 읽기를 돌리는 event tag 들입니다. 같은 tag 의 이벤트는 차례로
+// 실행되므로 로그인이 몰려도 tag 수보다 많은 이벤트 스레드를 막지 않습니다.
+std::vector<EventTag> the_login_fetch_tags;
+boost::atomic<size_t> the_next_login_fetch_tag(0);
+
+
+void InitializeLoginFetchTags() {
+  if (FLAGS_login_user_fetch_tags < 1) {
+    LOG(FATAL) << "login_user_fetch_tags must be at least 1: "
+               << FLAGS_login_user_fetch_tags;
+  }
+  for (int i = 0; i < FLAGS_login_user_fetch_tags; ++i) {
+    the_login_fetch_tags.push_back(RandomGenerator::GenerateUuid());
+  }
+}
+
+
+const EventTag &GetLoginFetchTag() {
+  const size_t index =
+      the_next_login_fetch_tag.fetch_add(1, boost::memory_order_relaxed);
+  return the_login_fetch_tags[index % the_login_fetch_tags.size()];
+}
+
+
+// 로그인 하나의 진행 상황입니다. 단계가 모두 끝나면 응답을 보냅니다.
+struct LoginJoin {
+  LoginJoin(const string &_id, const Ptr<Session> &_session)
+      : id(_id), session(_session), started(WallClock::Now()),
+        pending(kLoginStageCount), replied(false), timers_armed(false),
+        record_timer(), user_timer() {
+    std::fill(elapsed_in_ms, elapsed_in_ms + kLoginStageCount, -1);
+    record.id = id;
+  }
+
+  boost::mutex mutex;
+  const string id;
+  const Ptr<Session> session;
+  const WallClock::Value started;
+  PongLoginRecord record;
+  // 끝나지 않은 단계는 -1 입니다.
+  int64_t elapsed_in_ms[kLoginStageCount];
+  int pending;
+  bool replied;
+  // 응답을 보내면 남은 시간 초과 타이머를 취소합니다.
+  bool timers_armed;
+  Timer::Id record_timer;
+  Timer::Id user_timer;
+};
+
+
+// 시간 초과 타이머를 취소합니다. join->mutex 를 잡지 않고 불러야 합니다.
+void CancelLoginTimers(const Ptr<LoginJoin> &join) {
+  Timer::Id record_timer;
+  Timer::Id user_timer;
+  {
+    boost::mutex::scoped_lock lock(join->mutex);
+    if (not join->timers_armed) {
+      return;
+    }
+    join->timers_armed = false;
+    record_timer = join->record_timer;
+    user_timer = join->user_timer;
+  }
+  Timer::Cancel(record_timer);
+  Timer::Cancel(user_timer);
+}
+
+
+// join->mutex 를 잡고 불러야 합니다. 이미 끝난 단계면 false 를, 아니면
+// 단계를 끝내고 true 를 반환합니다.
+bool FinishLoginStage(LoginJoin *join, LoginStage stage) {
+  if (join->elapsed_in_ms[stage] >= 0) {
+    return false;
+  }
+  join->elapsed_in_ms[stage] =
+      (WallClock::Now() - join->started).total_milliseconds();
+  --join->pending;
+  return true;
+}
+
+
+// join->mutex 를 잡고 불러야 합니다. 응답을 보낼 차례면 true 입니다.
+bool ShouldReplyLogin(LoginJoin *join) {
+  if (join->replied || join->pending > 0) {
+    return false;
+  }
+  join->replied = true;
+  return true;
+}
+
+
+template <EncodingScheme kEncoding>
+void SendLoginReply(const Ptr<LoginJoin> &join) {
+  CancelLoginTimers(join);
+
+  LOG(INFO) << "Succeed to login: id=" << join->id
+            << ", user_ms=" << join->elapsed_in_ms[kLoginUser]
+            << ", record_ms=" << join->elapsed_in_ms[kLoginRecord]
+            << ", record_single_ms="
+            << join->elapsed_in_ms[kLoginRecordSingle];
+
+  join->session->SendMessage(
+      "login", PongCodec<kEncoding>::LoginSucceeded(join->record),
+      kDefaultEncryption);
+}
+
+
+// 로그인용 event tag 에서 User Object 를 가져옵니다. ORM 읽기는 끝날 때까지
+// 이 이벤트 스레드를 막습니다. 시간 초과 응답은 보내지만 읽기를 멈추지는
+// 못합니다. 로그인용 tag 가 event_threads_size 보다 적으므로 DB 가 느려도
+// 나머지 이벤트 스레드는 다른 이벤트를 처리합니다.
+template <EncodingScheme kEncoding>
+void FetchLoginUser(const Ptr<LoginJoin> &join) {
+  Ptr<User> user = UserPrefetch::FetchById(join->id);
+
+  if (not user) {
+    // 새로운 유저를 생성합니다.
+    user = User::Create(join->id);
+    LOG(INFO) << "Registered new user: id=" << join->id;
+  }
+
+  bool reply = false;
+  {
+    boost::mutex::scoped_lock lock(join->mutex);
+    if (not FinishLoginStage(join.get(), kLoginUser)) {
+      // 시간 초과로 이미 실패 응답을 보냈습니다.
+      return;
+    }
+    // 아직 ORM 에 쓰지 않은 전적을 더합니다.
+    const UserRecordDelta pending = UserRecordCache::GetPending(join->id);
+    join->record.win_count = user->GetWinCount() + pending.win_count;
+    join->record.lose_count = user->GetLoseCount() + pending.lose_count;
+    join->record.win_count_single =
+        user->GetWinCountSingle() + pending.win_count_single;
+    join->record.lose_count_single =
+        user->GetLoseCountSingle() + pending.lose_count_single;
+    reply = ShouldReplyLogin(join.get());
+  }
+
+  if (reply) {
+    SendLoginReply<kEncoding>(join);
+  }
+}
+
+
+template <EncodingScheme kEncoding>
+void OnLoginRecordFetched(const Ptr<LoginJoin> &join, LoginStage stage,
+                          bool /*success*/, int cur_record) {
+  bool reply = false;
+  {
+    boost::mutex::scoped_lock lock(join->mutex);
+    if (not FinishLoginStage(join.get(), stage)) {
+      // 시간 초과로 0 을 넣고 넘어갔습니다.
+      return;
+    }
+    if (stage == kLoginRecordSingle) {
+      join->record.cur_record_single = cur_record;
+    } else {
+      join->record.cur_record = cur_record;
+    }
+    reply = ShouldReplyLogin(join.get());
+  }
+
+  if (reply) {
+    SendLoginReply<kEncoding>(join);
+  }
+}
+
+
+// 연승 기록은 없어도 로그인할 수 있으므로 0 으로 두고 응답합니다.
+template <EncodingScheme kEncoding>
+void OnLoginRecordTimeout(const Ptr<LoginJoin> &join,
+                          const Timer::Id &/*timer_id*/,
+                          const WallClock::Value &/*now*/) {
+  bool reply = false;
+  {
+    boost::mutex::scoped_lock lock(join->mutex);
+    for (int stage = kLoginRecord; stage < kLoginStageCount; ++stage) {
+      if (FinishLoginStage(join.get(), static_cast<LoginStage>(stage))) {
+        LOG(WARNING) << "Login stage timed out: id=" << join->id
+                     << ", stage=" << kLoginStageNames[stage];
+      }
+    }
+    reply = ShouldReplyLogin(join.get());
+  }
+
+  if (reply) {
+    SendLoginReply<kEncoding>(join);
+  }
+}
+
+
+// User Object 없이는 응답할 수 없으므로 로그인을 실패시킵니다.
+template <EncodingScheme kEncoding>
+void OnLoginUserTimeout(const Ptr<LoginJoin> &join,
+                        const Timer::Id &/*timer_id*/,
+                        const WallClock::Value &/*now*/) {
+  {
+    boost::mutex::scoped_lock lock(join->mutex);
+    if (join->replied || not FinishLoginStage(join.get(), kLoginUser)) {
+      return;
+    }
+    join->replied = true;
+  }
+  CancelLoginTimers(join);
+
+  LOG(WARNING) << "Login stage timed out: id=" << join->id
+               << ", stage=" << kLoginStageNames[kLoginUser];
+  join->session->SendMessage("login",
+                             PongCodec<kEncoding>::LoginFailed("timeout"),
+                             kDefaultEncryption);
+  // OnSessionClosed 에서 로그아웃합니다.
+  join->session->Close();
+}
+
 }  // unnamed namespace
 
 
 // AccountManager 의 로그인 처리가 끝나면 불립니다.
-void OnLoggedIn(const string &id, const Ptr<Session> &session, bool success,
-                EncodingScheme encoding) {
+template <EncodingScheme kEncoding>
+void OnLoggedIn(const string &id, const Ptr<Session> &session, bool success) {
   if (not success) {
     // 로그인에 실패 응답을 보냅니다. 중복 로그인이 원인입니다.
     // (1. 같은 ID 로 이미 다른 Session 이 로그인 했거나,
     //  2. 이 Session 이 이미 로그인 되어 있는 경우)
     LOG(INFO) << "Failed to login: id=" << id;
 
-    if (encoding == kJsonEncoding) {
-      session->SendMessage("login", MakeResponse("nop", "fail to login"),
-                           kDefaultEncryption);
-    } else {
-      Ptr<FunMessage> response(new FunMessage);
-      LobbyLoginReply *login_response = response->MutableExtension(lobby_login_repl);
-      login_response->set_result("nop");
-      login_response->set_msg("fail to login");
-      session->SendMessage("login", response, kDefaultEncryption);
-    }
+    session->SendMessage("login",
+                         PongCodec<kEncoding>::LoginFailed("fail to login"),
+                         kDefaultEncryption);
 
     // 아래 로그아웃 처리를 한 후 자동으로 로그인 시킬 수 있지만
     // 일단 클라이언트에서 다시 시도하도록 합니다.
@@ -164,74 +402,67 @@ void OnLoggedIn(const string &id, const Ptr<Session> &session, bool success,
     return;
   }
 
-  // User Object 를 가져옵니다.
-  Ptr<User> user = User::FetchById(id);
-
-  if (not user) {
-    // 새로운 유저를 생성합니다.
-    user = User::Create(id);
-    LOG(INFO) << "Registered new user: id=" << id;
-  }
-  LOG(INFO) << "Succeed to login: id=" << id;
-
   // 로그인 Activitiy Log 를 남깁니다.
   logger::PlayerLoggedIn(to_string(session->id()), id, WallClock::Now());
 
   // Session 에 Login 한 ID 를 저장합니다.
-  session->AddToContext("id", id);
-
-  // 응답을 보냅니다.
-  if (encoding == kJsonEncoding) {
-    Json response = MakeResponse("ok");
-    response["id"] = id;
-    response["winCount"] = user->GetWinCount();
-    response["loseCount"] = user->GetLoseCount();
-    response["curRecord"] = GetCurrentRecordById(id);
-    response["singleWinCount"] = user->GetWinCountSingle();
-    response["singleLoseCount"] = user->GetLoseCountSingle();
-    response["singleCurRecord"] = GetCurrentRecordById(id, true);
-
-    session->SendMessage("login", response, kDefaultEncryption);
-  } else {
-    Ptr<FunMessage> response(new FunMessage);
-    LobbyLoginReply *login_response = response->MutableExtension(lobby_login_repl);
-    login_response->set_result("ok");
-    login_response->set_id(id);
-    login_response->set_win_count(user->GetWinCount());
-    login_response->set_lose_count(user->GetLoseCount());
-    login_response->set_cur_record(GetCurrentRecordById(id));
-    login_response->set_win_count_single(user->GetWinCountSingle());
-    login_response->set_lose_count_single(user->GetLoseCountSingle());
-    login_response->set_cur_record_single(GetCurrentRecordById(id, true));
-
-    session->SendMessage("login", response, kDefaultEncryption);
+  PongSessionState::FindOrCreate(session)->set_id(id);
+
+  // 두 연승 기록은 리더보드에 비동기로 묻고, User Object 는 로그인용 event
+  // tag 에서 읽습니다. 셋이 모두 도착하면 응답을 보냅니다. 리더보드 조회는
+  // 이벤트 스레드를 막지 않고, User 읽기는 로그인용 tag 수만큼의 이벤트
+  // 스레드만 막습니다.
+  Ptr<LoginJoin> join(new LoginJoin(id, session));
+
+  GetCurrentRecordById(
+      id, false,
+      bind(&OnLoginRecordFetched<kEncoding>, join, kLoginRecord, _1, _2));
+  GetCurrentRecordById(
+      id, true,
+      bind(&OnLoginRecordFetched<kEncoding>, join, kLoginRecordSingle, _1,
+           _2));
+  Event::Invoke(bind(&FetchLoginUser<kEncoding>, join), GetLoginFetchTag());
+
+  const Timer::Id record_timer = Timer::ExpireAfter(
+      WallClock::FromMsec(FLAGS_login_record_timeout_in_ms),
+      bind(&OnLoginRecordTimeout<kEncoding>, join, _1, _2));
+  const Timer::Id user_timer = Timer::ExpireAfter(
+      WallClock::FromMsec(FLAGS_login_user_timeout_in_ms),
+      bind(&OnLoginUserTimeout<kEncoding>, join, _1, _2));
+
+  bool replied = false;
+  {
+    boost::mutex::scoped_lock lock(join->mutex);
+    replied = join->replied;
+    if (not replied) {
+      join->timers_armed = true;
+      join->record_timer = record_timer;
+      join->user_timer = user_timer;
+    }
+  }
+  if (replied) {
+    // 타이머를 걸기 전에 이미 응답했습니다.
+    Timer::Cancel(record_timer);
+    Timer::Cancel(user_timer);
   }
 }
 
 
 // Facebook 인증 처리 후 불립니다.
+template <EncodingScheme kEncoding>
 void OnFacebookAuthenticated(
   const string &fb_uid, const Ptr<Session> &session,
   const AccountAuthenticationRequest &request,
-  const AccountAuthenticationResponse &response, const bool &error,
-  EncodingScheme encoding) {
+  const AccountAuthenticationResponse &response, const bool &error) {
   if (error) {
     // 인증에 오류가 있습니다. 장애 오류입니다.
     LOG(ERROR) << "Failed to authenticate. Facebook authentication error: "
                << "id=" << fb_uid;
 
-    if (encoding == kJsonEncoding) {
-      session->SendMessage("login",
-                           MakeResponse("nop", "facebook authentication error"),
-                           kDefaultEncryption);
-    } else {
-      Ptr<FunMessage> response(new FunMessage);
-      LobbyLoginReply *login_response = response->MutableExtension(lobby_login_repl);
-      login_response->set_result("nop");
-      login_response->set_msg("facebook authentication error");
-
-      session->SendMessage("login", response, kDefaultEncryption);
-    }
+    session->SendMessage(
+        "login",
+        PongCodec<kEncoding>::LoginFailed("facebook authentication error"),
+        kDefaultEncryption);
     return;
   }
 
@@ -242,17 +473,9 @@ void OnFacebookAuthenticated(
     string fail_message = "facebook authentication failed: " +
                           response.reason_description;
 
-    if (encoding == kJsonEncoding) {
-      session->SendMessage("login", MakeResponse("nop", fail_message),
-                           kDefaultEncryption);
-    } else {
-      Ptr<FunMessage> response(new FunMessage);
-      LobbyLoginReply *login_response = response->MutableExtension(lobby_login_repl);
-      login_response->set_result("nop");
-      login_response->set_msg(fail_message);
-
-      session->SendMessage("login", response, kDefaultEncryption);
-    }
+    session->SendMessage("login",
+                         PongCodec<kEncoding>::LoginFailed(fail_message),
+                         kDefaultEncryption);
     return;
   }
 
@@ -261,39 +484,67 @@ void OnFacebookAuthenticated(
 
   // 이어서 로그인 처리를 진행합니다.
   AccountManager::CheckAndSetLoggedInAsync(
-      fb_uid, session, bind(&OnLoggedIn, _1, _2, _3, encoding));
+      fb_uid, session, bind(&OnLoggedIn<kEncoding>, _1, _2, _3));
+}
+
+
+// 인증과 로그인을 시작합니다.
+template <EncodingScheme kEncoding>
+void StartLogin(const Ptr<Session> &session, const string &id,
+                const string &type, const string &access_token) {
+  if(type == "fb") {
+    // Facebook 인증을 먼저 합니다.
+    // 최근에 검증한 token 이면 다시 묻지 않습니다.
+    FacebookTokenCache::Authenticate(
+        id, access_token,
+        bind(&OnFacebookAuthenticated<kEncoding>, id, session, _1, _2, _3));
+  } else {
+    // Guest 는 별도의 인증 없이 로그인 합니다.
+    AccountManager::CheckAndSetLoggedInAsync(
+        id, session, bind(&OnLoggedIn<kEncoding>, _1, _2, _3));
+  }
+}
+
+
+// 로그인이 몰리면 LoginAdmission 의 대기열에서 차례를 기다린 뒤 시작합니다.
+template <EncodingScheme kEncoding>
+void RequestLogin(const Ptr<Session> &session, const string &id,
+                  const string &type, const string &access_token) {
+  int64_t retry_after_in_ms = 0;
+  const LoginAdmission::Result result = LoginAdmission::Admit(
+      session,
+      bind(&StartLogin<kEncoding>, session, id, type, access_token),
+      &retry_after_in_ms);
+  if (result == LoginAdmission::kRejected) {
+    LOG(INFO) << "Login rejected by admission control: id=" << id
+              << ", retry_after_in_ms=" << retry_after_in_ms;
+    session->SendMessage("login",
+                         PongCodec<kEncoding>::LoginBusy(retry_after_in_ms),
+                         kDefaultEncryption);
+  }
 }
 
 
-void StartMatchmaking(const Ptr<Session> &session, EncodingScheme encoding) {
+template <EncodingScheme kEncoding>
+void StartMatchmaking(const Ptr<Session> &session) {
   // Matchmaking 최대 대기 시간은 10 초입니다.
   static const WallClock::Duration kTimeout = WallClock::FromSec(10);
 
   // 로그인 한 Id 를 가져옵니다.
-  string id;
-  if (not session->GetFromContext("id", &id)) {
+  Ptr<PongSessionState> state = PongSessionState::Find(session);
+  const string id = state ? state->id() : string();
+  if (id.empty()) {
     LOG(WARNING) << "Failed to request matchmaking. Not logged in.";
 
-    if (encoding == kJsonEncoding) {
-      session->SendMessage("error", MakeResponse("fail", "not logged in"));
-    } else {
-      Ptr<FunMessage> response(new FunMessage);
-      PongErrorMessage *error = response->MutableExtension(pong_error);
-      error->set_result("fail");
-      error->set_msg("not logged in");
-      session->SendMessage("error", response);
-    }
+    session->SendMessage("error", PongCodec<kEncoding>::NotLoggedIn());
     return;
   }
 
   // Matchmaking 결과를 처리할 람다 함수입니다.
-  auto match_cb = [session, encoding](const string &player_id,
-                                      const MatchmakingClient::Match &match,
-                                      MatchmakingClient::MatchResult result) {
-    Json json_response;
-    Ptr<FunMessage> pbuf_response(new FunMessage);
-    LobbyMatchReply *pbuf_match_reply
-        = pbuf_response->MutableExtension(lobby_match_repl);
+  auto match_cb = [session, state](const string &player_id,
+                            const MatchmakingClient::Match &match,
+                            MatchmakingClient::MatchResult result) {
+    typename PongCodec<kEncoding>::Message response;
 
     if (result == MatchmakingClient::kMRSuccess) {
       // Matchmaking 에 성공했습니다.
@@ -310,64 +561,43 @@ void StartMatchmaking(const Ptr<Session> &session, EncodingScheme encoding) {
         opponent_id = match.context["B"].GetString();
       }
 
-      if (encoding == kJsonEncoding) {
-        json_response = MakeResponse("Success");
-        json_response["A"] = player_a_id;
-        json_response["B"] = player_b_id;
-      } else {
-        pbuf_match_reply->set_result("Success");
-        pbuf_match_reply->set_player1(player_a_id);
-        pbuf_match_reply->set_player2(player_b_id);
-      }
+      response = PongCodec<kEncoding>::MatchSucceeded(player_a_id, player_b_id);
 
       if (player_id == player_a_id) {
-        session->AddToContext("opponent", player_b_id);
+        state->set_opponent(player_b_id);
       } else {
-        session->AddToContext("opponent", player_a_id);
+        state->set_opponent(player_a_id);
+      }
+      state->set_matching(kMatchingDone);
+      state->set_ready(false);
+
+      // 유저를 Game 서버로 보냅니다. matchmaker 가 매치마다 고른 서버로
+      // 보내서 두 플레이어가 같은 서버에서 만나게 합니다.
+      if (HasJsonStringAttribute(match.context, "server")) {
+        MoveServerToPeer(session, match.context["server"].GetString(),
+                         "game");
+      } else {
+        MoveServerByTag(session, "game");
       }
-      session->AddToContext("matching", "done");
-      session->AddToContext("ready", 0);
-
-      // 유저를 Game 서버로 보냅니다.
-      MoveServerByTag(session, "game");
     } else if (result == MatchmakingClient::kMRAlreadyRequested) {
       // Matchmaking 요청을 중복으로 보냈습니다.
       LOG(INFO) << "Failed in matchmaking. Already requested: id="
                 << player_id;
-      session->AddToContext("matching", "failed");
-
-      if (encoding == kJsonEncoding) {
-        json_response = MakeResponse("AlreadyRequested");
-      } else {
-        pbuf_match_reply->set_result("AlreadyRequested");
-      }
+      state->set_matching(kMatchingFailed);
+      response = PongCodec<kEncoding>::MatchResult("AlreadyRequested");
     } else if (result == MatchmakingClient::kMRTimeout) {
       // Matchmaking 처리가 시간 초과되었습니다.
       LOG(INFO) << "Failed in matchmaking. Timeout: id=" << player_id;
-      session->AddToContext("matching", "failed");
-
-      if (encoding == kJsonEncoding) {
-        json_response = MakeResponse("Timeout");
-      } else {
-        pbuf_match_reply->set_result("Timeout");
-      }
+      state->set_matching(kMatchingFailed);
+      response = PongCodec<kEncoding>::MatchResult("Timeout");
     } else {
       // Matchmaking 에 오류가 발생했습니다.
       LOG(ERROR) << "Failed in matchmaking. Erorr: id=" << player_id;
-      session->AddToContext("matching", "failed");
-
-      if (encoding == kJsonEncoding) {
-        json_response = MakeResponse("Error");
-      } else {
-        pbuf_match_reply->set_result("Error");
-      }
+      state->set_matching(kMatchingFailed);
+      response = PongCodec<kEncoding>::MatchResult("Error");
     }
 
-    if (encoding == kJsonEncoding) {
-      session->SendMessage("match", json_response, kDefaultEncryption);
-    } else {
-      session->SendMessage("match", pbuf_response, kDefaultEncryption);
-    }
+    session->SendMessage("match", response, kDefaultEncryption);
   };
 
   // 빈 Player Context 를 만듭니다. 지금 구현에서는 Matchmaking 서버가
@@ -384,83 +614,63 @@ void StartMatchmaking(const Ptr<Session> &session, EncodingScheme encoding) {
 }
 
 
-void CancelMatchmaking(const Ptr<Session>& session, EncodingScheme encoding) {
+template <EncodingScheme kEncoding>
+void CancelMatchmaking(const Ptr<Session>& session) {
   // 로그인 한 Id 를 가져옵니다.
-  string id;
-  if (not session->GetFromContext("id", &id)) {
+  Ptr<PongSessionState> state = PongSessionState::Find(session);
+  const string id = state ? state->id() : string();
+  if (id.empty()) {
     LOG(WARNING) << "Failed to request matchmaking. Not logged in.";
-    session->SendMessage("error", MakeResponse("fail", "not logged in"));
+    session->SendMessage("error", PongCodec<kEncoding>::NotLoggedIn());
     return;
   }
 
   // 매치메이킹 취소 상태로 변경합니다.
-  session->AddToContext("matching", "cancel");
+  state->set_matching(kMatchingCancel);
 
   // Matchmaking cancel 결과를 처리할 람다 함수입니다.
-  auto cancel_cb = [session, encoding](const string &player_id,
-                                       MatchmakingClient::CancelResult result) {
-    if (encoding == kJsonEncoding) {
-      Json response;
-
-      if (result == MatchmakingClient::kCRSuccess) {
-        LOG(INFO) << "Succeed to cancel matchmaking: id=" << player_id;
-        response = MakeResponse("Cancel");
-      } else if (result == MatchmakingClient::kCRNoRequest) {
-        response = MakeResponse("NoRequest");
-      } else {
-        response = MakeResponse("Error");
-      }
-
-      session->SendMessage("match", response, kDefaultEncryption);
-    } else {
-      Ptr<FunMessage> pbuf_response(new FunMessage);
-      LobbyMatchReply *pbuf_match_reply
-          = pbuf_response->MutableExtension(lobby_match_repl);
-
-      if (result == MatchmakingClient::kCRSuccess) {
-        LOG(INFO) << "Succeed to cancel matchmaking: id=" << player_id;
-        pbuf_match_reply->set_result("Cancel");
-      } else if (result == MatchmakingClient::kCRNoRequest) {
-        pbuf_match_reply->set_result("NoRequest");
-      } else {
-        pbuf_match_reply->set_result("Error");
-      }
-
-      session->SendMessage("match", pbuf_response, kDefaultEncryption);
+  auto cancel_cb = [session](const string &player_id,
+                             MatchmakingClient::CancelResult result) {
+    string cancel_result = "Error";
+    if (result == MatchmakingClient::kCRSuccess) {
+      LOG(INFO) << "Succeed to cancel matchmaking: id=" << player_id;
+      cancel_result = "Cancel";
+    } else if (result == MatchmakingClient::kCRNoRequest) {
+      cancel_result = "NoRequest";
     }
+
+    session->SendMessage("match",
+                         PongCodec<kEncoding>::MatchResult(cancel_result),
+                         kDefaultEncryption);
   };
 
   // Matchmaking 취소를 요청합니다.
   MatchmakingClient::CancelMatchmaking(kMatch1vs1, id, cancel_cb);
 }
 
+template <EncodingScheme kEncoding>
 void HandleSingleModeResult(const Ptr<Session>& session, bool win)
 {
-  string id;
-  if (not session->GetFromContext("id", &id)) {
+  const string id = PongSessionState::GetId(session);
+  if (id.empty()) {
     LOG(WARNING) << "Failed to update singlemode game result. Not logged in.";
-    session->SendMessage("error", MakeResponse("fail", "not logged in"));
-    return;
-  }
-
-  Ptr<User> user = User::FetchById(id);
-
-  if(not user)
-  {
-    LOG(ERROR) << "Cannot find user's id in db: id=" << id;
+    session->SendMessage("error", PongCodec<kEncoding>::NotLoggedIn());
     return;
   }
 
+  // ORM 에는 UserRecordCache 가 모아서 씁니다.
+  UserRecordDelta delta;
   if(win)
   {
-    user->SetWinCountSingle(user->GetWinCountSingle()+1);
+    delta.win_count_single = 1;
     IncreaseCurWinCount(id, true);
   }
   else
   {
-    user->SetLoseCountSingle(user->GetLoseCountSingle()+1);
+    delta.lose_count_single = 1;
     ResetCurWinCount(id, true);
   }
+  UserRecordCache::Add(id, delta);
 }
 
 
@@ -475,32 +685,24 @@ void OnAccountLogin(const Ptr<Session> &session, const Json &message) {
   string id = message["id"].GetString();
   string type = message["type"].GetString();
 
+  string access_token;
   if(type == "fb") {
-    // Facebook 인증을 먼저 합니다.
-    string access_token = message["access_token"].GetString();
-    AccountAuthenticationRequest request(
-        "Facebook", id, MakeFacebookAuthenticationKey(access_token));
-    Authenticate(request,
-                 bind(&OnFacebookAuthenticated, id, session, _1, _2, _3,
-                      kJsonEncoding));
-  } else {
-    // Guest 는 별도의 인증 없이 로그인 합니다.
-    AccountManager::CheckAndSetLoggedInAsync(
-        id, session, bind(&OnLoggedIn, _1, _2, _3, kJsonEncoding));
+    access_token = message["access_token"].GetString();
   }
+  RequestLogin<kJsonEncoding>(session, id, type, access_token);
 }
 
 
 // 매치 메이킹 요청을 수행합니다.
 void OnMatchmaking(const Ptr<Session> &session, const Json &/*message*/) {
   // 실제 matchmaking 구현을 호출한다.
-  StartMatchmaking(session, kJsonEncoding);
+  StartMatchmaking<kJsonEncoding>(session);
 }
 
 
 // 매치메이킹 취소 메시지를 받으면 불립니다.
 void OnCancelMatchmaking(const Ptr<Session> &session, const Json &/*message*/) {
-  CancelMatchmaking(session, kJsonEncoding);
+  CancelMatchmaking<kJsonEncoding>(session);
 }
 
 void OnSingleModeResultReceived(const Ptr<Session> &session, const Json &message) {
@@ -509,16 +711,16 @@ void OnSingleModeResultReceived(const Ptr<Session> &session, const Json &message
   string str = message["result"].GetString();
   win = ( str == "win");
 
-  HandleSingleModeResult(session, win);
+  HandleSingleModeResult<kJsonEncoding>(session, win);
 }
 
 // TOP 8 랭킹 메시지를 받으면 불립니다.
 void OnRanklistRequested(const Ptr<Session> &session, const Json &message) {
-  GetAndSendTopEightList(session, kJsonEncoding);
+  GetAndSendTopEightList<kJsonEncoding>(session);
 }
 
 void OnSingleRanklistRequested(const Ptr<Session> &session, const Json &message) {
-  GetAndSendTopEightList(session, kJsonEncoding, true);
+  GetAndSendTopEightList<kJsonEncoding>(session, true);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -537,23 +739,15 @@ void OnAccountLogin2(
   string id = req.id();
   string type = req.type();
 
+  string access_token;
   if(type == "fb") {
-    // Facebook 인증을 먼저 합니다.
     if (not req.has_access_token()) {
       LOG(ERROR) << "FB login without an access token!";
       return;
     }
-    string access_token = req.access_token();
-    AccountAuthenticationRequest request(
-        "Facebook", id, MakeFacebookAuthenticationKey(access_token));
-    Authenticate(request,
-                 bind(&OnFacebookAuthenticated, id, session, _1, _2, _3,
-                      kProtobufEncoding));
-  } else {
-    // Guest 는 별도의 인증 없이 로그인 합니다.
-    AccountManager::CheckAndSetLoggedInAsync(
-        id, session, bind(&OnLoggedIn, _1, _2, _3, kProtobufEncoding));
+    access_token = req.access_token();
   }
+  RequestLogin<kProtobufEncoding>(session, id, type, access_token);
 }
 
 void OnSingleModeResultReceived2(
@@ -564,27 +758,27 @@ void OnSingleModeResultReceived2(
   const LobbySingleModeResultMessage &msg = message->GetExtension(lobby_single_result);
   win = (msg.result() == "win");
 
-  HandleSingleModeResult(session, win);
+  HandleSingleModeResult<kProtobufEncoding>(session, win);
 }
 
 void OnMatchmaking2(
     const Ptr<Session> &session, const Ptr<FunMessage> &/*message*/) {
-  StartMatchmaking(session, kProtobufEncoding);
+  StartMatchmaking<kProtobufEncoding>(session);
 }
 
 void OnCancelMatchmaking2(
     const Ptr<Session> &session, const Ptr<FunMessage> &/*message*/) {
-  CancelMatchmaking(session, kProtobufEncoding);
+  CancelMatchmaking<kProtobufEncoding>(session);
 }
 
 void OnRankListRequested2(
     const Ptr<Session> &session, const Ptr<FunMessage> &message) {
-  GetAndSendTopEightList(session, kProtobufEncoding);
+  GetAndSendTopEightList<kProtobufEncoding>(session);
 }
 
 void OnSingleRankListRequested2(
     const Ptr<Session> &session, const Ptr<FunMessage> &message) {
-  GetAndSendTopEightList(session, kProtobufEncoding, true);
+  GetAndSendTopEightList<kProtobufEncoding>(session, true);
 }
 
 
@@ -605,12 +799,14 @@ void RegisterLobbyEventHandlers() {
     LOG(FATAL) << "Either JSON or Protobuf must be enabled.";
   }
 
-  HandlerRegistry::Install2(
-      OnSessionOpened, bind(&OnSessionClosed, _1, _2, encoding));
-  HandlerRegistry::RegisterTcpTransportDetachedHandler(
-      bind(&OnTransportTcpDetached, _1, encoding));
+  InitializeLoginFetchTags();
+  FacebookTokenCache::Install();
+  LoginAdmission::Install();
+
+  HandlerRegistry::Install2(OnSessionOpened, OnSessionClosed);
+  HandlerRegistry::RegisterTcpTransportDetachedHandler(OnTransportTcpDetached);
   HandlerRegistry::RegisterWebSocketTransportDetachedHandler(
-      bind(&OnTransportWebsocketDetached, _1, encoding));
+      OnTransportWebsocketDetached);
 
   if (encoding == kJsonEncoding) {
     // JSON 버전 Login 핸들러
@@ -0,0 +1,297 @@
+﻿#include "login_admission.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+
+#include "session_state.h"
+
+
+DEFINE_int32(login_rate_per_sec, 200,
+             "Logins admitted per second on this server. 0 disables login "
+             "admission control");
+DEFINE_int32(login_burst, 400,
+             "Logins admitted at once after an idle period");
+DEFINE_int32(login_rate_per_ip_per_sec, 0,
+             "Logins accepted per second from one IP address. 0 disables the "
+             "per-IP limit. Players behind carrier NAT share one address, so "
+             "keep this well above the expected players per address");
+DEFINE_int32(login_burst_per_ip, 10,
+             "Logins accepted at once from one IP address");
+DEFINE_int32(login_queue_size, 1000,
+             "Logins waiting for admission. Further logins are rejected "
+             "with a retry-after hint");
+DEFINE_int32(login_queue_drain_interval_in_ms, 10,
+             "Admits waiting logins at this interval");
+
+
+namespace pong {
+
+namespace {
+
+// IP 마다의 bucket 을 이만큼 쓰지 않으면 지웁니다.
+const WallClock::Duration kIdleBucketExpiry = WallClock::FromSec(60);
+
+
+struct TokenBucket {
+  TokenBucket() : tokens(0), updated_time(WallClock::Now()) {}
+
+  double tokens;
+  WallClock::Value updated_time;
+};
+
+
+// 지난 시간만큼 token 을 채웁니다.
+void Refill(TokenBucket *bucket, const WallClock::Value &now, double rate,
+            double burst) {
+  const double elapsed_in_sec =
+      (now - bucket->updated_time).total_microseconds() / 1000000.0;
+  bucket->tokens = std::min(burst, bucket->tokens + elapsed_in_sec * rate);
+  bucket->updated_time = now;
+}
+
+
+// token 하나가 생길 때까지의 시간입니다.
+int64_t GetRetryAfterInMs(const TokenBucket &bucket, double rate,
+                          int64_t waiting) {
+  const double needed = waiting + 1 - bucket.tokens;
+  return std::max<int64_t>(1, std::ceil(needed / rate * 1000));
+}
+
+
+struct WaitingLogin {
+  Ptr<Session> session;
+  boost::function<void()> task;
+  WallClock::Value queued_time;
+};
+
+typedef std::deque<WaitingLogin> LoginQueue;
+typedef boost::unordered_map<string, TokenBucket> IpBucketMap;
+
+boost::mutex the_admission_mutex;
+TokenBucket the_global_bucket;
+IpBucketMap the_ip_buckets;
+// game 서버에서 돌아온 세션의 대기열입니다. 먼저 진행합니다.
+LoginQueue the_priority_queue;
+LoginQueue the_login_queue;
+WallClock::Value the_last_prune_time;
+
+
+struct AdmissionStats {
+  AdmissionStats()
+      : admitted(0), queued(0), rejected_by_ip(0), rejected_by_queue(0),
+        abandoned(0), wait_in_ms(0), max_wait_in_ms(0) {
+  }
+
+  boost::atomic<int64_t> admitted;
+  boost::atomic<int64_t> queued;
+  boost::atomic<int64_t> rejected_by_ip;
+  boost::atomic<int64_t> rejected_by_queue;
+  // 기다리는 동안 연결이 끊겼습니다.
+  boost::atomic<int64_t> abandoned;
+  // 대기열에서 기다린 시간의 합과 최댓값입니다.
+  boost::atomic<int64_t> wait_in_ms;
+  boost::atomic<int64_t> max_wait_in_ms;
+};
+
+AdmissionStats the_stats;
+
+
+string GetRemoteAddress(const Ptr<Session> &session) {
+  const TransportProtocol kProtocols[] = { kTcp, kWebSocket, kHttp };
+  for (size_t i = 0; i < sizeof(kProtocols) / sizeof(kProtocols[0]); ++i) {
+    if (session->IsTransportAttached(kProtocols[i])) {
+      return session->GetRemoteEndPoint(kProtocols[i]).address().to_string();
+    }
+  }
+  return "";
+}
+
+
+// the_admission_mutex 를 잡고 불러야 합니다.
+void PruneIpBuckets(const WallClock::Value &now) {
+  if (now - the_last_prune_time < kIdleBucketExpiry) {
+    return;
+  }
+  the_last_prune_time = now;
+  for (IpBucketMap::iterator itr = the_ip_buckets.begin();
+       itr != the_ip_buckets.end(); ) {
+    if (now - itr->second.updated_time > kIdleBucketExpiry) {
+      itr = the_ip_buckets.erase(itr);
+    } else {
+      ++itr;
+    }
+  }
+}
+
+
+// the_admission_mutex 를 잡고 불러야 합니다. token 이 있는 만큼 대기열에서
+// 꺼냅니다.
+void TakeAdmitted(std::vector<WaitingLogin> *admitted) {
+  LoginQueue *queues[2] = { &the_priority_queue, &the_login_queue };
+  for (size_t i = 0; i < 2; ++i) {
+    while (not queues[i]->empty() && the_global_bucket.tokens >= 1) {
+      WaitingLogin &waiting = queues[i]->front();
+      if (waiting.session->IsTransportAttached()) {
+        the_global_bucket.tokens -= 1;
+        admitted->push_back(waiting);
+      } else {
+        the_stats.abandoned.fetch_add(1, boost::memory_order_relaxed);
+      }
+      queues[i]->pop_front();
+    }
+  }
+}
+
+
+void UpdateMaxWait(int64_t wait_in_ms) {
+  int64_t current = the_stats.max_wait_in_ms.load(boost::memory_order_relaxed);
+  while (current < wait_in_ms &&
+         not the_stats.max_wait_in_ms.compare_exchange_weak(
+             current, wait_in_ms, boost::memory_order_relaxed)) {
+  }
+}
+
+
+void OnDrainTimerExpired(const Timer::Id &/*timer_id*/,
+                         const WallClock::Value &/*now*/) {
+  const WallClock::Value now = WallClock::Now();
+  std::vector<WaitingLogin> admitted;
+  {
+    boost::mutex::scoped_lock lock(the_admission_mutex);
+    Refill(&the_global_bucket, now, FLAGS_login_rate_per_sec,
+           FLAGS_login_burst);
+    TakeAdmitted(&admitted);
+    PruneIpBuckets(now);
+  }
+
+  for (size_t i = 0; i < admitted.size(); ++i) {
+    const int64_t wait_in_ms =
+        (now - admitted[i].queued_time).total_milliseconds();
+    the_stats.wait_in_ms.fetch_add(wait_in_ms, boost::memory_order_relaxed);
+    UpdateMaxWait(wait_in_ms);
+    the_stats.admitted.fetch_add(1, boost::memory_order_relaxed);
+    Event::Invoke(admitted[i].task, admitted[i].session->tag());
+  }
+}
+
+
+// GET /v1/login_admission/
+void OnLoginAdmissionRequested(Ptr<http::Response> response,
+                               const http::Request &/*request*/,
+                               const ApiService::MatchResult &/*params*/) {
+  response->status_code = http::kOk;
+  response->body = LoginAdmission::Dump().ToString();
+}
+
+}  // unnamed namespace
+
+
+void LoginAdmission::Install() {
+  the_global_bucket.tokens = FLAGS_login_burst;
+  the_last_prune_time = WallClock::Now();
+  Timer::ExpireRepeatedly(
+      WallClock::FromMsec(FLAGS_login_queue_drain_interval_in_ms),
+      OnDrainTimerExpired);
+  ApiService::RegisterHandler(
+      http::kGet, boost::regex("/v1/login_admission/"),
+      OnLoginAdmissionRequested);
+}
+
+
+LoginAdmission::Result LoginAdmission::Admit(
+    const Ptr<Session> &session, const boost::function<void()> &task,
+    int64_t *retry_after_in_ms) {
+  BOOST_ASSERT(retry_after_in_ms);
+
+  if (FLAGS_login_rate_per_sec <= 0) {
+    the_stats.admitted.fetch_add(1, boost::memory_order_relaxed);
+    task();
+    return kAdmitted;
+  }
+
+  // game 서버에서 옮겨 온 세션은 OnClientRedirected() 가 표시해 둡니다.
+  // 옮겨 온 뒤 첫 로그인만 먼저 진행하고 IP 제한은 모두 받습니다.
+  const Ptr<PongSessionState> state = PongSessionState::Find(session);
+  const bool priority = state && state->TakeRedirected();
+  const string address = GetRemoteAddress(session);
+  const WallClock::Value now = WallClock::Now();
+
+  {
+    boost::mutex::scoped_lock lock(the_admission_mutex);
+
+    if (not address.empty() && FLAGS_login_rate_per_ip_per_sec > 0) {
+      std::pair<IpBucketMap::iterator, bool> inserted =
+          the_ip_buckets.insert(std::make_pair(address, TokenBucket()));
+      TokenBucket &bucket = inserted.first->second;
+      if (inserted.second) {
+        bucket.tokens = FLAGS_login_burst_per_ip;
+      }
+      Refill(&bucket, now, FLAGS_login_rate_per_ip_per_sec,
+             FLAGS_login_burst_per_ip);
+      if (bucket.tokens < 1) {
+        *retry_after_in_ms =
+            GetRetryAfterInMs(bucket, FLAGS_login_rate_per_ip_per_sec, 0);
+        the_stats.rejected_by_ip.fetch_add(1, boost::memory_order_relaxed);
+        return kRejected;
+      }
+      bucket.tokens -= 1;
+    }
+
+    Refill(&the_global_bucket, now, FLAGS_login_rate_per_sec,
+           FLAGS_login_burst);
+    const size_t waiting =
+        the_priority_queue.size() + the_login_queue.size();
+    if (waiting == 0 && the_global_bucket.tokens >= 1) {
+      the_global_bucket.tokens -= 1;
+    } else {
+      LoginQueue &queue = priority ? the_priority_queue : the_login_queue;
+      if (queue.size() >= static_cast<size_t>(FLAGS_login_queue_size)) {
+        *retry_after_in_ms = GetRetryAfterInMs(
+            the_global_bucket, FLAGS_login_rate_per_sec, waiting);
+        the_stats.rejected_by_queue.fetch_add(1,
+                                              boost::memory_order_relaxed);
+        return kRejected;
+      }
+
+      WaitingLogin login;
+      login.session = session;
+      login.task = task;
+      login.queued_time = now;
+      queue.push_back(login);
+      the_stats.queued.fetch_add(1, boost::memory_order_relaxed);
+      return kQueued;
+    }
+  }
+
+  the_stats.admitted.fetch_add(1, boost::memory_order_relaxed);
+  task();
+  return kAdmitted;
+}
+
+
+Json LoginAdmission::Dump() {
+  Json dump;
+  dump["admitted"] = the_stats.admitted.load();
+  dump["queued"] = the_stats.queued.load();
+  dump["rejected_by_ip"] = the_stats.rejected_by_ip.load();
+  dump["rejected_by_queue"] = the_stats.rejected_by_queue.load();
+  dump["abandoned"] = the_stats.abandoned.load();
+  dump["wait_in_ms"] = the_stats.wait_in_ms.load();
+  dump["max_wait_in_ms"] = the_stats.max_wait_in_ms.load();
+  {
+    boost::mutex::scoped_lock lock(the_admission_mutex);
+    dump["priority_queue"] = static_cast<int64_t>(the_priority_queue.size());
+    dump["queue"] = static_cast<int64_t>(the_login_queue.size());
+    dump["ip_buckets"] = static_cast<int64_t>(the_ip_buckets.size());
+  }
+  return dump;
+}
+
+}  // namespace pong
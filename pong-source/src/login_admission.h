@@ -0,0 +1,43 @@
+﻿#ifndef SRC_LOGIN_ADMISSION_H_
+#define SRC_LOGIN_ADMISSION_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 로그인 요청을 받아들이는 속도를 제한합니다.
+//
+// 서버 전체와 IP 마다 token bucket 을 두고, 서버 전체 token 이 없으면 정해진
+// 크기의 대기열에 넣어 token 이 생기는 대로 진행합니다. IP 의 token 이
+// 없거나 대기열이 차면 거절하며 다시 시도할 때까지의 시간을 알려 줍니다.
+// game 서버에서 돌아온 세션은 대기열에서 먼저 진행합니다. IP 제한은 모든
+// 세션이 받으며 기본값은 꺼져 있습니다.
+//
+// 통계는 API 서비스의 GET /v1/login_admission/ 로 볼 수 있습니다.
+class LoginAdmission {
+ public:
+  enum Result {
+    // 바로 task 를 불렀습니다.
+    kAdmitted = 0,
+    // 차례가 되면 session 의 event tag 에서 task 를 부릅니다.
+    kQueued,
+    kRejected
+  };
+
+  static void Install();
+
+  // kRejected 이면 retry_after_in_ms 에 다시 시도할 때까지의 시간을
+  // 채웁니다.
+  static Result Admit(const Ptr<Session> &session,
+                      const boost::function<void()> &task,
+                      int64_t *retry_after_in_ms);
+
+  static Json Dump();
+};
+
+}  // namespace pong
+
+#endif  // SRC_LOGIN_ADMISSION_H_
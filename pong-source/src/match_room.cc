@@ -0,0 +1,323 @@
+﻿#include "match_room.h"
+
+#include <boost/functional/hash.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+
+
+namespace pong {
+
+namespace {
+
+struct RoomSeat {
+  Ptr<MatchRoom> room;
+  PongSide side;
+};
+
+// 세션 포인터로 찾으므로 문자열 해시가 필요 없습니다.
+typedef boost::unordered_map<const Session *, RoomSeat> SessionRoomMap;
+
+// relay 마다 여러 이벤트 스레드에서 찾으므로 세션의 자리는 표를 나눠
+// 둡니다. 나머지 표는 Join/Leave 에서만 쓰므로 the_room_mutex 하나로
+// 지킵니다. 둘 다 잡을 때는 the_room_mutex 를 먼저 잡습니다.
+const size_t kSeatShardCount = 16;
+
+struct SeatShard {
+  boost::mutex mutex;
+  SessionRoomMap seats;
+};
+
+SeatShard the_seat_shards[kSeatShardCount];
+
+
+SeatShard &GetSeatShard(const Session *session) {
+  const size_t hash = boost::hash<const Session *>()(session);
+  return the_seat_shards[hash % kSeatShardCount];
+}
+
+// 상대를 기다리는 방입니다. 기다리는 상대의 id 로 찾습니다.
+typedef boost::unordered_map<string, Ptr<MatchRoom> > WaitingRoomMap;
+// 플레이어 id 로 방을 찾습니다.
+typedef boost::unordered_map<string, Ptr<MatchRoom> > PlayerRoomMap;
+
+boost::mutex the_room_mutex;
+WaitingRoomMap the_waiting_rooms;
+PlayerRoomMap the_player_rooms;
+size_t the_room_count = 0;
+
+MatchRoom::CreatedHandler the_created_handler;
+
+}  // unnamed namespace
+
+
+MatchRoom::MatchRoom(const string &id, const string &opponent_id)
+    : tag_(RandomGenerator::GenerateUuid()), created_time_(WallClock::Now()),
+      state_(kRoomReadyCheck) {
+  has_pending_relay_[kSideA] = false;
+  has_pending_relay_[kSideB] = false;
+  // id 순서로 A, B 를 정합니다.
+  const bool is_a = id < opponent_id;
+  ids_[kSideA] = is_a ? id : opponent_id;
+  ids_[kSideB] = is_a ? opponent_id : id;
+  ready_[kSideA] = false;
+  ready_[kSideB] = false;
+  remote_peers_[kSideA] = Rpc::kNullPeerId;
+  remote_peers_[kSideB] = Rpc::kNullPeerId;
+}
+
+
+void MatchRoom::RegisterCreatedHandler(const CreatedHandler &handler) {
+  the_created_handler = handler;
+}
+
+
+Ptr<MatchRoom> MatchRoom::Join(const Ptr<Session> &session, const string &id,
+                               const string &opponent_id) {
+  BOOST_ASSERT(session);
+
+  Ptr<MatchRoom> room;
+  bool created = false;
+  {
+    boost::mutex::scoped_lock lock(the_room_mutex);
+
+    WaitingRoomMap::iterator itr = the_waiting_rooms.find(id);
+    if (itr != the_waiting_rooms.end() &&
+        (itr->second->ids_[kSideA] == opponent_id ||
+         itr->second->ids_[kSideB] == opponent_id)) {
+      // 상대가 먼저 도착해서 기다리고 있었습니다.
+      room = itr->second;
+      the_waiting_rooms.erase(itr);
+    } else {
+      room.reset(new MatchRoom(id, opponent_id));
+      the_waiting_rooms[opponent_id] = room;
+      ++the_room_count;
+      created = true;
+    }
+
+    const PongSide side = room->ids_[kSideA] == id ? kSideA : kSideB;
+    {
+      boost::mutex::scoped_lock room_lock(room->mutex_);
+      room->sessions_[side] = session;
+      room->remote_peers_[side] = Rpc::kNullPeerId;
+    }
+
+    {
+      SeatShard &shard = GetSeatShard(session.get());
+      boost::mutex::scoped_lock seat_lock(shard.mutex);
+      RoomSeat &seat = shard.seats[session.get()];
+      seat.room = room;
+      seat.side = side;
+    }
+    the_player_rooms[id] = room;
+  }
+
+  if (created && the_created_handler) {
+    the_created_handler(room);
+  }
+  return room;
+}
+
+
+Ptr<MatchRoom> MatchRoom::Find(const Ptr<Session> &session, PongSide *side) {
+  BOOST_ASSERT(side);
+
+  SeatShard &shard = GetSeatShard(session.get());
+  boost::mutex::scoped_lock lock(shard.mutex);
+  SessionRoomMap::const_iterator itr = shard.seats.find(session.get());
+  if (itr == shard.seats.end()) {
+    return Ptr<MatchRoom>();
+  }
+  *side = itr->second.side;
+  return itr->second.room;
+}
+
+
+Ptr<MatchRoom> MatchRoom::FindByPlayerId(const string &id) {
+  boost::mutex::scoped_lock lock(the_room_mutex);
+  PlayerRoomMap::const_iterator itr = the_player_rooms.find(id);
+  if (itr == the_player_rooms.end()) {
+    return Ptr<MatchRoom>();
+  }
+  return itr->second;
+}
+
+
+void MatchRoom::Leave(const Ptr<Session> &session) {
+  boost::mutex::scoped_lock lock(the_room_mutex);
+  Ptr<MatchRoom> room;
+  PongSide side = kSideA;
+  {
+    SeatShard &shard = GetSeatShard(session.get());
+    boost::mutex::scoped_lock seat_lock(shard.mutex);
+    SessionRoomMap::iterator itr = shard.seats.find(session.get());
+    if (itr == shard.seats.end()) {
+      return;
+    }
+    room = itr->second.room;
+    side = itr->second.side;
+    shard.seats.erase(itr);
+  }
+
+  PlayerRoomMap::iterator player = the_player_rooms.find(room->ids_[side]);
+  if (player != the_player_rooms.end() && player->second == room) {
+    the_player_rooms.erase(player);
+  }
+
+  bool empty = false;
+  {
+    boost::mutex::scoped_lock room_lock(room->mutex_);
+    room->sessions_[side].reset();
+    empty = room->sessions_[GetOpponentSide(side)].expired();
+  }
+
+  // 상대를 기다리던 방이면 더 이상 기다리지 않습니다.
+  WaitingRoomMap::iterator waiting =
+      the_waiting_rooms.find(room->ids_[GetOpponentSide(side)]);
+  if (waiting != the_waiting_rooms.end() && waiting->second == room) {
+    the_waiting_rooms.erase(waiting);
+    empty = true;
+  }
+
+  if (empty) {
+    BOOST_ASSERT(the_room_count > 0);
+    --the_room_count;
+
+    const RelayStats &stats = room->relay_stats_;
+    LOG(INFO) << "Match room closed: a=" << room->ids_[kSideA]
+              << ", b=" << room->ids_[kSideB]
+              << ", relay_packets=" << stats.packets.load()
+              << ", relay_bytes=" << stats.bytes.load()
+              << ", relay_packed_bytes=" << stats.packed_bytes.load()
+              << ", relay_drops=" << stats.drops.load()
+              << ", relay_merges=" << stats.merges.load();
+    for (int i = kSideA; i <= kSideB; ++i) {
+      const RelayChannelStats &channel = room->relay_filters_[i].stats();
+      LOG(INFO) << "Relay channel stats: id=" << room->ids_[i]
+                << ", received=" << channel.received.load()
+                << ", lost=" << channel.lost.load()
+                << ", reordered=" << channel.reordered.load()
+                << ", duplicated=" << channel.duplicated.load();
+      LOG(INFO) << "Latency stats: id=" << room->ids_[i] << ", "
+                << room->latencies_[i].ToJson().ToString();
+    }
+  }
+}
+
+
+size_t MatchRoom::count() {
+  boost::mutex::scoped_lock lock(the_room_mutex);
+  return the_room_count;
+}
+
+
+Ptr<Session> MatchRoom::GetSession(PongSide side) const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return sessions_[side].lock();
+}
+
+
+void MatchRoom::SetRemotePeer(PongSide side, const Rpc::PeerId &peer_id) {
+  boost::mutex::scoped_lock lock(mutex_);
+  remote_peers_[side] = peer_id;
+}
+
+
+bool MatchRoom::GetRemotePeer(PongSide side, Rpc::PeerId *peer_id) const {
+  BOOST_ASSERT(peer_id);
+  boost::mutex::scoped_lock lock(mutex_);
+  if (remote_peers_[side].is_nil()) {
+    return false;
+  }
+  *peer_id = remote_peers_[side];
+  return true;
+}
+
+
+bool MatchRoom::SetReady(PongSide side) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (state_ != kRoomReadyCheck || ready_[side]) {
+    return false;
+  }
+  ready_[side] = true;
+  if (not ready_[GetOpponentSide(side)]) {
+    return false;
+  }
+  state_ = kRoomPlaying;
+  return true;
+}
+
+
+bool MatchRoom::IsReady(PongSide side) const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return ready_[side];
+}
+
+
+bool MatchRoom::ExpireReadyCheck() {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (state_ != kRoomReadyCheck) {
+    return false;
+  }
+  state_ = kRoomFinished;
+  return true;
+}
+
+
+bool MatchRoom::Finish() {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (state_ == kRoomFinished) {
+    return false;
+  }
+  state_ = kRoomFinished;
+  return true;
+}
+
+
+template <typename MessageType>
+bool MatchRoom::SetPendingRelay(PongSide to, const MessageType &message,
+                                MessageType *slots) {
+  boost::mutex::scoped_lock lock(mutex_);
+  const bool merged = has_pending_relay_[to];
+  slots[to] = message;
+  has_pending_relay_[to] = true;
+  return merged;
+}
+
+
+bool MatchRoom::SetPendingRelay(PongSide to, const Ptr<FunMessage> &message) {
+  return SetPendingRelay(to, message, pending_pbuf_relays_);
+}
+
+
+bool MatchRoom::SetPendingRelay(PongSide to, const Json &message) {
+  return SetPendingRelay(to, message, pending_json_relays_);
+}
+
+
+bool MatchRoom::TakePendingRelay(PongSide to, Ptr<FunMessage> *pbuf_message,
+                                 Json *json_message) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (not has_pending_relay_[to]) {
+    return false;
+  }
+  has_pending_relay_[to] = false;
+  pbuf_message->swap(pending_pbuf_relays_[to]);
+  pending_pbuf_relays_[to].reset();
+  *json_message = pending_json_relays_[to];
+  pending_json_relays_[to] = Json();
+  return true;
+}
+
+
+bool MatchRoom::finished() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return state_ == kRoomFinished;
+}
+
+
+MatchRoomState MatchRoom::state() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return state_;
+}
+
+}  // namespace pong
@@ -0,0 +1,144 @@
+﻿#ifndef SRC_MATCH_ROOM_H_
+#define SRC_MATCH_ROOM_H_
+
+#include <funapi.h>
+
+#include "latency_estimator.h"
+#include "pong_simulation.h"
+#include "relay_channel.h"
+#include "relay_codec.h"
+#include "relay_trace.h"
+#include "pong_types.h"
+#include "spectator_channel.h"
+
+
+namespace pong {
+
+enum MatchRoomState {
+  // 두 플레이어가 모두 ready 를 보내기를 기다립니다.
+  kRoomReadyCheck = 0,
+  kRoomPlaying,
+  kRoomFinished
+};
+
+
+// game 서버에서 매치 하나를 나타냅니다. 두 세션을 직접 가리키므로 relay,
+// ready, result 처리 시 Session Context 나 AccountManager 를 거치지 않고
+// 상대 세션을 찾을 수 있습니다.
+class MatchRoom : private boost::noncopyable {
+ public:
+  typedef boost::function<void(const Ptr<MatchRoom> &)> CreatedHandler;
+
+  MatchRoom(const string &id, const string &opponent_id);
+
+  // 새 방이 만들어지면 불립니다. ready check 마감 시간을 거는 데 씁니다.
+  static void RegisterCreatedHandler(const CreatedHandler &handler);
+
+  // redirect 된 세션이 도착하면 불립니다. 상대가 먼저 도착했다면 그 방에
+  // 들어가고, 아니면 새 방을 만들어 상대를 기다립니다.
+  static Ptr<MatchRoom> Join(const Ptr<Session> &session, const string &id,
+                             const string &opponent_id);
+  // 세션이 들어가 있는 방과 편을 찾습니다. relay 마다 불리므로 전역 lock
+  // 을 잡지 않고 세션별로 나눈 표만 봅니다.
+  static Ptr<MatchRoom> Find(const Ptr<Session> &session, PongSide *side);
+  // 플레이어가 들어가 있는 방을 찾습니다. 관전할 매치를 찾을 때 씁니다.
+  static Ptr<MatchRoom> FindByPlayerId(const string &id);
+  // 세션을 방에서 뺍니다. 세션이 닫힐 때 불립니다.
+  static void Leave(const Ptr<Session> &session);
+  static size_t count();
+
+  // 두 플레이어의 ready, result, 연결 종료 처리와 tick 은 모두 이 event
+  // tag 로 실행합니다. 매치 안에서는 직렬화되고 매치끼리는 여러 이벤트
+  // 스레드에서 동시에 실행됩니다.
+  const EventTag &tag() const { return tag_; }
+
+  const string &GetPlayerId(PongSide side) const { return ids_[side]; }
+  Ptr<Session> GetSession(PongSide side) const;
+
+  // 준비 상태로 바꿉니다. 이번 호출로 두 플레이어가 모두 준비되었으면
+  // kRoomPlaying 으로 바꾸고 true 를 반환합니다.
+  bool SetReady(PongSide side);
+  bool IsReady(PongSide side) const;
+  // ready check 가 마감되었을 때 불립니다. 아직 ready check 중이었으면
+  // 매치를 끝내고 true 를 반환합니다.
+  bool ExpireReadyCheck();
+  // 방이 만들어진 시각입니다. ready check 는 이때부터 시작합니다.
+  const WallClock::Value &created_time() const { return created_time_; }
+
+  // 매치를 끝냅니다. 처음 호출한 쪽만 true 를 받습니다.
+  bool Finish();
+  bool finished() const;
+  MatchRoomState state() const;
+
+  // side 플레이어가 다른 game 서버에 있으면 그 서버를 기록합니다. 그
+  // 플레이어가 이 서버에 들어오면 지워집니다.
+  void SetRemotePeer(PongSide side, const Rpc::PeerId &peer_id);
+  bool GetRemotePeer(PongSide side, Rpc::PeerId *peer_id) const;
+
+  RelayStats *relay_stats() { return &relay_stats_; }
+  SpectatorChannel &spectators() { return spectators_; }
+  // side 세션의 왕복 지연 시간입니다.
+  LatencyEstimator &latency(PongSide side) { return latencies_[side]; }
+  const LatencyEstimator &latency(PongSide side) const {
+    return latencies_[side];
+  }
+  // side 가 보내는 relay 의 sequence 검사기입니다.
+  RelaySequenceFilter &relay_filter(PongSide side) {
+    return relay_filters_[side];
+  }
+
+  // to 에게 보낼 relay 를 맡깁니다. 아직 보내지 않은 relay 가 있었다면
+  // 새 relay 로 교체하고 true 를 반환합니다. 위치 상태는 최신 값만
+  // 의미가 있으므로 세션마다 한 칸만 둡니다.
+  bool SetPendingRelay(PongSide to, const Ptr<FunMessage> &message);
+  bool SetPendingRelay(PongSide to, const Json &message);
+  // 맡겨 둔 relay 를 꺼냅니다. 인코딩에 맞는 쪽만 채워집니다.
+  bool TakePendingRelay(PongSide to, Ptr<FunMessage> *pbuf_message,
+                        Json *json_message);
+
+  // 아래 값들은 서버 권한 모드에서 씁니다. mutex() 를 잡고 접근합니다.
+  boost::mutex &mutex() const { return mutex_; }
+  PongSimulation &simulation() { return simulation_; }
+  // side 로 보내는 snapshot 과 side 에게서 받는 입력의 압축 상태입니다.
+  RelayEncoder &snapshot_encoder(PongSide side) {
+    return snapshot_encoders_[side];
+  }
+  RelayDecoder &input_decoder(PongSide side) { return input_decoders_[side]; }
+
+ private:
+  template <typename MessageType>
+  bool SetPendingRelay(PongSide to, const MessageType &message,
+                       MessageType *slots);
+
+  const EventTag tag_;
+  const WallClock::Value created_time_;
+  mutable boost::mutex mutex_;
+  // 인덱스는 PongSide 입니다.
+  string ids_[2];
+  weak_ptr<Session> sessions_[2];
+  Rpc::PeerId remote_peers_[2];
+  bool ready_[2];
+  MatchRoomState state_;
+
+  RelayStats relay_stats_;
+  SpectatorChannel spectators_;
+  RelaySequenceFilter relay_filters_[2];
+  LatencyEstimator latencies_[2];
+
+  bool has_pending_relay_[2];
+  Ptr<FunMessage> pending_pbuf_relays_[2];
+  Json pending_json_relays_[2];
+
+  PongSimulation simulation_;
+  RelayEncoder snapshot_encoders_[2];
+  RelayDecoder input_decoders_[2];
+};
+
+
+inline PongSide GetOpponentSide(PongSide side) {
+  return side == kSideA ? kSideB : kSideA;
+}
+
+}  // namespace pong
+
+#endif  // SRC_MATCH_ROOM_H_
@@ -0,0 +1,118 @@
+﻿#include "match_ticker.h"
+
+#include <boost/atomic.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+
+
+namespace pong {
+
+namespace {
+
+struct TickEntry {
+  TickEntry(const MatchTicker::Task &_task, const EventTag &_tag)
+      : task(_task), tag(_tag), running(false), done(false) {
+  }
+
+  MatchTicker::Task task;
+  EventTag tag;
+  // 작업의 event 에서 바꾸고 timer 에서 읽습니다.
+  boost::atomic<bool> running;
+  boost::atomic<bool> done;
+};
+
+boost::mutex the_pending_mutex;
+std::vector<Ptr<TickEntry> > the_pending_entries;
+
+// 아래 값들은 tick 이벤트 안에서만 접근합니다.
+boost::mutex the_tick_mutex;
+std::vector<Ptr<TickEntry> > the_entries;
+int64_t the_tick = 0;
+
+WallClock::Duration the_interval;
+size_t the_task_count = 0;
+
+
+void RunTask(const Ptr<TickEntry> &entry, int64_t tick) {
+  if (not entry->task(tick)) {
+    entry->done.store(true, boost::memory_order_release);
+  }
+  entry->running.store(false, boost::memory_order_release);
+}
+
+
+void OnTick(const Timer::Id &/*timer_id*/, const WallClock::Value &/*now*/) {
+  // 이전 tick 이 아직 끝나지 않았으면 이번 tick 은 건너뜁니다.
+  boost::mutex::scoped_try_lock tick_lock(the_tick_mutex);
+  if (not tick_lock.owns_lock()) {
+    // the_entries 는 실행 중인 tick 이 바꾸므로 읽지 않습니다.
+    LOG(WARNING) << "Match tick overrun: tasks=" << MatchTicker::task_count();
+    return;
+  }
+
+  {
+    boost::mutex::scoped_lock lock(the_pending_mutex);
+    the_entries.insert(the_entries.end(), the_pending_entries.begin(),
+                       the_pending_entries.end());
+    the_pending_entries.clear();
+  }
+
+  ++the_tick;
+
+  // 끝난 작업은 마지막 작업과 자리를 바꿔 제거합니다.
+  size_t i = 0;
+  while (i < the_entries.size()) {
+    const Ptr<TickEntry> &entry = the_entries[i];
+    if (entry->done.load(boost::memory_order_acquire)) {
+      if (i + 1 != the_entries.size()) {
+        the_entries[i].swap(the_entries.back());
+      }
+      the_entries.pop_back();
+      continue;
+    }
+
+    if (entry->running.exchange(true, boost::memory_order_acq_rel)) {
+      // 이 매치의 이전 tick 이 아직 처리 중입니다.
+      LOG_EVERY_N(WARNING, 100) << "Match task overrun: tick=" << the_tick;
+    } else {
+      Event::Invoke(bind(&RunTask, entry, the_tick), entry->tag);
+    }
+    ++i;
+  }
+
+  boost::mutex::scoped_lock lock(the_pending_mutex);
+  the_task_count = the_entries.size() + the_pending_entries.size();
+}
+
+}  // unnamed namespace
+
+
+void MatchTicker::Start(const WallClock::Duration &interval) {
+  BOOST_ASSERT(interval.total_milliseconds() > 0);
+  the_interval = interval;
+  Timer::ExpireRepeatedly(interval, OnTick);
+  LOG(INFO) << "Match ticker started: interval="
+            << interval.total_milliseconds() << "ms";
+}
+
+
+void MatchTicker::Add(const Task &task, const EventTag &tag) {
+  // 실행 중인 tick 과 겹치지 않도록 다음 tick 에서 합류합니다.
+  Ptr<TickEntry> entry(new TickEntry(task, tag));
+  boost::mutex::scoped_lock lock(the_pending_mutex);
+  the_pending_entries.push_back(entry);
+  ++the_task_count;
+}
+
+
+float MatchTicker::interval_in_sec() {
+  return the_interval.total_microseconds() / 1000000.0f;
+}
+
+
+size_t MatchTicker::task_count() {
+  boost::mutex::scoped_lock lock(the_pending_mutex);
+  return the_task_count;
+}
+
+}  // namespace pong
@@ -0,0 +1,31 @@
+﻿#ifndef SRC_MATCH_TICKER_H_
+#define SRC_MATCH_TICKER_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 등록된 작업들을 고정 주기로 실행합니다. 매치마다 Timer 를 만들지 않고
+// 하나의 Timer 에서 배열을 순회합니다. 작업은 Timer 에서 직접 돌리지 않고
+// 등록할 때 준 event tag 로 넘기므로 매치마다 직렬화되면서 여러 이벤트
+// 스레드에 나뉘어 실행됩니다.
+class MatchTicker {
+ public:
+  // 인자는 tick 번호입니다. false 를 반환하면 더 이상 불리지 않습니다.
+  typedef boost::function<bool(int64_t)> Task;
+
+  static void Start(const WallClock::Duration &interval);
+  // 보통 MatchRoom::tag() 를 넘깁니다. 이전 tick 의 작업이 아직 끝나지
+  // 않았으면 그 작업의 이번 tick 은 건너뜁니다.
+  static void Add(const Task &task, const EventTag &tag);
+
+  static float interval_in_sec();
+  static size_t task_count();
+};
+
+}  // namespace pong
+
+#endif  // SRC_MATCH_TICKER_H_
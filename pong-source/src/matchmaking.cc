@@ -1,5 +1,8 @@
-﻿#include <funapi.h>
+﻿#include <boost/uuid/string_generator.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
 
+#include "game_server_load.h"
 #include "matchmaking.h"
 #include "pong_types.h"
 
@@ -44,6 +47,12 @@ void OnJoined(const MatchmakingServer::Player &player,
   } else {
     BOOST_ASSERT(not HasJsonStringAttribute(match->context, "B"));
     match->context["B"] = player.id;
+
+    // 두 플레이어가 같은 game 서버로 가도록 여기서 한 번만 고릅니다.
+    const Rpc::PeerId server = GameServerLoad::PickGameServer();
+    if (not server.is_nil()) {
+      match->context["server"] = to_string(server);
+    }
   }
 }
 
@@ -62,12 +71,27 @@ void OnLeft(const MatchmakingServer::Player &player,
                  match->context["B"].GetString() == player.id);
     match->context.RemoveAttribute("B");
   }
+
+  // 남은 플레이어는 다음 상대와 다시 고릅니다. 고를 때 더해 둔 매치는
+  // 뺍니다.
+  if (HasJsonStringAttribute(match->context, "server")) {
+    const string server = match->context["server"].GetString();
+    match->context.RemoveAttribute("server");
+    try {
+      GameServerLoad::ReleaseGameServer(
+          boost::uuids::string_generator()(server));
+    } catch (const std::runtime_error &) {
+      LOG(ERROR) << "Invalid game server in match context: server="
+                 << server;
+    }
+  }
 }
 
 }  // unnamed namespace
 
 
 void StartMatchmakingServer() {
+  GameServerLoad::InstallCollector();
   MatchmakingServer::Start(CheckJoinable, CheckCompletion, OnJoined, OnLeft);
 }
 
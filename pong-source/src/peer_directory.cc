@@ -0,0 +1,271 @@
+﻿#include "peer_directory.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_set.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+
+
+DECLARE_int32(game_load_report_interval_in_ms);
+
+DEFINE_int32(peer_directory_refresh_in_ms, 1000,
+             "Refreshes the cached server list of each RPC tag at this "
+             "interval");
+
+
+namespace pong {
+
+namespace {
+
+const boost::posix_time::ptime kUnixEpoch(boost::gregorian::date(1970, 1, 1));
+
+
+struct PeerLoad {
+  PeerLoad() : load(0), reported_in_ms(0) {}
+
+  boost::atomic<int64_t> load;
+  // 마지막으로 부하를 받은 시각입니다. 받은 적이 없으면 0 입니다.
+  boost::atomic<int64_t> reported_in_ms;
+};
+
+struct PeerEntry {
+  Rpc::PeerId id;
+  // 같은 서버는 모든 tag 의 목록에서 같은 값을 가리킵니다.
+  Ptr<PeerLoad> load;
+};
+
+// 한 번 만든 목록은 바꾸지 않고 통째로 교체합니다.
+typedef std::vector<PeerEntry> PeerList;
+
+struct CachedPeerList {
+  CachedPeerList() : generation(0) {}
+
+  Ptr<const PeerList> peers;
+  // peers 를 읽기 시작한 순서입니다. 늦게 끝난 갱신이 더 최근 목록을
+  // 덮어쓰지 않도록 더 큰 값만 씁니다.
+  uint64_t generation;
+};
+
+typedef boost::unordered_map<Rpc::Tag, CachedPeerList> PeerListMap;
+typedef boost::unordered_map<Rpc::PeerId, Ptr<PeerLoad>,
+                             boost::hash<Rpc::PeerId> > PeerLoadMap;
+
+boost::mutex the_directory_mutex;
+PeerListMap the_peer_lists;
+PeerLoadMap the_peer_loads;
+uint64_t the_last_generation = 0;
+
+
+int64_t GetNowInMsec() {
+  return (WallClock::Now() - kUnixEpoch).total_milliseconds();
+}
+
+
+// the_directory_mutex 를 잡고 불러야 합니다.
+const Ptr<PeerLoad> &GetPeerLoad(const Rpc::PeerId &peer_id) {
+  Ptr<PeerLoad> &load = the_peer_loads[peer_id];
+  if (not load) {
+    load.reset(new PeerLoad);
+  }
+  return load;
+}
+
+
+// 부하를 보고하던 서버가 보고 주기 3 번 동안 조용하면 죽은 것으로 보고
+// 고르지 않습니다. 보고한 적이 없는 서버는 그대로 고릅니다.
+bool IsStale(const PeerLoad &load, int64_t now_in_ms) {
+  const int64_t reported_in_ms =
+      load.reported_in_ms.load(boost::memory_order_relaxed);
+  return reported_in_ms > 0 &&
+         now_in_ms - reported_in_ms >
+             3 * static_cast<int64_t>(FLAGS_game_load_report_interval_in_ms);
+}
+
+
+bool IsSamePeers(const PeerList &lhs, const PeerList &rhs) {
+  if (lhs.size() != rhs.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < lhs.size(); ++i) {
+    if (lhs[i].id != rhs[i].id) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+Ptr<const PeerList> Refresh(const Rpc::Tag &tag) {
+  uint64_t generation = 0;
+  {
+    boost::mutex::scoped_lock lock(the_directory_mutex);
+    generation = ++the_last_generation;
+  }
+
+  // PeerMap 을 복사하는 동안 lock 을 잡지 않습니다.
+  Rpc::PeerMap servers;
+  Rpc::GetPeersWithTag(&servers, tag);
+
+  Ptr<PeerList> peers(new PeerList);
+  peers->reserve(servers.size());
+
+  boost::mutex::scoped_lock lock(the_directory_mutex);
+  CachedPeerList &cached = the_peer_lists[tag];
+  if (generation < cached.generation) {
+    // 나중에 읽기 시작한 목록이 이미 들어와 있습니다.
+    return cached.peers;
+  }
+
+  for (Rpc::PeerMap::const_iterator itr = servers.begin();
+       itr != servers.end(); ++itr) {
+    PeerEntry entry;
+    entry.id = itr->first;
+    entry.load = GetPeerLoad(itr->first);
+    peers->push_back(entry);
+  }
+
+  cached.generation = generation;
+  if (not cached.peers || not IsSamePeers(*cached.peers, *peers)) {
+    LOG(INFO) << "Peer directory updated: tag=" << tag
+              << ", peers=" << peers->size();
+    cached.peers = peers;
+  }
+  return cached.peers;
+}
+
+
+// 어느 목록에도 없는 서버의 부하를 지웁니다. the_directory_mutex 를 잡고
+// 불러야 합니다.
+void EraseUnlistedLoads() {
+  boost::unordered_set<Rpc::PeerId, boost::hash<Rpc::PeerId> > listed;
+  for (PeerListMap::const_iterator itr = the_peer_lists.begin();
+       itr != the_peer_lists.end(); ++itr) {
+    const PeerList &peers = *itr->second.peers;
+    for (size_t i = 0; i < peers.size(); ++i) {
+      listed.insert(peers[i].id);
+    }
+  }
+  for (PeerLoadMap::iterator itr = the_peer_loads.begin();
+       itr != the_peer_loads.end(); ) {
+    if (listed.find(itr->first) == listed.end()) {
+      itr = the_peer_loads.erase(itr);
+    } else {
+      ++itr;
+    }
+  }
+}
+
+
+void RefreshAll(const Timer::Id &/*timer_id*/,
+                const WallClock::Value &/*now*/) {
+  std::vector<Rpc::Tag> tags;
+  {
+    boost::mutex::scoped_lock lock(the_directory_mutex);
+    for (PeerListMap::const_iterator itr = the_peer_lists.begin();
+         itr != the_peer_lists.end(); ++itr) {
+      tags.push_back(itr->first);
+    }
+  }
+  for (size_t i = 0; i < tags.size(); ++i) {
+    Refresh(tags[i]);
+  }
+
+  boost::mutex::scoped_lock lock(the_directory_mutex);
+  EraseUnlistedLoads();
+}
+
+
+Ptr<const PeerList> GetPeerList(const Rpc::Tag &tag) {
+  {
+    boost::mutex::scoped_lock lock(the_directory_mutex);
+    PeerListMap::const_iterator itr = the_peer_lists.find(tag);
+    if (itr != the_peer_lists.end() && itr->second.peers) {
+      return itr->second.peers;
+    }
+  }
+  return Refresh(tag);
+}
+
+
+// 부하가 오래된 서버는 가장 바쁜 것으로 봅니다.
+int64_t GetEffectiveLoad(const PeerEntry &entry, int64_t now_in_ms) {
+  if (IsStale(*entry.load, now_in_ms)) {
+    return std::numeric_limits<int64_t>::max();
+  }
+  return entry.load->load.load(boost::memory_order_relaxed);
+}
+
+}  // unnamed namespace
+
+
+void PeerDirectory::Start() {
+  Timer::ExpireRepeatedly(
+      WallClock::FromMsec(FLAGS_peer_directory_refresh_in_ms), RefreshAll);
+}
+
+
+Rpc::PeerId PeerDirectory::Pick(const Rpc::Tag &tag) {
+  Ptr<const PeerList> peers = GetPeerList(tag);
+  if (peers->empty()) {
+    return Rpc::kNullPeerId;
+  }
+
+  const int64_t now_in_ms = GetNowInMsec();
+  const int64_t last = peers->size() - 1;
+  const PeerEntry &first = (*peers)[RandomGenerator::GenerateNumber(0, last)];
+  const PeerEntry &second =
+      (*peers)[RandomGenerator::GenerateNumber(0, last)];
+  const int64_t first_load = GetEffectiveLoad(first, now_in_ms);
+  const int64_t second_load = GetEffectiveLoad(second, now_in_ms);
+  if (first_load != std::numeric_limits<int64_t>::max() ||
+      second_load != std::numeric_limits<int64_t>::max()) {
+    return first_load <= second_load ? first.id : second.id;
+  }
+
+  // 둘 다 보고가 끊겼으면 살아 있는 서버를 찾습니다. 모두 끊겼으면 다음
+  // 갱신에서 목록이 바뀔 때까지 그대로 씁니다.
+  for (size_t i = 0; i < peers->size(); ++i) {
+    if (not IsStale(*(*peers)[i].load, now_in_ms)) {
+      return (*peers)[i].id;
+    }
+  }
+  return first.id;
+}
+
+
+bool PeerDirectory::Contains(const Rpc::Tag &tag,
+                             const Rpc::PeerId &peer_id) {
+  Ptr<const PeerList> peers = GetPeerList(tag);
+  for (size_t i = 0; i < peers->size(); ++i) {
+    if ((*peers)[i].id == peer_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void PeerDirectory::GetPeers(const Rpc::Tag &tag,
+                             std::vector<Rpc::PeerId> *peers) {
+  BOOST_ASSERT(peers);
+  Ptr<const PeerList> cached = GetPeerList(tag);
+  peers->clear();
+  for (size_t i = 0; i < cached->size(); ++i) {
+    peers->push_back((*cached)[i].id);
+  }
+}
+
+
+void PeerDirectory::UpdateLoad(const Rpc::PeerId &peer_id, int64_t load) {
+  const int64_t now_in_ms = GetNowInMsec();
+  boost::mutex::scoped_lock lock(the_directory_mutex);
+  const Ptr<PeerLoad> &peer_load = GetPeerLoad(peer_id);
+  peer_load->load.store(load, boost::memory_order_relaxed);
+  peer_load->reported_in_ms.store(now_in_ms, boost::memory_order_relaxed);
+}
+
+}  // namespace pong
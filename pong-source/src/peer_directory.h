@@ -0,0 +1,40 @@
+﻿#ifndef SRC_PEER_DIRECTORY_H_
+#define SRC_PEER_DIRECTORY_H_
+
+#include <vector>
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// tag 별 서버 목록을 캐시합니다.
+//
+// Rpc::GetPeersWithTag() 는 부를 때마다 PeerMap 을 새로 만들어 복사하므로
+// redirect 마다 부르지 않고, 타이머로 주기적으로 갱신한 목록을 tag 마다
+// 배열로 둡니다. 처음 보는 tag 는 그 자리에서 읽어 옵니다. 엔진이 서버
+// 가입/탈퇴를 알려주지 않으므로 목록은 갱신 주기만큼 늦을 수 있습니다.
+// 갱신이 겹치면 나중에 읽기 시작한 목록만 남깁니다.
+//
+// 고를 때는 무작위로 두 서버를 뽑아 부하가 작은 쪽을 씁니다. 부하는
+// UpdateLoad() 로 받은 값이며, 받은 적이 없으면 0 으로 보므로 무작위로
+// 고르는 것과 같습니다. 보고하던 서버의 부하가 보고 주기 3 번보다 오래되면
+// 죽은 서버로 보고 다른 서버가 있는 한 고르지 않습니다.
+class PeerDirectory {
+ public:
+  static void Start();
+
+  // tag 서버 중 하나를 고릅니다. 없으면 Rpc::kNullPeerId 입니다.
+  static Rpc::PeerId Pick(const Rpc::Tag &tag);
+  static bool Contains(const Rpc::Tag &tag, const Rpc::PeerId &peer_id);
+  static void GetPeers(const Rpc::Tag &tag, std::vector<Rpc::PeerId> *peers);
+
+  // 작을수록 여유가 있는 값입니다.
+  static void UpdateLoad(const Rpc::PeerId &peer_id, int64_t load);
+};
+
+}  // namespace pong
+
+#endif  // SRC_PEER_DIRECTORY_H_
@@ -0,0 +1,302 @@
+﻿#include "pong_codec.h"
+
+#include "response_pool.h"
+
+#include "pong_messages.pb.h"
+
+
+namespace pong {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// JSON
+//
+////////////////////////////////////////////////////////////////////////////////
+
+Json PongCodec<kJsonEncoding>::LoginSucceeded(const PongLoginRecord &record) {
+  Json message = MakeResponse("ok");
+  message["id"] = record.id;
+  message["winCount"] = record.win_count;
+  message["loseCount"] = record.lose_count;
+  message["curRecord"] = record.cur_record;
+  message["singleWinCount"] = record.win_count_single;
+  message["singleLoseCount"] = record.lose_count_single;
+  message["singleCurRecord"] = record.cur_record_single;
+  return message;
+}
+
+
+Json PongCodec<kJsonEncoding>::LoginFailed(const string &reason) {
+  return MakeResponse("nop", reason);
+}
+
+
+Json PongCodec<kJsonEncoding>::LoginBusy(int64_t retry_after_in_ms) {
+  Json message = MakeResponse("busy", "too many logins");
+  message["retryAfterMs"] = retry_after_in_ms;
+  return message;
+}
+
+
+Json PongCodec<kJsonEncoding>::MatchSucceeded(const string &player_a_id,
+                                              const string &player_b_id) {
+  Json message = MakeResponse("Success");
+  message["A"] = player_a_id;
+  message["B"] = player_b_id;
+  return message;
+}
+
+
+Json PongCodec<kJsonEncoding>::MatchResult(const string &result) {
+  return MakeResponse(result);
+}
+
+
+Json PongCodec<kJsonEncoding>::RankList(
+    const LeaderboardQueryResponse &response) {
+  Json message;
+  for (size_t i = 0; i < response.records.size(); ++i) {
+    string index = std::to_string(i);
+    message["ranks"][index]["rank"] = response.records[i].rank;
+    message["ranks"][index]["score"] = response.records[i].score;
+    message["ranks"][index]["id"] = response.records[i].player_account.id();
+  }
+  return message;
+}
+
+
+Json PongCodec<kJsonEncoding>::Snapshot(const PongState &view, int64_t tick) {
+  Json message;
+  message["ballX"] = static_cast<double>(view.ball_x);
+  message["ballY"] = static_cast<double>(view.ball_y);
+  message["ballVX"] = static_cast<double>(view.ball_vx);
+  message["ballVY"] = static_cast<double>(view.ball_vy);
+  message["barX"] = static_cast<double>(view.bar_x[1]);
+  message["timeSeq"] = tick;
+  return message;
+}
+
+
+Json PongCodec<kJsonEncoding>::LatencyProbe(int64_t server_time) {
+  Json message;
+  message["serverTime"] = server_time;
+  return message;
+}
+
+
+Json PongCodec<kJsonEncoding>::SpectateSucceeded(const string &player_a_id,
+                                                 const string &player_b_id) {
+  Json message = MakeResponse("ok");
+  message["A"] = player_a_id;
+  message["B"] = player_b_id;
+  return message;
+}
+
+
+Json PongCodec<kJsonEncoding>::SpectateResult(const string &result) {
+  return MakeResponse(result);
+}
+
+
+string PongCodec<kJsonEncoding>::SerializeRelay(const Json &relay) {
+  return relay.ToString();
+}
+
+
+// relay 는 JSON 을 직렬화한 문자열로 담습니다.
+Json PongCodec<kJsonEncoding>::SpectateFrame(PongSide side,
+                                             const string &relay) {
+  Json message;
+  message["side"] = side == kSideA ? "A" : "B";
+  message["relay"] = relay;
+  return message;
+}
+
+
+const Json &PongCodec<kJsonEncoding>::GameStart() {
+  return ResponsePool::GameStartJson();
+}
+
+
+const Json &PongCodec<kJsonEncoding>::GameResult(bool win) {
+  return ResponsePool::GameResultJson(win);
+}
+
+
+const Json &PongCodec<kJsonEncoding>::GameVoided() {
+  return ResponsePool::GameVoidedJson();
+}
+
+
+const Json &PongCodec<kJsonEncoding>::NotLoggedIn() {
+  return ResponsePool::NotLoggedInJson();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Protobuf
+//
+////////////////////////////////////////////////////////////////////////////////
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::LoginSucceeded(
+    const PongLoginRecord &record) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  LobbyLoginReply *login_reply = message->MutableExtension(lobby_login_repl);
+  login_reply->set_result("ok");
+  login_reply->set_id(record.id);
+  login_reply->set_win_count(record.win_count);
+  login_reply->set_lose_count(record.lose_count);
+  login_reply->set_cur_record(record.cur_record);
+  login_reply->set_win_count_single(record.win_count_single);
+  login_reply->set_lose_count_single(record.lose_count_single);
+  login_reply->set_cur_record_single(record.cur_record_single);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::LoginFailed(
+    const string &reason) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  LobbyLoginReply *login_reply = message->MutableExtension(lobby_login_repl);
+  login_reply->set_result("nop");
+  login_reply->set_msg(reason);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::LoginBusy(
+    int64_t retry_after_in_ms) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  LobbyLoginReply *login_reply = message->MutableExtension(lobby_login_repl);
+  login_reply->set_result("busy");
+  login_reply->set_msg("too many logins");
+  login_reply->set_retry_after_in_ms(retry_after_in_ms);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::MatchSucceeded(
+    const string &player_a_id, const string &player_b_id) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  LobbyMatchReply *match_reply = message->MutableExtension(lobby_match_repl);
+  match_reply->set_result("Success");
+  match_reply->set_player1(player_a_id);
+  match_reply->set_player2(player_b_id);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::MatchResult(
+    const string &result) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  message->MutableExtension(lobby_match_repl)->set_result(result);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::RankList(
+    const LeaderboardQueryResponse &response) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  LobbyRankListReply *rank_reply =
+      message->MutableExtension(lobby_rank_list_repl);
+  rank_reply->set_result("Success");
+  for (size_t i = 0; i < response.records.size(); ++i) {
+    LobbyRankListReply::RankElement *elem = rank_reply->add_rank();
+    elem->set_rank(response.records[i].rank);
+    elem->set_score(response.records[i].score);
+    elem->set_id(response.records[i].player_account.id());
+  }
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::Snapshot(const PongState &view,
+                                                       int64_t tick) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  GameRelayMessage *relay_msg = message->MutableExtension(game_relay);
+  relay_msg->set_ballx(view.ball_x);
+  relay_msg->set_bally(view.ball_y);
+  relay_msg->set_ballvx(view.ball_vx);
+  relay_msg->set_ballvy(view.ball_vy);
+  relay_msg->set_barx(view.bar_x[1]);
+  relay_msg->set_timeseq(tick);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::PackedSnapshot(
+    const string &packed) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  message->MutableExtension(game_relay)->set_packed(packed);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::LatencyProbe(
+    int64_t server_time) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  message->MutableExtension(game_latency)->set_server_time(server_time);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::SpectateSucceeded(
+    const string &player_a_id, const string &player_b_id) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  GameSpectateReply *spectate_reply =
+      message->MutableExtension(game_spectate_repl);
+  spectate_reply->set_result("ok");
+  spectate_reply->set_player1(player_a_id);
+  spectate_reply->set_player2(player_b_id);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::SpectateResult(
+    const string &result) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  message->MutableExtension(game_spectate_repl)->set_result(result);
+  return message;
+}
+
+
+string PongCodec<kProtobufEncoding>::SerializeRelay(
+    const Ptr<FunMessage> &relay) {
+  if (not relay->HasExtension(game_relay)) {
+    return string();
+  }
+  return relay->GetExtension(game_relay).SerializeAsString();
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::SpectateFrame(
+    PongSide side, const string &relay) {
+  Ptr<FunMessage> message = ResponsePool::Acquire();
+  GameSpectateFrame *frame = message->MutableExtension(game_spectate_frame);
+  frame->set_side(side == kSideA ? "A" : "B");
+  frame->set_relay(relay);
+  return message;
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::GameStart() {
+  return ResponsePool::GameStart();
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::GameResult(bool win) {
+  return ResponsePool::GameResult(win);
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::GameVoided() {
+  return ResponsePool::GameVoided();
+}
+
+
+Ptr<FunMessage> PongCodec<kProtobufEncoding>::NotLoggedIn() {
+  return ResponsePool::NotLoggedIn();
+}
+
+}  // namespace pong
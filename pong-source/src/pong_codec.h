@@ -0,0 +1,104 @@
+﻿#ifndef SRC_PONG_CODEC_H_
+#define SRC_PONG_CODEC_H_
+
+#include <funapi.h>
+
+#include "pong_simulation.h"
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 로그인 성공 응답에 담는 전적입니다.
+struct PongLoginRecord {
+  PongLoginRecord()
+      : win_count(0), lose_count(0), cur_record(0), win_count_single(0),
+        lose_count_single(0), cur_record_single(0) {
+  }
+
+  string id;
+  int64_t win_count;
+  int64_t lose_count;
+  int64_t cur_record;
+  int64_t win_count_single;
+  int64_t lose_count_single;
+  int64_t cur_record_single;
+};
+
+
+// 클라이언트로 보내는 메시지를 인코딩별로 만듭니다.
+//
+// 메시지마다 JSON 과 Protobuf 구현을 한 곳에 둡니다. 핸들러는
+// PongCodec<kEncoding> 을 쓰는 템플릿으로 인코딩마다 따로 인스턴스화
+// 되므로 메시지를 보낼 때마다 인코딩을 비교하지 않습니다.
+//
+// Message 는 Session::SendMessage() 에 그대로 넘길 수 있는 타입입니다.
+template <EncodingScheme kEncoding>
+struct PongCodec;
+
+
+template <>
+struct PongCodec<kJsonEncoding> {
+  typedef Json Message;
+
+  static Message LoginSucceeded(const PongLoginRecord &record);
+  static Message LoginFailed(const string &reason);
+  // 로그인이 몰려서 받지 않았습니다. retry_after_in_ms 뒤에 다시 보냅니다.
+  static Message LoginBusy(int64_t retry_after_in_ms);
+  static Message MatchSucceeded(const string &player_a_id,
+                                const string &player_b_id);
+  // "AlreadyRequested", "Timeout", "Cancel" 등 결과만 담은 응답입니다.
+  static Message MatchResult(const string &result);
+  static Message RankList(const LeaderboardQueryResponse &response);
+  static Message Snapshot(const PongState &view, int64_t tick);
+  // 클라이언트가 그대로 돌려보낼 RTT 측정용 메시지입니다.
+  static Message LatencyProbe(int64_t server_time);
+  static Message SpectateSucceeded(const string &player_a_id,
+                                   const string &player_b_id);
+  static Message SpectateResult(const string &result);
+  // 관전자에게 보낼 relay 를 한 번만 직렬화합니다.
+  static string SerializeRelay(const Message &relay);
+  // SerializeRelay() 로 직렬화한 side 의 relay 를 관전자에게 보낼 형태로
+  // 감쌉니다. 관전자마다 직렬화한 relay 를 복사하기만 합니다.
+  static Message SpectateFrame(PongSide side, const string &relay);
+
+  // 내용이 바뀌지 않으므로 공유하는 메시지를 돌려줍니다.
+  static const Message &GameStart();
+  static const Message &GameResult(bool win);
+  // ready check 가 마감되어 승패 없이 끝난 매치입니다.
+  static const Message &GameVoided();
+  static const Message &NotLoggedIn();
+};
+
+
+template <>
+struct PongCodec<kProtobufEncoding> {
+  typedef Ptr<FunMessage> Message;
+
+  static Message LoginSucceeded(const PongLoginRecord &record);
+  static Message LoginFailed(const string &reason);
+  static Message LoginBusy(int64_t retry_after_in_ms);
+  static Message MatchSucceeded(const string &player_a_id,
+                                const string &player_b_id);
+  static Message MatchResult(const string &result);
+  static Message RankList(const LeaderboardQueryResponse &response);
+  static Message Snapshot(const PongState &view, int64_t tick);
+  // use_relay_codec 로 압축한 snapshot 입니다. Protobuf 에만 있습니다.
+  static Message PackedSnapshot(const string &packed);
+  static Message LatencyProbe(int64_t server_time);
+  static Message SpectateSucceeded(const string &player_a_id,
+                                   const string &player_b_id);
+  static Message SpectateResult(const string &result);
+  static string SerializeRelay(const Message &relay);
+  static Message SpectateFrame(PongSide side, const string &relay);
+
+  // FunMessage 는 보낼 때 엔진이 고치므로 세션마다 새로 만듭니다.
+  static Message GameStart();
+  static Message GameResult(bool win);
+  static Message GameVoided();
+  static Message NotLoggedIn();
+};
+
+}  // namespace pong
+
+#endif  // SRC_PONG_CODEC_H_
@@ -4,9 +4,13 @@
 
 #include "common_handlers.h"
 #include "game_event_handlers.h"
+#include "game_server_load.h"
 #include "lobby_event_handlers.h"
 #include "matchmaking.h"
+#include "peer_directory.h"
 #include "pong_object.h"
+#include "replay_recorder.h"
+#include "user_record_cache.h"
 
 
 DECLARE_string(app_flavor);
@@ -21,12 +25,14 @@ class PongServer : public Component {
     LOG(INFO) << "Built using Engine version: " << FUNAPI_BUILD_IDENTIFIER;
 
     pong::ObjectModelInit();
+    pong::PeerDirectory::Start();
 
     if (FLAGS_app_flavor == "lobby") {
       // Lobby 서버 역할로 초기화 합니다.
       LOG(INFO) << "Install lobby server";
       pong::RegisterCommonHandlers();
       pong::RegisterLobbyEventHandlers();
+      pong::GameServerLoad::InstallCollector();
     } else if (FLAGS_app_flavor == "game") {
       // Game 서버 역할로 초기화 합니다.
       LOG(INFO) << "Install game server";
@@ -49,6 +55,14 @@ class PongServer : public Component {
   }
 
   static bool Uninstall() {
+    // 모아 둔 전적을 씁니다.
+    if (FLAGS_app_flavor == "lobby" || FLAGS_app_flavor == "game") {
+      pong::UserRecordCache::FlushAll();
+    }
+    // 남은 replay 이벤트를 씁니다.
+    if (FLAGS_app_flavor == "game") {
+      pong::ReplayRecorder::Stop();
+    }
     return true;
   }
 
@@ -0,0 +1,130 @@
+﻿#include "pong_simulation.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace pong {
+
+namespace {
+
+float Clamp(float value, float min_value, float max_value) {
+  return std::max(min_value, std::min(max_value, value));
+}
+
+}  // unnamed namespace
+
+
+PongSimulation::PongSimulation() : random_state_(1) {
+  Reset(1);
+}
+
+
+void PongSimulation::Reset(uint32_t seed) {
+  random_state_ = seed ? seed : 1;
+
+  state_.bar_x[kSideA] = 0.0f;
+  state_.bar_x[kSideB] = 0.0f;
+  bar_target_x_[kSideA] = 0.0f;
+  bar_target_x_[kSideB] = 0.0f;
+
+  // 코트 중앙에서 좌우 30 도 안쪽으로 무작위 서브합니다.
+  const float angle = (NextRandom() * 2.0f - 1.0f) * 0.5236f;
+  const float direction = NextRandom() < 0.5f ? -1.0f : 1.0f;
+  state_.ball_x = 0.0f;
+  state_.ball_y = 0.0f;
+  state_.ball_vx = kBallServeSpeed * std::sin(angle);
+  state_.ball_vy = kBallServeSpeed * std::cos(angle) * direction;
+}
+
+
+void PongSimulation::SetBarInput(PongSide side, float bar_x) {
+  // B 는 코트를 180 도 돌려서 보고 있습니다.
+  if (side == kSideB) {
+    bar_x = -bar_x;
+  }
+  const float limit = kCourtHalfWidth - kBarHalfWidth;
+  bar_target_x_[side] = Clamp(bar_x, -limit, limit);
+}
+
+
+PongStepResult PongSimulation::Step(float dt) {
+  // 막대는 최대 속도를 넘지 않도록 목표 위치로 이동합니다.
+  const float max_move = kBarMaxSpeed * dt;
+  for (int side = kSideA; side <= kSideB; ++side) {
+    const float delta = bar_target_x_[side] - state_.bar_x[side];
+    state_.bar_x[side] += Clamp(delta, -max_move, max_move);
+  }
+
+  const float prev_y = state_.ball_y;
+  state_.ball_x += state_.ball_vx * dt;
+  state_.ball_y += state_.ball_vy * dt;
+
+  // 좌우 벽에 부딪히면 반사합니다.
+  const float wall = kCourtHalfWidth - kBallRadius;
+  if (state_.ball_x < -wall) {
+    state_.ball_x = -wall - (state_.ball_x + wall);
+    state_.ball_vx = -state_.ball_vx;
+  } else if (state_.ball_x > wall) {
+    state_.ball_x = wall - (state_.ball_x - wall);
+    state_.ball_vx = -state_.ball_vx;
+  }
+
+  // 이번 step 에서 막대 라인을 지났는지 검사합니다.
+  const float line = kBarLineY - kBallRadius;
+  PongSide side;
+  if (state_.ball_vy < 0.0f && prev_y > -line && state_.ball_y <= -line) {
+    side = kSideA;
+  } else if (state_.ball_vy > 0.0f && prev_y < line && state_.ball_y >= line) {
+    side = kSideB;
+  } else {
+    // 막대가 놓친 공이 코트 끝을 넘어가면 실점입니다.
+    if (state_.ball_y <= -kCourtHalfHeight) {
+      return kSideAMissed;
+    } else if (state_.ball_y >= kCourtHalfHeight) {
+      return kSideBMissed;
+    }
+    return kInPlay;
+  }
+
+  const float offset = state_.ball_x - state_.bar_x[side];
+  if (std::fabs(offset) > kBarHalfWidth + kBallRadius) {
+    return kInPlay;
+  }
+
+  // 막대에 맞으면 반사하며, 맞은 위치에 따라 좌우 속도를 더합니다.
+  const float speed = std::min(
+      kBallMaxSpeed,
+      std::sqrt(state_.ball_vx * state_.ball_vx +
+                state_.ball_vy * state_.ball_vy) * kBallSpeedUpPerHit);
+  const float english = Clamp(offset / kBarHalfWidth, -1.0f, 1.0f) * 0.7f;
+  state_.ball_vx = speed * english;
+  state_.ball_vy = std::sqrt(speed * speed - state_.ball_vx * state_.ball_vx) *
+                   (side == kSideA ? 1.0f : -1.0f);
+  state_.ball_y = side == kSideA ? -line : line;
+  return kInPlay;
+}
+
+
+void PongSimulation::GetView(PongSide side, PongState *view) const {
+  BOOST_ASSERT(view);
+  const PongSide other = side == kSideA ? kSideB : kSideA;
+  const float sign = side == kSideA ? 1.0f : -1.0f;
+  view->ball_x = state_.ball_x * sign;
+  view->ball_y = state_.ball_y * sign;
+  view->ball_vx = state_.ball_vx * sign;
+  view->ball_vy = state_.ball_vy * sign;
+  view->bar_x[0] = state_.bar_x[side] * sign;
+  view->bar_x[1] = state_.bar_x[other] * sign;
+}
+
+
+float PongSimulation::NextRandom() {
+  // xorshift32. 리플레이 시 같은 결과를 얻기 위해 자체 난수를 씁니다.
+  random_state_ ^= random_state_ << 13;
+  random_state_ ^= random_state_ >> 17;
+  random_state_ ^= random_state_ << 5;
+  return (random_state_ & 0xffffff) / 16777216.0f;
+}
+
+}  // namespace pong
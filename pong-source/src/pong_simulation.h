@@ -0,0 +1,79 @@
+﻿#ifndef SRC_PONG_SIMULATION_H_
+#define SRC_PONG_SIMULATION_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 코트의 크기와 공/막대의 물리 값입니다. 클라이언트 씬의 좌표계와
+// 동일해야 합니다. 코트의 중심이 (0, 0) 이며, A 의 막대는 아래쪽,
+// B 의 막대는 위쪽에 있습니다.
+const float kCourtHalfWidth = 3.0f;
+const float kCourtHalfHeight = 5.0f;
+const float kBarLineY = 4.5f;
+const float kBarHalfWidth = 0.75f;
+const float kBarMaxSpeed = 12.0f;
+const float kBallRadius = 0.15f;
+const float kBallServeSpeed = 5.0f;
+const float kBallMaxSpeed = 12.0f;
+const float kBallSpeedUpPerHit = 1.05f;
+
+
+enum PongSide {
+  kSideA = 0,
+  kSideB = 1
+};
+
+
+enum PongStepResult {
+  kInPlay = 0,
+  kSideAMissed,
+  kSideBMissed
+};
+
+
+struct PongState {
+  float ball_x;
+  float ball_y;
+  float ball_vx;
+  float ball_vy;
+  float bar_x[2];
+};
+
+
+// 서버 권한 모드에서 매치 하나의 공/막대를 시뮬레이션 합니다.
+// 클라이언트로부터는 막대 위치만 입력으로 받습니다.
+class PongSimulation {
+ public:
+  PongSimulation();
+
+  // 상태를 초기화하고 공을 서브합니다. 같은 seed 면 같은 결과가 나옵니다.
+  void Reset(uint32_t seed);
+
+  // side 의 시점 좌표로 받은 막대 위치를 입력합니다. 실제 막대는 다음
+  // Step() 에서 kBarMaxSpeed 를 넘지 않게 이동합니다.
+  void SetBarInput(PongSide side, float bar_x);
+
+  // dt 초 만큼 진행합니다.
+  PongStepResult Step(float dt);
+
+  // side 가 항상 아래쪽에 있도록 변환한 상태를 돌려줍니다.
+  // bar_x[0] 은 자신의, bar_x[1] 은 상대의 막대입니다.
+  void GetView(PongSide side, PongState *view) const;
+
+  const PongState &state() const { return state_; }
+
+ private:
+  float NextRandom();
+
+  PongState state_;
+  float bar_target_x_[2];
+  uint32_t random_state_;
+};
+
+}  // namespace pong
+
+#endif  // SRC_PONG_SIMULATION_H_
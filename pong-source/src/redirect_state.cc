@@ -0,0 +1,144 @@
+﻿#include "redirect_state.h"
+
+#include <funapi.h>
+#include <glog/logging.h>
+
+#include "pong_rpc_messages.pb.h"
+
+
+DEFINE_string(redirect_state_format, "binary",
+              "Format of the session state sent on client redirection. "
+              "\"binary\" or \"json\". Use \"json\" while servers older than "
+              "the binary format are still running");
+
+
+namespace pong {
+
+namespace {
+
+// PongRedirectState 형식을 바꾸면 올립니다. JSON 은 '{' 로 시작하므로
+// 겹치지 않습니다.
+const char kRedirectStateVersion = 1;
+
+
+// JSON 형식에서 쓰는 이름입니다. MatchingState 순서와 같습니다.
+const char *kMatchingNames[] = {
+  "", "doing", "done", "failed", "cancel"
+};
+
+const size_t kMatchingNameCount =
+    sizeof(kMatchingNames) / sizeof(kMatchingNames[0]);
+
+BOOST_STATIC_ASSERT(kMatchingNameCount == kMatchingCancel + 1);
+BOOST_STATIC_ASSERT(static_cast<int>(PongRedirectState::CANCEL) ==
+                    static_cast<int>(kMatchingCancel));
+
+
+MatchingState ToMatchingState(const string &name) {
+  for (size_t i = 1; i < kMatchingNameCount; ++i) {
+    if (name == kMatchingNames[i]) {
+      return static_cast<MatchingState>(i);
+    }
+  }
+  return kMatchingNone;
+}
+
+
+// 이전 서버가 쓰던 Session Context 모양 그대로 만듭니다.
+string EncodeJson(const PongSessionState &state) {
+  Json context;
+  context.SetObject();
+  const string id = state.id();
+  if (not id.empty()) {
+    context["id"] = id;
+  }
+  const string opponent = state.opponent();
+  if (not opponent.empty()) {
+    context["opponent"] = opponent;
+  }
+  if (state.matching() != kMatchingNone) {
+    context["matching"] = kMatchingNames[state.matching()];
+    context["ready"] = state.ready() ? 1 : 0;
+  }
+  return context.ToString();
+}
+
+
+bool DecodeJson(const string &extra_data, PongSessionState *state) {
+  Json context;
+  if (not context.FromString(extra_data) || not context.IsObject()) {
+    return false;
+  }
+  if (HasJsonStringAttribute(context, "id")) {
+    state->set_id(context["id"].GetString());
+  }
+  if (HasJsonStringAttribute(context, "opponent")) {
+    state->set_opponent(context["opponent"].GetString());
+  }
+  if (HasJsonStringAttribute(context, "matching")) {
+    state->set_matching(ToMatchingState(context["matching"].GetString()));
+  }
+  if (context.HasAttribute("ready") && context["ready"].IsInteger()) {
+    state->set_ready(context["ready"].GetInteger() != 0);
+  }
+  return true;
+}
+
+}  // unnamed namespace
+
+
+string EncodeRedirectState(const PongSessionState &state) {
+  if (FLAGS_redirect_state_format == "json") {
+    return EncodeJson(state);
+  }
+
+  PongRedirectState message;
+  const string id = state.id();
+  if (not id.empty()) {
+    message.set_id(id);
+  }
+  const string opponent = state.opponent();
+  if (not opponent.empty()) {
+    message.set_opponent(opponent);
+  }
+  if (state.matching() != kMatchingNone) {
+    message.set_matching(
+        static_cast<PongRedirectState::Matching>(state.matching()));
+  }
+  if (state.ready()) {
+    message.set_ready(1);
+  }
+
+  string extra_data(1, kRedirectStateVersion);
+  message.AppendToString(&extra_data);
+  return extra_data;
+}
+
+
+bool DecodeRedirectState(const string &extra_data, PongSessionState *state) {
+  BOOST_ASSERT(state);
+
+  if (extra_data.empty()) {
+    return true;
+  }
+
+  if (extra_data[0] != kRedirectStateVersion) {
+    // 이전 서버가 보낸 JSON 입니다.
+    return DecodeJson(extra_data, state);
+  }
+
+  PongRedirectState message;
+  if (not message.ParseFromArray(extra_data.data() + 1,
+                                 extra_data.size() - 1)) {
+    LOG(ERROR) << "Invalid redirect state: size=" << extra_data.size();
+    return false;
+  }
+
+  state->set_id(message.id());
+  state->set_opponent(message.opponent());
+  state->set_matching(static_cast<MatchingState>(message.matching()));
+  state->set_ready(message.ready() != 0);
+  return true;
+}
+
+}  // namespace pong
@@ -0,0 +1,25 @@
+﻿#ifndef SRC_REDIRECT_STATE_H_
+#define SRC_REDIRECT_STATE_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+#include "session_state.h"
+
+
+namespace pong {
+
+// 서버를 옮길 때 PongSessionState 를 extra_data 로 바꾸고 되돌립니다.
+//
+// 기본 형식은 버전 1 바이트 뒤에 PongRedirectState(pong_rpc_messages.proto)
+// 를 직렬화한 것입니다. 이전 서버가 보낸 JSON 문자열도 읽을 수 있으며,
+// 이전 서버가 남아 있는 동안에는 --redirect_state_format=json 으로 JSON 을
+// 보내도록 할 수 있습니다.
+string EncodeRedirectState(const PongSessionState &state);
+
+// 알 수 없는 형식이면 false 를 반환합니다.
+bool DecodeRedirectState(const string &extra_data, PongSessionState *state);
+
+}  // namespace pong
+
+#endif  // SRC_REDIRECT_STATE_H_
@@ -0,0 +1,231 @@
+﻿#include "relay_bridge.h"
+
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+
+#include "latency_estimator.h"
+
+
+namespace pong {
+
+namespace {
+
+const char kBridgeRpcType[] = "pong_bridge";
+
+
+struct PendingItem {
+  PongBridgeItem::Type type;
+  string to_id;
+  // RELAY 만 채웁니다. 맡길 때 직렬화해 두므로 relay 메시지를 쥐지
+  // 않습니다.
+  string payload;
+};
+
+
+// 상대 서버 하나로 가는 경로입니다. the_bridge_mutex 를 잡고 접근합니다.
+struct PeerLink {
+  PeerLink()
+      : latency(false), batch_count(0), item_count(0), replaced_count(0),
+        failure_count(0) {
+  }
+
+  std::vector<PendingItem> items;
+  // latency 는 자체 lock 을 씁니다.
+  LatencyEstimator latency;
+  int64_t batch_count;
+  int64_t item_count;
+  int64_t replaced_count;
+  int64_t failure_count;
+};
+
+typedef boost::unordered_map<Rpc::PeerId, Ptr<PeerLink>,
+                             boost::hash<Rpc::PeerId> > PeerLinkMap;
+
+boost::mutex the_bridge_mutex;
+PeerLinkMap the_links;
+RelayBridge::ItemHandler the_item_handler;
+
+
+// the_bridge_mutex 를 잡고 불러야 합니다.
+PeerLink &GetLink(const Rpc::PeerId &peer) {
+  Ptr<PeerLink> &link = the_links[peer];
+  if (not link) {
+    LOG(INFO) << "Relay bridge opened: peer_id=" << peer;
+    link.reset(new PeerLink);
+  }
+  return *link;
+}
+
+
+// 같은 플레이어에게 가는 마지막 item 이 아직 보내지 않은 relay 면 그 칸을
+// 돌려줍니다. 그 뒤에 READY, RESULT 가 있으면 새 relay 가 그보다 먼저 가지
+// 않도록 새 칸을 붙입니다.
+PendingItem &ReserveRelay(const Rpc::PeerId &peer, const string &to_id) {
+  PeerLink &link = GetLink(peer);
+  for (size_t i = link.items.size(); i > 0; --i) {
+    PendingItem &item = link.items[i - 1];
+    if (item.to_id != to_id) {
+      continue;
+    }
+    if (item.type == PongBridgeItem::RELAY) {
+      ++link.replaced_count;
+      return item;
+    }
+    break;
+  }
+  link.items.push_back(PendingItem());
+  PendingItem &item = link.items.back();
+  item.type = PongBridgeItem::RELAY;
+  item.to_id = to_id;
+  return item;
+}
+
+
+void OnBatchReplied(const Ptr<PeerLink> &link, int64_t sent_time,
+                    const Rpc::PeerId &peer, const Rpc::Xid &/*xid*/,
+                    const Ptr<const FunRpcMessage> &reply) {
+  if (not reply) {
+    LOG_EVERY_N(WARNING, 100) << "Relay bridge batch failed: peer_id="
+                              << peer;
+    boost::mutex::scoped_lock lock(the_bridge_mutex);
+    ++link->failure_count;
+    return;
+  }
+  link->latency.AddSample(sent_time, WallClock::Now());
+}
+
+
+void FlushBatches(const Timer::Id &/*timer_id*/, const WallClock::Value &now) {
+  typedef std::pair<Rpc::PeerId, Ptr<PeerLink> > Target;
+  std::vector<Target> targets;
+  std::vector<std::vector<PendingItem> > items;
+  {
+    boost::mutex::scoped_lock lock(the_bridge_mutex);
+    for (PeerLinkMap::iterator itr = the_links.begin();
+         itr != the_links.end(); ++itr) {
+      PeerLink &link = *itr->second;
+      if (link.items.empty()) {
+        continue;
+      }
+      ++link.batch_count;
+      link.item_count += link.items.size();
+      targets.push_back(Target(itr->first, itr->second));
+      items.push_back(std::vector<PendingItem>());
+      items.back().swap(link.items);
+    }
+  }
+
+  const int64_t sent_time = LatencyEstimator::ToProbeTime(now);
+  for (size_t i = 0; i < targets.size(); ++i) {
+    Ptr<FunRpcMessage> request(new FunRpcMessage);
+    request->set_type(kBridgeRpcType);
+    PongBridgeBatch *batch = request->MutableExtension(pong_bridge_batch);
+    for (size_t j = 0; j < items[i].size(); ++j) {
+      const PendingItem &pending = items[i][j];
+      PongBridgeItem *item = batch->add_item();
+      item->set_type(pending.type);
+      item->set_to_id(pending.to_id);
+      if (not pending.payload.empty()) {
+        item->set_payload(pending.payload);
+      }
+    }
+    Rpc::Call(targets[i].first, request,
+              bind(&OnBatchReplied, targets[i].second, sent_time, _1, _2,
+                   _3));
+  }
+}
+
+
+void OnBatchReceived(const Rpc::PeerId &sender, const Rpc::Xid &/*xid*/,
+                     const Ptr<const FunRpcMessage> &request,
+                     const Rpc::ReadyBack &finisher) {
+  // 보낸 쪽이 왕복 시간을 잴 수 있도록 바로 응답합니다.
+  Ptr<FunRpcMessage> reply(new FunRpcMessage);
+  reply->set_type(kBridgeRpcType);
+  finisher(reply);
+
+  if (not request->HasExtension(pong_bridge_batch)) {
+    return;
+  }
+  const PongBridgeBatch &batch = request->GetExtension(pong_bridge_batch);
+  for (int i = 0; i < batch.item_size(); ++i) {
+    the_item_handler(sender, batch.item(i));
+  }
+}
+
+
+// GET /v1/relay_bridge/
+void OnRelayBridgeRequested(Ptr<http::Response> response,
+                            const http::Request &/*request*/,
+                            const ApiService::MatchResult &/*params*/) {
+  response->status_code = http::kOk;
+  response->body = RelayBridge::Dump().ToString();
+}
+
+}  // unnamed namespace
+
+
+void RelayBridge::Install(const WallClock::Duration &interval,
+                          const ItemHandler &handler) {
+  the_item_handler = handler;
+  Rpc::RegisterHandler(kBridgeRpcType, OnBatchReceived);
+  Timer::ExpireRepeatedly(interval, FlushBatches);
+  ApiService::RegisterHandler(
+      http::kGet, boost::regex("/v1/relay_bridge/"), OnRelayBridgeRequested);
+}
+
+
+void RelayBridge::SendRelay(const Rpc::PeerId &peer, const string &to_id,
+                            const Ptr<FunMessage> &message) {
+  // timer 스레드에서 직렬화하면 엔진이 같은 메시지를 보내는 중일 수
+  // 있으므로 여기서 합니다.
+  string payload;
+  message->SerializeToString(&payload);
+  boost::mutex::scoped_lock lock(the_bridge_mutex);
+  ReserveRelay(peer, to_id).payload.swap(payload);
+}
+
+
+void RelayBridge::SendRelay(const Rpc::PeerId &peer, const string &to_id,
+                            const Json &message) {
+  string payload = message.ToString();
+  boost::mutex::scoped_lock lock(the_bridge_mutex);
+  ReserveRelay(peer, to_id).payload.swap(payload);
+}
+
+
+void RelayBridge::Send(const Rpc::PeerId &peer, PongBridgeItem::Type type,
+                       const string &to_id) {
+  BOOST_ASSERT(type != PongBridgeItem::RELAY);
+  boost::mutex::scoped_lock lock(the_bridge_mutex);
+  PeerLink &link = GetLink(peer);
+  link.items.push_back(PendingItem());
+  link.items.back().type = type;
+  link.items.back().to_id = to_id;
+}
+
+
+Json RelayBridge::Dump() {
+  Json dump;
+  dump["peers"].SetArray();
+
+  boost::mutex::scoped_lock lock(the_bridge_mutex);
+  for (PeerLinkMap::const_iterator itr = the_links.begin();
+       itr != the_links.end(); ++itr) {
+    const PeerLink &link = *itr->second;
+    Json peer;
+    peer["peer_id"] = to_string(itr->first);
+    peer["batches"] = link.batch_count;
+    peer["items"] = link.item_count;
+    peer["replaced_relays"] = link.replaced_count;
+    peer["failures"] = link.failure_count;
+    peer["rtt"] = link.latency.ToJson();
+    dump["peers"].PushBack(peer);
+  }
+  return dump;
+}
+
+}  // namespace pong
@@ -0,0 +1,47 @@
+﻿#ifndef SRC_RELAY_BRIDGE_H_
+#define SRC_RELAY_BRIDGE_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+#include "pong_rpc_messages.pb.h"
+
+
+namespace pong {
+
+// 두 플레이어가 서로 다른 game 서버에 들어간 매치에서 상대 서버로 relay,
+// ready, result 를 넘깁니다.
+//
+// 보낼 메시지는 서버마다 모아 두었다가 tick 마다 한 번의 RPC 로 보냅니다.
+// relay 는 받을 플레이어마다 tick 안에서 최신 것만 남기지만, 그 사이에
+// 맡긴 READY, RESULT 를 앞지르지는 않습니다. RPC 연결은 엔진이 서버 사이에
+// 유지하는 것을 그대로 씁니다. 보낸 batch 의 응답이 오면 서버 사이 왕복
+// 시간을 샘플로 더하며 GET /v1/relay_bridge/ 로 볼 수 있습니다.
+class RelayBridge {
+ public:
+  typedef boost::function<void(const Rpc::PeerId & /*sender*/,
+                               const PongBridgeItem &)> ItemHandler;
+
+  // RPC 핸들러를 등록하고 interval 마다 모아 둔 메시지를 보냅니다. 받은
+  // 메시지는 handler 로 넘깁니다.
+  static void Install(const WallClock::Duration &interval,
+                      const ItemHandler &handler);
+
+  // relay 는 부른 스레드에서 바로 직렬화하므로 message 를 쥐고 있지
+  // 않습니다.
+  static void SendRelay(const Rpc::PeerId &peer, const string &to_id,
+                        const Ptr<FunMessage> &message);
+  static void SendRelay(const Rpc::PeerId &peer, const string &to_id,
+                        const Json &message);
+  // READY, RESULT, FORFEIT 처럼 payload 가 없는 메시지입니다. 버리거나
+  // 합치지 않습니다.
+  static void Send(const Rpc::PeerId &peer, PongBridgeItem::Type type,
+                   const string &to_id);
+
+  static Json Dump();
+};
+
+}  // namespace pong
+
+#endif  // SRC_RELAY_BRIDGE_H_
@@ -0,0 +1,62 @@
+﻿#include "relay_channel.h"
+
+#include <funapi.h>
+
+
+DECLARE_uint64(udp_json_port);
+DECLARE_uint64(udp_protobuf_port);
+
+
+namespace pong {
+
+RelaySequenceFilter::RelaySequenceFilter()
+    : has_last_(false), last_sequence_(0) {
+}
+
+
+bool RelaySequenceFilter::Accept(int64_t sequence) {
+  boost::mutex::scoped_lock lock(mutex_);
+  stats_.received.fetch_add(1, boost::memory_order_relaxed);
+
+  if (not has_last_ || sequence > last_sequence_) {
+    if (has_last_ && sequence > last_sequence_ + 1) {
+      stats_.lost.fetch_add(sequence - last_sequence_ - 1,
+                            boost::memory_order_relaxed);
+    }
+    has_last_ = true;
+    last_sequence_ = sequence;
+    return true;
+  }
+
+  if (sequence == last_sequence_) {
+    stats_.duplicated.fetch_add(1, boost::memory_order_relaxed);
+  } else {
+    stats_.reordered.fetch_add(1, boost::memory_order_relaxed);
+  }
+  return false;
+}
+
+
+TransportProtocol GetRelayProtocol(const Ptr<Session> &session) {
+  if ((FLAGS_udp_json_port || FLAGS_udp_protobuf_port) &&
+      session->IsTransportAttached(kUdp)) {
+    return kUdp;
+  }
+  return GetControlProtocol();
+}
+
+
+bool IsUnreliableRelay(const Ptr<Session> &session) {
+  return session && GetRelayProtocol(session) == kUdp;
+}
+
+
+TransportProtocol GetControlProtocol() {
+  // UDP 를 함께 쓸 때는 명시하지 않으면 UDP 로 나갈 수 있습니다.
+  if (FLAGS_udp_json_port || FLAGS_udp_protobuf_port) {
+    return kTcp;
+  }
+  return kDefaultProtocol;
+}
+
+}  // namespace pong
@@ -0,0 +1,57 @@
+﻿#ifndef SRC_RELAY_CHANNEL_H_
+#define SRC_RELAY_CHANNEL_H_
+
+#include <boost/atomic.hpp>
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// UDP 로 들어오는 relay 의 유실/순서 통계입니다.
+struct RelayChannelStats {
+  RelayChannelStats() : received(0), lost(0), reordered(0), duplicated(0) {}
+
+  boost::atomic<int64_t> received;
+  // sequence 가 건너뛴 만큼 더합니다. 늦게 도착한 패킷은 reordered 로
+  // 다시 세므로 lost 는 실제 유실보다 클 수 있습니다.
+  boost::atomic<int64_t> lost;
+  boost::atomic<int64_t> reordered;
+  boost::atomic<int64_t> duplicated;
+};
+
+
+// 세션 하나가 UDP 로 보내는 relay 의 sequence(GameRelayMessage.seq, JSON 은
+// "seq") 를 검사해서 늦게 오거나 중복된 패킷을 걸러냅니다.
+class RelaySequenceFilter {
+ public:
+  RelaySequenceFilter();
+
+  // 처음 보는 최신 패킷이면 true 를 반환합니다.
+  bool Accept(int64_t sequence);
+
+  const RelayChannelStats &stats() const { return stats_; }
+
+ private:
+  boost::mutex mutex_;
+  bool has_last_;
+  int64_t last_sequence_;
+  RelayChannelStats stats_;
+};
+
+
+// 상대에게 relay 를 보낼 전송 수단입니다. UDP 가 붙어 있으면 UDP 를,
+// 아니면 TCP 를 씁니다.
+TransportProtocol GetRelayProtocol(const Ptr<Session> &session);
+
+// ready, start, result 처럼 반드시 도착해야 하는 메시지의 전송 수단입니다.
+TransportProtocol GetControlProtocol();
+
+// session 이 relay 를 UDP 로 주고받으면 true 를 반환합니다. 이때만
+// RelaySequenceFilter 로 거릅니다.
+bool IsUnreliableRelay(const Ptr<Session> &session);
+
+}  // namespace pong
+
+#endif  // SRC_RELAY_CHANNEL_H_
@@ -0,0 +1,289 @@
+﻿#include "relay_codec.h"
+
+#include <cassert>
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace pong {
+
+namespace {
+
+// 1/1024, 1/256 단위로 양자화합니다. 코트 크기(pong_simulation.h)와
+// 최대 속도에서 16 비트를 넘지 않습니다.
+const float kPositionScale = 1024.0f;
+const float kVelocityScale = 256.0f;
+
+const uint32_t kHeaderBits = 16 + 1 + 16 + 5 + 5;
+
+
+float GetScale(RelayField field) {
+  return field == kRelayBallVX || field == kRelayBallVY ?
+      kVelocityScale : kPositionScale;
+}
+
+
+int32_t Quantize(float value, RelayField field) {
+  const float scaled = std::floor(value * GetScale(field) + 0.5f);
+  return static_cast<int32_t>(
+      std::max(-32767.0f, std::min(32767.0f, scaled)));
+}
+
+
+uint32_t ZigZag(int32_t value) {
+  return (static_cast<uint32_t>(value) << 1) ^
+         static_cast<uint32_t>(value >> 31);
+}
+
+
+int32_t UnZigZag(uint32_t value) {
+  return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+}
+
+
+class BitWriter {
+ public:
+  explicit BitWriter(std::string *out) : out_(out), buffer_(0), bits_(0) {
+    out_->clear();
+  }
+
+  void Write(uint32_t value, uint32_t bits) {
+    assert(bits <= 32);
+    buffer_ = (buffer_ << bits) | (value & ((1ULL << bits) - 1));
+    bits_ += bits;
+    while (bits_ >= 8) {
+      bits_ -= 8;
+      out_->push_back(static_cast<char>((buffer_ >> bits_) & 0xff));
+    }
+  }
+
+  void Flush() {
+    if (bits_ > 0) {
+      out_->push_back(static_cast<char>((buffer_ << (8 - bits_)) & 0xff));
+      bits_ = 0;
+    }
+  }
+
+ private:
+  std::string *out_;
+  uint64_t buffer_;
+  uint32_t bits_;
+};
+
+
+class BitReader {
+ public:
+  explicit BitReader(const std::string &in)
+      : in_(in), offset_(0), buffer_(0), bits_(0), overflow_(false) {
+  }
+
+  uint32_t Read(uint32_t bits) {
+    assert(bits <= 32);
+    while (bits_ < bits) {
+      if (offset_ >= in_.size()) {
+        overflow_ = true;
+        return 0;
+      }
+      buffer_ = (buffer_ << 8) | static_cast<uint8_t>(in_[offset_++]);
+      bits_ += 8;
+    }
+    bits_ -= bits;
+    return static_cast<uint32_t>((buffer_ >> bits_) & ((1ULL << bits) - 1));
+  }
+
+  bool overflow() const { return overflow_; }
+
+ private:
+  const std::string &in_;
+  size_t offset_;
+  uint64_t buffer_;
+  uint32_t bits_;
+  bool overflow_;
+};
+
+}  // unnamed namespace
+
+
+RelayState::RelayState() {
+  std::fill(fields, fields + kRelayFieldCount, 0);
+}
+
+
+RelayState RelayState::Quantize(float ball_x, float ball_y, float ball_vx,
+                                float ball_vy, float bar_x) {
+  RelayState state;
+  state.fields[kRelayBallX] = pong::Quantize(ball_x, kRelayBallX);
+  state.fields[kRelayBallY] = pong::Quantize(ball_y, kRelayBallY);
+  state.fields[kRelayBallVX] = pong::Quantize(ball_vx, kRelayBallVX);
+  state.fields[kRelayBallVY] = pong::Quantize(ball_vy, kRelayBallVY);
+  state.fields[kRelayBarX] = pong::Quantize(bar_x, kRelayBarX);
+  return state;
+}
+
+
+float RelayState::Dequantize(RelayField field) const {
+  return fields[field] / GetScale(field);
+}
+
+
+RelayEncoder::RelayEncoder()
+    : next_sequence_(0), has_ack_(false), acked_sequence_(0) {
+  std::fill(history_sequences_, history_sequences_ + kHistorySize, 0);
+}
+
+
+void RelayEncoder::Acknowledge(uint16_t sequence) {
+  // 최근에 보낸 패킷에 대한 ack 만 받습니다.
+  const uint16_t age = next_sequence_ - sequence;
+  if (age == 0 || age > kHistorySize) {
+    return;
+  }
+  if (has_ack_ && not IsNewerSequence(sequence, acked_sequence_)) {
+    return;
+  }
+  has_ack_ = true;
+  acked_sequence_ = sequence;
+}
+
+
+void RelayEncoder::Encode(const RelayState &state, bool has_ack,
+                          uint16_t ack, std::string *out) {
+  assert(out);
+
+  const uint16_t sequence = next_sequence_++;
+
+  // ack 된 상태가 아직 history 에 있으면 baseline 으로 씁니다.
+  const RelayState *baseline = NULL;
+  uint32_t distance = 0;
+  if (has_ack_) {
+    const uint16_t age = sequence - acked_sequence_;
+    const size_t slot = acked_sequence_ % kHistorySize;
+    if (age > 0 && age < kHistorySize &&
+        history_sequences_[slot] == acked_sequence_) {
+      baseline = &history_[slot];
+      distance = age;
+    }
+  }
+
+  uint32_t values[kRelayFieldCount];
+  for (int i = 0; i < kRelayFieldCount; ++i) {
+    values[i] = ZigZag(state.fields[i] - (baseline ? baseline->fields[i] : 0));
+    if (values[i] > 0xffff) {
+      // 차이가 16 비트를 넘으면 keyframe 으로 보냅니다.
+      baseline = NULL;
+      distance = 0;
+    }
+  }
+
+  uint32_t mask = 0;
+  for (int i = 0; i < kRelayFieldCount; ++i) {
+    if (not baseline) {
+      values[i] = ZigZag(state.fields[i]);
+    }
+    if (values[i] != 0) {
+      mask |= 1 << i;
+    }
+  }
+
+  BitWriter writer(out);
+  writer.Write(sequence, 16);
+  writer.Write(has_ack ? 1 : 0, 1);
+  writer.Write(has_ack ? ack : 0, 16);
+  writer.Write(distance, 5);
+  writer.Write(mask, 5);
+  for (int i = 0; i < kRelayFieldCount; ++i) {
+    if (not (mask & (1 << i))) {
+      continue;
+    }
+    if (not baseline) {
+      writer.Write(values[i], 16);
+      continue;
+    }
+    // 차이값의 크기에 맞춰 4/8/12/16 비트 중 하나로 씁니다.
+    const uint32_t size_class =
+        values[i] < (1 << 4) ? 0 :
+        values[i] < (1 << 8) ? 1 :
+        values[i] < (1 << 12) ? 2 : 3;
+    writer.Write(size_class, 2);
+    writer.Write(values[i], 4 * (size_class + 1));
+  }
+  writer.Flush();
+
+  const size_t slot = sequence % kHistorySize;
+  history_sequences_[slot] = sequence;
+  history_[slot] = state;
+}
+
+
+RelayDecoder::RelayDecoder() : has_last_(false), last_sequence_(0) {
+  std::fill(history_valid_, history_valid_ + kHistorySize, false);
+  std::fill(history_sequences_, history_sequences_ + kHistorySize, 0);
+}
+
+
+bool RelayDecoder::Decode(const std::string &packet, RelayState *state,
+                          bool *has_ack, uint16_t *ack) {
+  assert(state);
+  assert(has_ack);
+  assert(ack);
+
+  if (packet.size() * 8 < kHeaderBits) {
+    return false;
+  }
+
+  BitReader reader(packet);
+  const uint16_t sequence = reader.Read(16);
+  const bool acked_valid = reader.Read(1) != 0;
+  const uint16_t acked = reader.Read(16);
+  const uint32_t distance = reader.Read(5);
+  const uint32_t mask = reader.Read(5);
+
+  // 이미 받은 패킷보다 오래된 패킷은 버립니다.
+  if (has_last_ && not IsNewerSequence(sequence, last_sequence_)) {
+    return false;
+  }
+
+  const RelayState *baseline = NULL;
+  if (distance > 0) {
+    const uint16_t baseline_sequence = sequence - distance;
+    const size_t slot = baseline_sequence % kHistorySize;
+    if (not history_valid_[slot] ||
+        history_sequences_[slot] != baseline_sequence) {
+      return false;
+    }
+    baseline = &history_[slot];
+  }
+
+  RelayState decoded;
+  for (int i = 0; i < kRelayFieldCount; ++i) {
+    const int32_t base = baseline ? baseline->fields[i] : 0;
+    if (not (mask & (1 << i))) {
+      decoded.fields[i] = base;
+      continue;
+    }
+    uint32_t bits = 16;
+    if (baseline) {
+      bits = 4 * (reader.Read(2) + 1);
+    }
+    decoded.fields[i] = base + UnZigZag(reader.Read(bits));
+  }
+
+  if (reader.overflow()) {
+    return false;
+  }
+
+  const size_t slot = sequence % kHistorySize;
+  history_valid_[slot] = true;
+  history_sequences_[slot] = sequence;
+  history_[slot] = decoded;
+  has_last_ = true;
+  last_sequence_ = sequence;
+
+  *state = decoded;
+  *has_ack = acked_valid;
+  *ack = acked;
+  return true;
+}
+
+}  // namespace pong
@@ -0,0 +1,106 @@
+﻿#ifndef SRC_RELAY_CODEC_H_
+#define SRC_RELAY_CODEC_H_
+
+#include <stdint.h>
+
+#include <string>
+
+
+namespace pong {
+
+// GameRelayMessage 의 압축 형식입니다. 위치와 속도를 고정 소수점으로
+// 양자화하고, 상대가 마지막으로 받았다고 알려준(ack) 상태와의 차이만
+// 비트 단위로 담습니다. 서버는 GameRelayMessage.packed 를 풀지 않고
+// 그대로 전달합니다. 엔진 없이 시험할 수 있도록 표준 라이브러리만 씁니다.
+//
+// 패킷 구조 (비트 단위, 큰 자리부터):
+//   16  sequence
+//    1  ack 유무. 상대에게서 아직 아무것도 받지 못했으면 0 입니다.
+//   16  ack: 상대에게서 마지막으로 받은 sequence. ack 가 없으면 0
+//    5  baseline 거리. 0 이면 keyframe, 아니면 sequence - baseline
+//    5  field mask: ballX, ballY, ballVX, ballVY, barX
+//   필드마다
+//     keyframe: 16 비트 zigzag 절대값
+//     delta:    2 비트 크기(4/8/12/16 비트) + zigzag 차이값
+// mask 에 없는 필드는 baseline 과 같은 값(keyframe 이면 0)입니다.
+
+enum RelayField {
+  kRelayBallX = 0,
+  kRelayBallY,
+  kRelayBallVX,
+  kRelayBallVY,
+  kRelayBarX,
+  kRelayFieldCount
+};
+
+
+// 양자화한 relay 상태입니다.
+struct RelayState {
+  RelayState();
+
+  static RelayState Quantize(float ball_x, float ball_y, float ball_vx,
+                             float ball_vy, float bar_x);
+  float Dequantize(RelayField field) const;
+
+  int32_t fields[kRelayFieldCount];
+};
+
+
+class RelayEncoder {
+ public:
+  RelayEncoder();
+
+  // 상대가 받았다고 알려준 sequence 입니다. 다음 Encode() 의 baseline 이
+  // 됩니다.
+  void Acknowledge(uint16_t sequence);
+
+  // state 를 부호화해서 out 에 씁니다. ack 는 함께 보낼 수신 확인이며,
+  // has_ack 가 false 면 보내지 않습니다.
+  void Encode(const RelayState &state, bool has_ack, uint16_t ack,
+              std::string *out);
+
+ private:
+  static const size_t kHistorySize = 32;
+
+  uint16_t next_sequence_;
+  bool has_ack_;
+  uint16_t acked_sequence_;
+  uint16_t history_sequences_[kHistorySize];
+  RelayState history_[kHistorySize];
+};
+
+
+class RelayDecoder {
+ public:
+  RelayDecoder();
+
+  // 패킷을 풀어 state 와 ack 에 씁니다. 패킷에 ack 가 없으면 has_ack 가
+  // false 입니다. baseline 을 모르거나 이미 받은 패킷보다 오래된 패킷이면
+  // false 를 반환합니다.
+  bool Decode(const std::string &packet, RelayState *state, bool *has_ack,
+              uint16_t *ack);
+
+  // 상대에게 보낼 수신 확인 값입니다. has_last() 가 false 면 아직 받은
+  // 패킷이 없으므로 ack 를 보내면 안 됩니다.
+  bool has_last() const { return has_last_; }
+  uint16_t last_sequence() const { return last_sequence_; }
+
+ private:
+  static const size_t kHistorySize = 32;
+
+  bool has_last_;
+  uint16_t last_sequence_;
+  bool history_valid_[kHistorySize];
+  uint16_t history_sequences_[kHistorySize];
+  RelayState history_[kHistorySize];
+};
+
+
+// 16 비트 sequence 를 wrap-around 를 고려해 비교합니다.
+inline bool IsNewerSequence(uint16_t lhs, uint16_t rhs) {
+  return lhs != rhs && static_cast<uint16_t>(lhs - rhs) < 0x8000;
+}
+
+}  // namespace pong
+
+#endif  // SRC_RELAY_CODEC_H_
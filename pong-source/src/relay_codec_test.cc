@@ -0,0 +1,178 @@
+﻿#include "relay_codec.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+
+namespace {
+
+using pong::RelayDecoder;
+using pong::RelayEncoder;
+using pong::RelayField;
+using pong::RelayState;
+
+int the_failure_count = 0;
+
+#define EXPECT(condition) \
+  do { \
+    if (not (condition)) { \
+      std::fprintf(stderr, "%s:%d: EXPECT(%s) failed\n", __FILE__, __LINE__, \
+                   #condition); \
+      ++the_failure_count; \
+    } \
+  } while (false)
+
+
+RelayState MakeState(int i) {
+  return RelayState::Quantize(i % 50 * 0.1f, i % 70 * 0.1f, 1.5f, -2.0f,
+                              i % 30 * 0.1f);
+}
+
+
+bool IsSameState(const RelayState &lhs, const RelayState &rhs) {
+  for (int i = 0; i < pong::kRelayFieldCount; ++i) {
+    if (lhs.fields[i] != rhs.fields[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// 아직 아무것도 받지 않은 decoder 는 ack 를 보내면 안 됩니다.
+void TestNoAckBeforeFirstDecode() {
+  RelayDecoder server_decoder;
+  EXPECT(not server_decoder.has_last());
+
+  RelayEncoder server_encoder;
+  RelayDecoder client_decoder;
+  std::string packet;
+  server_encoder.Encode(MakeState(0), server_decoder.has_last(),
+                        server_decoder.last_sequence(), &packet);
+
+  RelayState state;
+  bool has_ack = true;
+  uint16_t ack = 1;
+  EXPECT(client_decoder.Decode(packet, &state, &has_ack, &ack));
+  EXPECT(not has_ack);
+  EXPECT(IsSameState(state, MakeState(0)));
+}
+
+
+// 클라이언트의 첫 입력이 사라져도 서버가 ack 하지 않았으므로 다음 입력은
+// keyframe 으로 가고 풀 수 있어야 합니다.
+void TestFirstInputLost() {
+  RelayEncoder client_encoder;
+  RelayDecoder server_decoder;
+
+  std::string lost;
+  client_encoder.Encode(MakeState(0), false, 0, &lost);
+
+  // 서버는 아무것도 받지 못했으므로 ack 없는 snapshot 을 보냅니다.
+  EXPECT(not server_decoder.has_last());
+
+  std::string packet;
+  client_encoder.Encode(MakeState(1), false, 0, &packet);
+  RelayState state;
+  bool has_ack = false;
+  uint16_t ack = 0;
+  EXPECT(server_decoder.Decode(packet, &state, &has_ack, &ack));
+  EXPECT(IsSameState(state, MakeState(1)));
+  EXPECT(server_decoder.has_last());
+  EXPECT(server_decoder.last_sequence() == 1);
+}
+
+
+// sequence 가 0xffff 에서 0 으로 넘어가도 ack 와 delta 가 이어져야 합니다.
+void TestRoundTripAcrossWraparound() {
+  RelayEncoder encoder;
+  RelayDecoder decoder;
+  const int kPacketCount = 0x10000 + 100;
+  int keyframe_count = 0;
+  for (int i = 0; i < kPacketCount; ++i) {
+    std::string packet;
+    encoder.Encode(MakeState(i), false, 0, &packet);
+
+    RelayState state;
+    bool has_ack = false;
+    uint16_t ack = 0;
+    if (not decoder.Decode(packet, &state, &has_ack, &ack)) {
+      EXPECT(false);
+      return;
+    }
+    EXPECT(IsSameState(state, MakeState(i)));
+    EXPECT(decoder.last_sequence() == static_cast<uint16_t>(i));
+
+    // 헤더의 34 번째 비트부터 5 비트가 baseline 거리입니다. 0 이면
+    // keyframe 입니다.
+    if (packet.size() >= 5 &&
+        (((static_cast<uint8_t>(packet[4]) >> 2) & 0x1f) == 0)) {
+      ++keyframe_count;
+    }
+    encoder.Acknowledge(decoder.last_sequence());
+  }
+  // ack 가 매번 오므로 처음 한 번만 keyframe 입니다.
+  EXPECT(keyframe_count == 1);
+}
+
+
+// 이미 받은 패킷보다 오래된 패킷은 wrap-around 뒤에도 버립니다.
+void TestStalePacketAfterWraparound() {
+  RelayEncoder encoder;
+  RelayDecoder decoder;
+  std::string stale;
+  for (int i = 0; i < 0x10000 + 2; ++i) {
+    std::string packet;
+    encoder.Encode(MakeState(i), false, 0, &packet);
+    if (i == 0xfffe) {
+      stale = packet;
+      continue;
+    }
+    RelayState state;
+    bool has_ack = false;
+    uint16_t ack = 0;
+    decoder.Decode(packet, &state, &has_ack, &ack);
+  }
+
+  RelayState state;
+  bool has_ack = false;
+  uint16_t ack = 0;
+  EXPECT(not decoder.Decode(stale, &state, &has_ack, &ack));
+}
+
+
+// 보낸 ack 는 그대로 돌아와야 합니다. 0 도 올바른 ack 입니다.
+void TestAckRoundTrip() {
+  const uint16_t kAcks[] = { 0, 1, 0x7fff, 0xffff };
+  for (size_t i = 0; i < sizeof(kAcks) / sizeof(kAcks[0]); ++i) {
+    RelayEncoder encoder;
+    RelayDecoder decoder;
+    std::string packet;
+    encoder.Encode(MakeState(0), true, kAcks[i], &packet);
+
+    RelayState state;
+    bool has_ack = false;
+    uint16_t ack = 0;
+    EXPECT(decoder.Decode(packet, &state, &has_ack, &ack));
+    EXPECT(has_ack);
+    EXPECT(ack == kAcks[i]);
+  }
+}
+
+}  // unnamed namespace
+
+
+int main() {
+  TestNoAckBeforeFirstDecode();
+  TestFirstInputLost();
+  TestRoundTripAcrossWraparound();
+  TestStalePacketAfterWraparound();
+  TestAckRoundTrip();
+
+  if (the_failure_count > 0) {
+    std::fprintf(stderr, "%d expectation(s) failed\n", the_failure_count);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
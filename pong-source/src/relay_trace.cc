@@ -0,0 +1,199 @@
+﻿#include "relay_trace.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <funapi.h>
+#include <glog/logging.h>
+
+#include "pong_messages.pb.h"
+
+
+DEFINE_int32(relay_trace_sampling_rate, 0,
+             "Records one in N relay packets into the trace ring buffer. "
+             "0 disables sampling; counters are always kept");
+
+
+namespace pong {
+
+namespace {
+
+const size_t kTraceBufferSize = 4096;
+const boost::posix_time::ptime kUnixEpoch(boost::gregorian::date(1970, 1, 1));
+
+
+// ring buffer 의 한 칸입니다. 쓰는 중에는 sequence 가 0 이며, 읽는 쪽은
+// 읽기 전후의 sequence 가 같을 때만 값을 믿습니다.
+struct TraceEntry {
+  boost::atomic<uint64_t> sequence;
+  boost::atomic<int64_t> when_in_usec;
+  boost::atomic<uint64_t> session_id[2];
+  boost::atomic<uint64_t> bytes;
+  boost::atomic<bool> dropped;
+};
+
+TraceEntry the_entries[kTraceBufferSize];
+boost::atomic<uint64_t> the_last_sequence(0);
+
+RelayStats the_total_stats;
+
+
+bool Sample() {
+  if (FLAGS_relay_trace_sampling_rate <= 0) {
+    return false;
+  }
+  // 스레드마다 따로 세므로 경합이 없습니다.
+  static thread_local uint32_t counter = 0;
+  return ++counter % FLAGS_relay_trace_sampling_rate == 0;
+}
+
+
+void AppendEntry(const SessionId &from, size_t bytes, bool dropped) {
+  const uint64_t sequence =
+      the_last_sequence.fetch_add(1, boost::memory_order_relaxed) + 1;
+  TraceEntry &entry = the_entries[(sequence - 1) % kTraceBufferSize];
+
+  uint64_t session_id[2];
+  BOOST_STATIC_ASSERT(sizeof(session_id) == sizeof(from.data));
+  std::memcpy(session_id, from.data, sizeof(session_id));
+
+  const int64_t when_in_usec =
+      (WallClock::Now() - kUnixEpoch).total_microseconds();
+
+  entry.sequence.store(0, boost::memory_order_relaxed);
+  boost::atomic_thread_fence(boost::memory_order_release);
+  entry.when_in_usec.store(when_in_usec, boost::memory_order_relaxed);
+  entry.session_id[0].store(session_id[0], boost::memory_order_relaxed);
+  entry.session_id[1].store(session_id[1], boost::memory_order_relaxed);
+  entry.bytes.store(bytes, boost::memory_order_relaxed);
+  entry.dropped.store(dropped, boost::memory_order_relaxed);
+  entry.sequence.store(sequence, boost::memory_order_release);
+}
+
+
+void RecordPacket(RelayStats *stats, const Ptr<Session> &from, size_t bytes,
+                  size_t packed_bytes, bool dropped) {
+  RelayStats *targets[2] = { stats, &the_total_stats };
+  for (size_t i = 0; i < 2; ++i) {
+    if (not targets[i]) {
+      continue;
+    }
+    targets[i]->packets.fetch_add(1, boost::memory_order_relaxed);
+    targets[i]->bytes.fetch_add(bytes, boost::memory_order_relaxed);
+    targets[i]->packed_bytes.fetch_add(packed_bytes,
+                                       boost::memory_order_relaxed);
+    if (dropped) {
+      targets[i]->drops.fetch_add(1, boost::memory_order_relaxed);
+    }
+  }
+
+  // replay benchmark 에서는 보낸 세션이 없습니다.
+  if (Sample() && from) {
+    AppendEntry(from->id(), bytes, dropped);
+  }
+}
+
+
+// GET /v1/relay_trace/
+void OnRelayTraceRequested(Ptr<http::Response> response,
+                           const http::Request &/*request*/,
+                           const ApiService::MatchResult &/*params*/) {
+  response->status_code = http::kOk;
+  response->body = RelayTrace::Dump().ToString();
+}
+
+}  // unnamed namespace
+
+
+void RelayTrace::Install() {
+  ApiService::RegisterHandler(
+      http::kGet, boost::regex("/v1/relay_trace/"), OnRelayTraceRequested);
+}
+
+
+void RelayTrace::Record(RelayStats *stats, const Ptr<Session> &from,
+                        const Ptr<FunMessage> &message, bool dropped) {
+  size_t packed_bytes = 0;
+  if (message->HasExtension(game_relay) &&
+      message->GetExtension(game_relay).has_packed()) {
+    packed_bytes = message->GetExtension(game_relay).packed().size();
+  }
+  RecordPacket(stats, from, message->ByteSizeLong(), packed_bytes, dropped);
+}
+
+
+void RelayTrace::Record(RelayStats *stats, const Ptr<Session> &from,
+                        const Json &message, bool dropped) {
+  RecordPacket(stats, from, message.ToString().size(), 0, dropped);
+}
+
+
+void RelayTrace::CountDrop(RelayStats *stats) {
+  stats->drops.fetch_add(1, boost::memory_order_relaxed);
+  the_total_stats.drops.fetch_add(1, boost::memory_order_relaxed);
+}
+
+
+void RelayTrace::CountMerge(RelayStats *stats) {
+  stats->merges.fetch_add(1, boost::memory_order_relaxed);
+  the_total_stats.merges.fetch_add(1, boost::memory_order_relaxed);
+}
+
+
+Json RelayTrace::Dump() {
+  typedef std::pair<uint64_t, Json> TraceSample;
+  std::vector<TraceSample> samples;
+
+  for (size_t i = 0; i < kTraceBufferSize; ++i) {
+    const TraceEntry &entry = the_entries[i];
+    const uint64_t sequence = entry.sequence.load(boost::memory_order_acquire);
+    if (sequence == 0) {
+      continue;
+    }
+
+    uint64_t session_id[2];
+    session_id[0] = entry.session_id[0].load(boost::memory_order_relaxed);
+    session_id[1] = entry.session_id[1].load(boost::memory_order_relaxed);
+    const int64_t when_in_usec =
+        entry.when_in_usec.load(boost::memory_order_relaxed);
+    const uint64_t bytes = entry.bytes.load(boost::memory_order_relaxed);
+    const bool dropped = entry.dropped.load(boost::memory_order_relaxed);
+
+    boost::atomic_thread_fence(boost::memory_order_acquire);
+    if (entry.sequence.load(boost::memory_order_relaxed) != sequence) {
+      // 읽는 동안 덮어써졌습니다.
+      continue;
+    }
+
+    SessionId from;
+    std::memcpy(from.data, session_id, sizeof(session_id));
+
+    Json sample;
+    sample["sequence"] = static_cast<int64_t>(sequence);
+    sample["when_in_usec"] = when_in_usec;
+    sample["session_id"] = to_string(from);
+    sample["bytes"] = static_cast<int64_t>(bytes);
+    sample["dropped"] = dropped;
+    samples.push_back(TraceSample(sequence, sample));
+  }
+
+  std::sort(samples.begin(), samples.end(),
+            [](const TraceSample &lhs, const TraceSample &rhs) {
+              return lhs.first < rhs.first;
+            });
+
+  Json dump;
+  dump["packets"] = the_total_stats.packets.load();
+  dump["bytes"] = the_total_stats.bytes.load();
+  dump["packed_bytes"] = the_total_stats.packed_bytes.load();
+  dump["drops"] = the_total_stats.drops.load();
+  dump["merges"] = the_total_stats.merges.load();
+  dump["sampling_rate"] = FLAGS_relay_trace_sampling_rate;
+  dump["samples"].SetArray();
+  for (size_t i = 0; i < samples.size(); ++i) {
+    dump["samples"].PushBack(samples[i].second);
+  }
+  return dump;
+}
+
+}  // namespace pong
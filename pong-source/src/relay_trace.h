@@ -0,0 +1,53 @@
+﻿#ifndef SRC_RELAY_TRACE_H_
+#define SRC_RELAY_TRACE_H_
+
+#include <boost/atomic.hpp>
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 매치 하나의 relay 통계입니다. 여러 이벤트 스레드에서 동시에 갱신합니다.
+struct RelayStats {
+  RelayStats()
+      : packets(0), bytes(0), packed_bytes(0), drops(0), merges(0) {
+  }
+
+  boost::atomic<int64_t> packets;
+  // 인코딩과 상관없이 relay 메시지를 직렬화한 크기입니다.
+  boost::atomic<int64_t> bytes;
+  // 그 중 use_relay_codec 으로 압축한 payload 의 크기입니다.
+  boost::atomic<int64_t> packed_bytes;
+  boost::atomic<int64_t> drops;
+  // 아직 보내지 않은 relay 가 새 relay 로 교체된 횟수입니다.
+  boost::atomic<int64_t> merges;
+};
+
+
+// relay 패킷마다 LOG(INFO) 를 남기는 대신 카운터를 올리고, N 개 중 하나만
+// 메모리 상의 ring buffer 에 기록합니다. ring buffer 는 API 서비스의
+// GET /v1/relay_trace 로 덤프할 수 있습니다.
+class RelayTrace {
+ public:
+  static void Install();
+
+  // relay 패킷 하나를 기록합니다. opponent 가 없어 보내지 못했으면
+  // dropped 를 true 로 넘깁니다. 크기를 재려고 메시지를 읽으므로 엔진에
+  // 넘기기 전에 불러야 합니다.
+  static void Record(RelayStats *stats, const Ptr<Session> &from,
+                     const Ptr<FunMessage> &message, bool dropped);
+  static void Record(RelayStats *stats, const Ptr<Session> &from,
+                     const Json &message, bool dropped);
+
+  // 패킷을 받은 뒤에 보내지 못했거나 새 패킷으로 교체된 경우 불립니다.
+  static void CountDrop(RelayStats *stats);
+  static void CountMerge(RelayStats *stats);
+
+  static Json Dump();
+};
+
+}  // namespace pong
+
+#endif  // SRC_RELAY_TRACE_H_
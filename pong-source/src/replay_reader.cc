@@ -0,0 +1,192 @@
+﻿#include "replay_reader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include <glog/logging.h>
+#include <zlib.h>
+
+
+namespace pong {
+
+namespace {
+
+const size_t kBlockHeaderSize = 12;
+const size_t kIndexEntrySize = 16 + 8;
+const size_t kRecordHeaderSize = 1 + 1 + 1 + 16 + 8 + 4;
+// 블록은 64KB 를 넘으면 쓰므로 이보다 크면 깨진 파일입니다. zlib 은 1032
+// 배 넘게 압축하지 못합니다.
+const uint32_t kMaxRawBlockSize = 16 * 1024 * 1024;
+const uint64_t kMaxCompressionRatio = 1032;
+
+
+bool MapFile(const string &path, const char **data, size_t *size) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "Cannot open a replay file: path=" << path;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  *size = st.st_size;
+  *data = NULL;
+  if (*size > 0) {
+    void *mapped = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      LOG(ERROR) << "Cannot map a replay file: path=" << path;
+      close(fd);
+      return false;
+    }
+    *data = static_cast<const char *>(mapped);
+  }
+  close(fd);
+  return true;
+}
+
+
+void UnmapFile(const char **data, size_t *size) {
+  if (*data) {
+    munmap(const_cast<char *>(*data), *size);
+  }
+  *data = NULL;
+  *size = 0;
+}
+
+
+template <typename T>
+T ReadInt(const char *in) {
+  T value;
+  std::memcpy(&value, in, sizeof(T));
+  return value;
+}
+
+
+Uuid ReadUuid(const char *in) {
+  Uuid uuid;
+  std::memcpy(uuid.data, in, uuid.size());
+  return uuid;
+}
+
+
+// 블록 하나를 풀어 match_id 의 레코드만 events 에 더합니다.
+bool ReadBlock(const char *data, size_t data_size, uint64_t offset,
+               const Uuid &match_id, std::vector<ReplayEvent> *events) {
+  if (offset > data_size || data_size - offset < kBlockHeaderSize ||
+      std::memcmp(data + offset, "PRB1", 4) != 0) {
+    return false;
+  }
+  const uint32_t raw_size = ReadInt<uint32_t>(data + offset + 4);
+  const uint32_t compressed_size = ReadInt<uint32_t>(data + offset + 8);
+  if (data_size - offset - kBlockHeaderSize < compressed_size ||
+      raw_size > kMaxRawBlockSize ||
+      raw_size > compressed_size * kMaxCompressionRatio) {
+    return false;
+  }
+
+  string raw(raw_size, '\0');
+  uLongf uncompressed_size = raw_size;
+  if (uncompress(reinterpret_cast<Bytef *>(&raw[0]), &uncompressed_size,
+                 reinterpret_cast<const Bytef *>(
+                     data + offset + kBlockHeaderSize),
+                 compressed_size) != Z_OK ||
+      uncompressed_size != raw_size) {
+    return false;
+  }
+
+  size_t pos = 0;
+  while (pos + kRecordHeaderSize <= raw.size()) {
+    const char *record = raw.data() + pos;
+    const uint32_t payload_size = ReadInt<uint32_t>(record + 27);
+    if (pos + kRecordHeaderSize + payload_size > raw.size()) {
+      return false;
+    }
+    pos += kRecordHeaderSize + payload_size;
+
+    if (ReadUuid(record + 3) != match_id) {
+      continue;
+    }
+    ReplayEvent event;
+    event.type = static_cast<ReplayEventType>(ReadInt<uint8_t>(record));
+    event.side = static_cast<PongSide>(ReadInt<uint8_t>(record + 1));
+    event.encoding = static_cast<EncodingScheme>(ReadInt<uint8_t>(record + 2));
+    event.match_id = match_id;
+    event.time_in_usec = ReadInt<int64_t>(record + 19);
+    event.payload.assign(record + kRecordHeaderSize, payload_size);
+    events->push_back(event);
+  }
+  return pos == raw.size();
+}
+
+}  // unnamed namespace
+
+
+ReplayReader::ReplayReader()
+    : data_(NULL), data_size_(0), index_(NULL), index_size_(0) {
+}
+
+
+ReplayReader::~ReplayReader() {
+  Close();
+}
+
+
+bool ReplayReader::Open(const string &path) {
+  Close();
+  if (not MapFile(path + ".dat", &data_, &data_size_) ||
+      not MapFile(path + ".idx", &index_, &index_size_)) {
+    Close();
+    return false;
+  }
+
+  for (size_t pos = 0; pos + kIndexEntrySize <= index_size_;
+       pos += kIndexEntrySize) {
+    const Uuid match_id = ReadUuid(index_ + pos);
+    std::vector<uint64_t> &offsets = block_offsets_[match_id];
+    if (offsets.empty()) {
+      match_ids_.push_back(match_id);
+    }
+    offsets.push_back(ReadInt<uint64_t>(index_ + pos + 16));
+  }
+  return true;
+}
+
+
+void ReplayReader::Close() {
+  UnmapFile(&data_, &data_size_);
+  UnmapFile(&index_, &index_size_);
+  match_ids_.clear();
+  block_offsets_.clear();
+}
+
+
+void ReplayReader::GetMatchIds(std::vector<Uuid> *match_ids) const {
+  BOOST_ASSERT(match_ids);
+  match_ids->insert(match_ids->end(), match_ids_.begin(), match_ids_.end());
+}
+
+
+bool ReplayReader::ReadMatch(const Uuid &match_id,
+                             std::vector<ReplayEvent> *events) const {
+  BOOST_ASSERT(events);
+  BlockOffsetMap::const_iterator itr = block_offsets_.find(match_id);
+  if (itr == block_offsets_.end()) {
+    return true;
+  }
+  const std::vector<uint64_t> &offsets = itr->second;
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    if (not ReadBlock(data_, data_size_, offsets[i], match_id, events)) {
+      LOG(ERROR) << "Corrupted replay block: offset=" << offsets[i];
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace pong
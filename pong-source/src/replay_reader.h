@@ -0,0 +1,48 @@
+﻿#ifndef SRC_REPLAY_READER_H_
+#define SRC_REPLAY_READER_H_
+
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include <funapi.h>
+
+#include "pong_types.h"
+#include "replay_recorder.h"
+
+
+namespace pong {
+
+// ReplayRecorder 가 쓴 파일을 mmap 으로 열어 매치 단위로 읽습니다.
+// 형식은 replay_recorder.h 를 참고하세요. Open() 할 때 색인을 한 번 읽어
+// 매치마다 블록 위치를 모아 둡니다.
+class ReplayReader : private boost::noncopyable {
+ public:
+  ReplayReader();
+  ~ReplayReader();
+
+  // path 는 .dat/.idx 를 뺀 경로입니다.
+  bool Open(const string &path);
+  void Close();
+
+  // 기록된 매치들의 id 입니다. 처음 기록된 순서로 채웁니다.
+  void GetMatchIds(std::vector<Uuid> *match_ids) const;
+  // 매치 하나의 이벤트를 기록된 순서로 읽습니다. 파일이 깨졌으면 false 를
+  // 반환합니다.
+  bool ReadMatch(const Uuid &match_id, std::vector<ReplayEvent> *events) const;
+
+ private:
+  typedef boost::unordered_map<Uuid, std::vector<uint64_t>,
+                               boost::hash<Uuid> > BlockOffsetMap;
+
+  const char *data_;
+  size_t data_size_;
+  const char *index_;
+  size_t index_size_;
+  std::vector<Uuid> match_ids_;
+  BlockOffsetMap block_offsets_;
+};
+
+}  // namespace pong
+
+#endif  // SRC_REPLAY_READER_H_
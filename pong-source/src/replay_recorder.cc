@@ -0,0 +1,345 @@
+﻿#include "replay_recorder.h"
+
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+#include <zlib.h>
+
+
+DEFINE_string(replay_directory, "",
+              "Records match replays into this directory. Empty disables "
+              "recording");
+DEFINE_int32(replay_queue_size, 65536,
+             "Maximum number of match events waiting to be written. Events "
+             "are dropped when the queue is full");
+
+
+namespace pong {
+
+namespace {
+
+const char kBlockMagic[4] = { 'P', 'R', 'B', '1' };
+// 압축 전 블록 크기가 이보다 커지면 씁니다.
+const size_t kBlockSize = 64 * 1024;
+// 이벤트가 없으면 이 간격으로 쌓인 블록을 씁니다.
+const int64_t kFlushIntervalInMs = 1000;
+
+const boost::posix_time::ptime kUnixEpoch(boost::gregorian::date(1970, 1, 1));
+
+// relay 마다 잡는 lock 이므로 매치 id 로 큐를 나눕니다. 한 매치의 이벤트는
+// 한 shard 에만 들어가므로 매치 안의 순서는 그대로 남습니다.
+const size_t kQueueShardCount = 16;
+
+struct QueueShard {
+  boost::mutex mutex;
+  std::vector<ReplayEvent> events;
+};
+
+boost::atomic<bool> the_enabled(false);
+boost::atomic<int64_t> the_dropped_count(0);
+// 모든 shard 에 쌓인 이벤트 수입니다. replay_queue_size 를 넘지 않습니다.
+boost::atomic<int64_t> the_queued_count(0);
+
+QueueShard the_queue_shards[kQueueShardCount];
+
+// 기록 스레드를 깨우고 멈출 때만 씁니다.
+boost::mutex the_writer_mutex;
+boost::condition_variable the_writer_condition;
+bool the_stop_requested = false;
+Ptr<boost::thread> the_writer_thread;
+
+
+template <typename T>
+void AppendInt(string *out, T value) {
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, &value, sizeof(T));
+  out->append(bytes, sizeof(T));
+}
+
+
+bool WriteFully(FILE *file, const string &data) {
+  return std::fwrite(data.data(), 1, data.size(), file) == data.size() &&
+         std::fflush(file) == 0;
+}
+
+
+class ReplayWriter {
+ public:
+  ReplayWriter() : data_file_(NULL), index_file_(NULL), data_offset_(0) {}
+
+  ~ReplayWriter() {
+    Close();
+  }
+
+  bool Open(const string &directory) {
+    path_ = directory + "/replay-" +
+        boost::posix_time::to_iso_string(WallClock::Now());
+    data_file_ = std::fopen((path_ + ".dat").c_str(), "ab");
+    index_file_ = std::fopen((path_ + ".idx").c_str(), "ab");
+    if (not data_file_ || not index_file_) {
+      LOG(ERROR) << "Cannot open replay files: path=" << path_;
+      Close();
+      return false;
+    }
+    LOG(INFO) << "Recording match replays: path=" << path_;
+    return true;
+  }
+
+  void Close() {
+    if (data_file_) {
+      std::fclose(data_file_);
+      data_file_ = NULL;
+    }
+    if (index_file_) {
+      std::fclose(index_file_);
+      index_file_ = NULL;
+    }
+  }
+
+  // 파일에 쓰지 못했으면 false 를 반환합니다.
+  bool Append(const ReplayEvent &event) {
+    AppendInt<uint8_t>(&block_, event.type);
+    AppendInt<uint8_t>(&block_, event.side);
+    AppendInt<uint8_t>(&block_, event.encoding);
+    block_.append(reinterpret_cast<const char *>(event.match_id.data),
+                  event.match_id.size());
+    AppendInt<int64_t>(&block_, event.time_in_usec);
+    AppendInt<uint32_t>(&block_, event.payload.size());
+    block_.append(event.payload);
+    block_matches_.insert(event.match_id);
+
+    if (block_.size() >= kBlockSize) {
+      return Flush();
+    }
+    return true;
+  }
+
+  // 파일에 쓰지 못했으면 false 를 반환합니다. 이 때는 색인을 쓰지 않고
+  // 위치도 옮기지 않으므로 이미 쓴 블록은 그대로 읽을 수 있습니다.
+  bool Flush() {
+    if (block_.empty()) {
+      return true;
+    }
+
+    uLongf compressed_size = compressBound(block_.size());
+    compressed_.resize(compressed_size);
+    if (compress2(reinterpret_cast<Bytef *>(&compressed_[0]),
+                  &compressed_size,
+                  reinterpret_cast<const Bytef *>(block_.data()),
+                  block_.size(), Z_BEST_SPEED) != Z_OK) {
+      LOG(ERROR) << "Cannot compress a replay block: size=" << block_.size();
+      Reset();
+      return true;
+    }
+    compressed_.resize(compressed_size);
+
+    string header(kBlockMagic, sizeof(kBlockMagic));
+    AppendInt<uint32_t>(&header, block_.size());
+    AppendInt<uint32_t>(&header, compressed_size);
+    if (not WriteFully(data_file_, header + compressed_)) {
+      LOG(ERROR) << "Cannot write a replay block: path=" << path_
+                 << ".dat, offset=" << data_offset_;
+      return false;
+    }
+
+    // 블록을 다 쓴 뒤에 색인을 씁니다.
+    string index;
+    for (std::set<Uuid>::const_iterator itr = block_matches_.begin();
+         itr != block_matches_.end(); ++itr) {
+      index.append(reinterpret_cast<const char *>(itr->data), itr->size());
+      AppendInt<uint64_t>(&index, data_offset_);
+    }
+    if (not WriteFully(index_file_, index)) {
+      LOG(ERROR) << "Cannot write a replay index: path=" << path_ << ".idx";
+      return false;
+    }
+
+    data_offset_ += header.size() + compressed_size;
+    Reset();
+    return true;
+  }
+
+ private:
+  void Reset() {
+    block_.clear();
+    block_matches_.clear();
+  }
+
+  string path_;
+  FILE *data_file_;
+  FILE *index_file_;
+  uint64_t data_offset_;
+  string block_;
+  string compressed_;
+  std::set<Uuid> block_matches_;
+};
+
+
+// 모든 shard 의 이벤트를 꺼내 씁니다. 파일에 쓰지 못했으면 false 입니다.
+bool DrainQueue(ReplayWriter *writer, std::vector<ReplayEvent> *events) {
+  bool drained = false;
+  for (size_t i = 0; i < kQueueShardCount; ++i) {
+    {
+      boost::mutex::scoped_lock lock(the_queue_shards[i].mutex);
+      events->swap(the_queue_shards[i].events);
+    }
+    if (events->empty()) {
+      continue;
+    }
+    drained = true;
+    the_queued_count.fetch_sub(events->size(), boost::memory_order_relaxed);
+    for (size_t j = 0; j < events->size(); ++j) {
+      if (not writer->Append((*events)[j])) {
+        return false;
+      }
+    }
+    events->clear();
+  }
+  // 한동안 이벤트가 없으면 쌓인 블록을 씁니다.
+  return drained || writer->Flush();
+}
+
+
+void RunWriter(const Ptr<ReplayWriter> &writer) {
+  std::vector<ReplayEvent> events;
+  while (true) {
+    bool stop_requested = false;
+    {
+      boost::mutex::scoped_lock lock(the_writer_mutex);
+      if (not the_stop_requested &&
+          the_queued_count.load(boost::memory_order_relaxed) == 0) {
+        the_writer_condition.timed_wait(
+            lock, boost::posix_time::milliseconds(kFlushIntervalInMs));
+      }
+      stop_requested = the_stop_requested;
+    }
+
+    if (not DrainQueue(writer.get(), &events)) {
+      // 파일이 망가지지 않도록 더 쓰지 않습니다.
+      the_enabled.store(false, boost::memory_order_release);
+      LOG(ERROR) << "Stopped recording match replays";
+      writer->Close();
+      return;
+    }
+
+    if (stop_requested) {
+      if (not writer->Flush()) {
+        LOG(ERROR) << "Lost the last replay block";
+      }
+      writer->Close();
+      return;
+    }
+  }
+}
+
+
+// 큐에 이벤트를 넣습니다. 큐가 가득 찼으면 버립니다. payload 는 비웁니다.
+void Enqueue(const MatchRoom &room, PongSide side, ReplayEventType type,
+             EncodingScheme encoding, string *payload) {
+  if (the_queued_count.fetch_add(1, boost::memory_order_relaxed) >=
+      FLAGS_replay_queue_size) {
+    the_queued_count.fetch_sub(1, boost::memory_order_relaxed);
+    the_dropped_count.fetch_add(1, boost::memory_order_relaxed);
+    LOG_EVERY_N(WARNING, 1000) << "Replay queue is full. Dropping events: "
+                               << "dropped=" << the_dropped_count.load();
+    return;
+  }
+
+  const Uuid &match_id = room.tag();
+  QueueShard &shard =
+      the_queue_shards[boost::hash<Uuid>()(match_id) % kQueueShardCount];
+  {
+    boost::mutex::scoped_lock lock(shard.mutex);
+    shard.events.push_back(ReplayEvent());
+    ReplayEvent &event = shard.events.back();
+    event.match_id = match_id;
+    event.time_in_usec = (WallClock::Now() - kUnixEpoch).total_microseconds();
+    event.type = type;
+    event.side = side;
+    event.encoding = encoding;
+    event.payload.swap(*payload);
+  }
+}
+
+}  // unnamed namespace
+
+
+ReplayEvent::ReplayEvent()
+    : time_in_usec(0), type(kReplayReady), side(kSideA),
+      encoding(kUnknownEncoding) {
+  std::memset(match_id.data, 0, match_id.size());
+}
+
+
+void ReplayRecorder::Start() {
+  if (FLAGS_replay_directory.empty()) {
+    return;
+  }
+  Ptr<ReplayWriter> writer(new ReplayWriter);
+  if (not writer->Open(FLAGS_replay_directory)) {
+    return;
+  }
+  the_writer_thread.reset(new boost::thread(bind(&RunWriter, writer)));
+  the_enabled.store(true, boost::memory_order_release);
+}
+
+
+void ReplayRecorder::Stop() {
+  if (not the_writer_thread) {
+    return;
+  }
+  the_enabled.store(false, boost::memory_order_release);
+  {
+    boost::mutex::scoped_lock lock(the_writer_mutex);
+    the_stop_requested = true;
+  }
+  the_writer_condition.notify_one();
+  the_writer_thread->join();
+  the_writer_thread.reset();
+}
+
+
+bool ReplayRecorder::enabled() {
+  return the_enabled.load(boost::memory_order_acquire);
+}
+
+
+void ReplayRecorder::Record(const MatchRoom &room, PongSide side,
+                            ReplayEventType type, const string &payload) {
+  if (not enabled()) {
+    return;
+  }
+  string copied(payload);
+  Enqueue(room, side, type, kUnknownEncoding, &copied);
+}
+
+
+void ReplayRecorder::Record(const MatchRoom &room, PongSide side,
+                            const Ptr<FunMessage> &relay) {
+  if (not enabled()) {
+    return;
+  }
+  // 보낸 뒤에는 엔진이 메시지를 고칠 수 있으므로 여기서 직렬화합니다.
+  string payload;
+  relay->SerializeToString(&payload);
+  Enqueue(room, side, kReplayRelay, kProtobufEncoding, &payload);
+}
+
+
+void ReplayRecorder::Record(const MatchRoom &room, PongSide side,
+                            const Json &relay) {
+  if (not enabled()) {
+    return;
+  }
+  string payload = relay.ToString();
+  Enqueue(room, side, kReplayRelay, kJsonEncoding, &payload);
+}
+
+}  // namespace pong
@@ -0,0 +1,84 @@
+﻿#ifndef SRC_REPLAY_RECORDER_H_
+#define SRC_REPLAY_RECORDER_H_
+
+#include <funapi.h>
+
+#include "match_room.h"
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 매치 replay 파일 형식
+//
+// replay_directory 아래에 서버 프로세스마다 두 파일을 만들고 뒤에 덧붙이기만
+// 합니다. 정수는 모두 little endian 입니다.
+//
+//   replay-<시각>.dat: 블록의 연속
+//     4   "PRB1"
+//     4   압축 전 크기
+//     4   압축 후 크기
+//     N   zlib 으로 압축한 레코드들
+//   레코드
+//     1   ReplayEventType
+//     1   PongSide
+//     1   EncodingScheme
+//     16  match id (MatchRoom::tag())
+//     8   시각 (unix epoch 부터 us)
+//     4   payload 크기
+//     N   payload
+//
+//   replay-<시각>.idx: 블록을 쓸 때마다 그 블록에 레코드가 있는 매치마다
+//     16  match id
+//     8   .dat 안에서 블록의 위치
+//
+// 매치 하나를 읽을 때는 .idx 에서 그 매치의 블록만 찾아 풉니다.
+
+enum ReplayEventType {
+  kReplayReady = 1,
+  kReplayStart,
+  // payload 는 side 가 보낸 relay 입니다. JSON 은 문자열, Protobuf 는
+  // 직렬화한 FunMessage 입니다.
+  kReplayRelay,
+  // side 는 이긴 쪽이고 payload 는 이긴 플레이어의 id 입니다. 승패 없이
+  // 끝났으면 payload 가 비어 있습니다.
+  kReplayFinish
+};
+
+
+struct ReplayEvent {
+  ReplayEvent();
+
+  Uuid match_id;
+  int64_t time_in_usec;
+  ReplayEventType type;
+  PongSide side;
+  EncodingScheme encoding;
+  string payload;
+};
+
+
+// 매치 이벤트를 replay 파일에 기록합니다.
+//
+// Record() 는 relay 를 직렬화해서 크기가 정해진 큐에 넣기만 하고, 압축과
+// 파일 쓰기는 별도 스레드에서 합니다. 큐가 가득 차면 이벤트를 버리므로
+// 이벤트 스레드는 기다리지 않습니다. 파일에 쓰지 못하면 기록을 멈춥니다.
+class ReplayRecorder {
+ public:
+  // replay_directory 가 지정되어 있으면 기록 스레드를 시작합니다.
+  static void Start();
+  // 큐에 남은 이벤트와 마지막 블록을 쓰고 기록 스레드를 멈춥니다.
+  static void Stop();
+  static bool enabled();
+
+  static void Record(const MatchRoom &room, PongSide side,
+                     ReplayEventType type, const string &payload = "");
+  static void Record(const MatchRoom &room, PongSide side,
+                     const Ptr<FunMessage> &relay);
+  static void Record(const MatchRoom &room, PongSide side,
+                     const Json &relay);
+};
+
+}  // namespace pong
+
+#endif  // SRC_REPLAY_RECORDER_H_
@@ -0,0 +1,142 @@
+﻿#include "response_pool.h"
+
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#include "pong_messages.pb.h"
+
+
+namespace pong {
+
+namespace {
+
+// 스레드마다 이 개수까지만 보관합니다. 나머지는 바로 해제합니다.
+const size_t kMaxPooledMessages = 256;
+
+
+// Acquire() 를 부른 스레드의 free list 입니다. 메시지는 보통 엔진 IO
+// 스레드에서 마지막 참조가 사라지므로 돌려받을 때는 lock 을 잡습니다.
+// 꺼내는 스레드와 돌려주는 스레드 하나씩만 만나므로 경합은 적습니다.
+struct MessageFreeList {
+  MessageFreeList() {
+    messages.reserve(kMaxPooledMessages);
+  }
+
+  ~MessageFreeList() {
+    for (size_t i = 0; i < messages.size(); ++i) {
+      delete messages[i];
+    }
+  }
+
+  boost::mutex mutex;
+  std::vector<FunMessage *> messages;
+};
+
+
+// 메시지를 꺼낸 스레드의 free list 로 돌려보냅니다. free list 는 메시지가
+// 모두 돌아올 때까지 남아 있으므로 스레드가 먼저 끝나도 괜찮습니다.
+class ReleaseMessage {
+ public:
+  explicit ReleaseMessage(const boost::shared_ptr<MessageFreeList> &free_list)
+      : free_list_(free_list) {
+  }
+
+  void operator()(FunMessage *message) const {
+    message->Clear();
+    {
+      boost::mutex::scoped_lock lock(free_list_->mutex);
+      if (free_list_->messages.size() < kMaxPooledMessages) {
+        free_list_->messages.push_back(message);
+        return;
+      }
+    }
+    delete message;
+  }
+
+ private:
+  boost::shared_ptr<MessageFreeList> free_list_;
+};
+
+
+const boost::shared_ptr<MessageFreeList> &GetFreeList() {
+  thread_local boost::shared_ptr<MessageFreeList> the_free_list(
+      new MessageFreeList);
+  return the_free_list;
+}
+
+}  // unnamed namespace
+
+
+Ptr<FunMessage> ResponsePool::Acquire() {
+  const boost::shared_ptr<MessageFreeList> &free_list = GetFreeList();
+  FunMessage *message = NULL;
+  {
+    boost::mutex::scoped_lock lock(free_list->mutex);
+    if (not free_list->messages.empty()) {
+      message = free_list->messages.back();
+      free_list->messages.pop_back();
+    }
+  }
+  if (message == NULL) {
+    message = new FunMessage;
+  }
+  return Ptr<FunMessage>(message, ReleaseMessage(free_list));
+}
+
+
+Ptr<FunMessage> ResponsePool::GameStart() {
+  Ptr<FunMessage> message = Acquire();
+  message->MutableExtension(game_start)->set_result("ok");
+  return message;
+}
+
+
+Ptr<FunMessage> ResponsePool::GameResult(bool win) {
+  Ptr<FunMessage> message = Acquire();
+  message->MutableExtension(game_result)->set_result(win ? "win" : "lose");
+  return message;
+}
+
+
+Ptr<FunMessage> ResponsePool::GameVoided() {
+  Ptr<FunMessage> message = Acquire();
+  message->MutableExtension(game_result)->set_result("void");
+  return message;
+}
+
+
+Ptr<FunMessage> ResponsePool::NotLoggedIn() {
+  Ptr<FunMessage> message = Acquire();
+  PongErrorMessage *error = message->MutableExtension(pong_error);
+  error->set_result("fail");
+  error->set_msg("not logged in");
+  return message;
+}
+
+
+const Json &ResponsePool::GameStartJson() {
+  static const Json the_message = MakeResponse("ok");
+  return the_message;
+}
+
+
+const Json &ResponsePool::GameResultJson(bool win) {
+  static const Json the_win = MakeResponse("win");
+  static const Json the_lose = MakeResponse("lose");
+  return win ? the_win : the_lose;
+}
+
+
+const Json &ResponsePool::GameVoidedJson() {
+  static const Json the_message = MakeResponse("void");
+  return the_message;
+}
+
+
+const Json &ResponsePool::NotLoggedInJson() {
+  static const Json the_message = MakeResponse("fail", "not logged in");
+  return the_message;
+}
+
+}  // namespace pong
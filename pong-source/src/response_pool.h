@@ -0,0 +1,38 @@
+﻿#ifndef SRC_RESPONSE_POOL_H_
+#define SRC_RESPONSE_POOL_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 응답 메시지를 재사용합니다.
+//
+// Acquire() 로 꺼낸 FunMessage 는 마지막 참조가 사라질 때 내용만 지우고
+// Acquire() 를 부른 스레드의 pool 로 돌아갑니다. protobuf 는 Clear() 후에도
+// extension 과 문자열 버퍼를 지우지 않으므로 다음 응답에서 그대로 다시
+// 씁니다.
+//
+// FunMessage 는 보낼 때 엔진이 크기와 헤더를 기록하므로 세션끼리 공유할 수
+// 없습니다. 내용이 바뀌지 않는 응답(start, win, lose 등)도 보낼 때마다 새로
+// 꺼냅니다. 공유하는 것은 JSON 응답뿐입니다.
+class ResponsePool {
+ public:
+  static Ptr<FunMessage> Acquire();
+
+  static Ptr<FunMessage> GameStart();
+  static Ptr<FunMessage> GameResult(bool win);
+  static Ptr<FunMessage> GameVoided();
+  static Ptr<FunMessage> NotLoggedIn();
+
+  static const Json &GameStartJson();
+  static const Json &GameResultJson(bool win);
+  static const Json &GameVoidedJson();
+  static const Json &NotLoggedInJson();
+};
+
+}  // namespace pong
+
+#endif  // SRC_RESPONSE_POOL_H_
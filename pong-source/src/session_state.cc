@@ -0,0 +1,209 @@
+﻿#include "session_state.h"
+
+#include <utility>
+
+#include <boost/functional/hash.hpp>
+#include <funapi.h>
+
+
+namespace pong {
+
+namespace {
+
+struct InternedIdHash {
+  size_t operator()(const string *id) const {
+    return boost::hash<string>()(*id);
+  }
+};
+
+struct InternedIdEqual {
+  bool operator()(const string *lhs, const string *rhs) const {
+    return *lhs == *rhs;
+  }
+};
+
+// 문자열을 다시 갖지 않도록 InternedId 가 가리키는 문자열을 key 로 씁니다.
+typedef boost::unordered_map<const string *, weak_ptr<const string>,
+                             InternedIdHash, InternedIdEqual> InternedIdMap;
+
+boost::mutex the_interned_id_mutex;
+InternedIdMap the_interned_ids;
+
+
+void ReleaseInternedId(const string *id) {
+  {
+    boost::mutex::scoped_lock lock(the_interned_id_mutex);
+    InternedIdMap::iterator itr = the_interned_ids.find(id);
+    // 그 사이에 같은 아이디를 새로 만들었으면 그대로 둡니다.
+    if (itr != the_interned_ids.end() && itr->first == id) {
+      the_interned_ids.erase(itr);
+    }
+  }
+  delete id;
+}
+
+
+// 로비의 로그인처럼 여러 스레드가 동시에 찾으므로 표를 나눕니다.
+const size_t kStateShardCount = 16;
+
+typedef boost::unordered_map<SessionId, Ptr<PongSessionState>,
+                             boost::hash<SessionId> > SessionStateMap;
+
+struct SessionStateShard {
+  boost::mutex mutex;
+  SessionStateMap states;
+};
+
+SessionStateShard the_state_shards[kStateShardCount];
+
+
+SessionStateShard &GetShard(const Ptr<Session> &session) {
+  const size_t hash = boost::hash<SessionId>()(session->id());
+  return the_state_shards[hash % kStateShardCount];
+}
+
+}  // unnamed namespace
+
+
+InternedId InternPlayerId(const string &id) {
+  if (id.empty()) {
+    return InternedId();
+  }
+
+  boost::mutex::scoped_lock lock(the_interned_id_mutex);
+  InternedIdMap::iterator itr = the_interned_ids.find(&id);
+  if (itr != the_interned_ids.end()) {
+    if (InternedId interned = itr->second.lock()) {
+      return interned;
+    }
+    // 놓였지만 아직 ReleaseInternedId() 가 지우지 못했습니다.
+    the_interned_ids.erase(itr);
+  }
+
+  InternedId interned(new string(id), ReleaseInternedId);
+  the_interned_ids.insert(
+      std::make_pair(interned.get(), weak_ptr<const string>(interned)));
+  return interned;
+}
+
+
+PongSessionState::PongSessionState()
+    : matching_(kMatchingNone), ready_(false), redirected_(false) {
+}
+
+
+Ptr<PongSessionState> PongSessionState::Find(const Ptr<Session> &session) {
+  SessionStateShard &shard = GetShard(session);
+  boost::mutex::scoped_lock lock(shard.mutex);
+  SessionStateMap::const_iterator itr = shard.states.find(session->id());
+  if (itr == shard.states.end()) {
+    return Ptr<PongSessionState>();
+  }
+  return itr->second;
+}
+
+
+Ptr<PongSessionState> PongSessionState::FindOrCreate(
+    const Ptr<Session> &session) {
+  SessionStateShard &shard = GetShard(session);
+  boost::mutex::scoped_lock lock(shard.mutex);
+  Ptr<PongSessionState> &state = shard.states[session->id()];
+  if (not state) {
+    state.reset(new PongSessionState);
+  }
+  return state;
+}
+
+
+void PongSessionState::Set(const Ptr<Session> &session,
+                           const Ptr<PongSessionState> &state) {
+  BOOST_ASSERT(state);
+  SessionStateShard &shard = GetShard(session);
+  boost::mutex::scoped_lock lock(shard.mutex);
+  shard.states[session->id()] = state;
+}
+
+
+Ptr<PongSessionState> PongSessionState::Remove(const Ptr<Session> &session) {
+  Ptr<PongSessionState> state;
+  SessionStateShard &shard = GetShard(session);
+  boost::mutex::scoped_lock lock(shard.mutex);
+  SessionStateMap::iterator itr = shard.states.find(session->id());
+  if (itr != shard.states.end()) {
+    state.swap(itr->second);
+    shard.states.erase(itr);
+  }
+  return state;
+}
+
+
+string PongSessionState::GetId(const Ptr<Session> &session) {
+  Ptr<PongSessionState> state = Find(session);
+  return state ? state->id() : string();
+}
+
+
+string PongSessionState::id() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return id_ ? *id_ : string();
+}
+
+
+void PongSessionState::set_id(const string &id) {
+  InternedId interned = InternPlayerId(id);
+  boost::mutex::scoped_lock lock(mutex_);
+  id_.swap(interned);
+}
+
+
+string PongSessionState::opponent() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return opponent_ ? *opponent_ : string();
+}
+
+
+void PongSessionState::set_opponent(const string &opponent) {
+  InternedId interned = InternPlayerId(opponent);
+  boost::mutex::scoped_lock lock(mutex_);
+  opponent_.swap(interned);
+}
+
+
+MatchingState PongSessionState::matching() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return matching_;
+}
+
+
+void PongSessionState::set_matching(MatchingState matching) {
+  boost::mutex::scoped_lock lock(mutex_);
+  matching_ = matching;
+}
+
+
+bool PongSessionState::ready() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return ready_;
+}
+
+
+void PongSessionState::set_ready(bool ready) {
+  boost::mutex::scoped_lock lock(mutex_);
+  ready_ = ready;
+}
+
+
+void PongSessionState::MarkRedirected() {
+  boost::mutex::scoped_lock lock(mutex_);
+  redirected_ = true;
+}
+
+
+bool PongSessionState::TakeRedirected() {
+  boost::mutex::scoped_lock lock(mutex_);
+  const bool redirected = redirected_;
+  redirected_ = false;
+  return redirected;
+}
+
+}  // namespace pong
@@ -0,0 +1,75 @@
+﻿#ifndef SRC_SESSION_STATE_H_
+#define SRC_SESSION_STATE_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 매치메이킹 진행 상태입니다. 값은 PongRedirectState::Matching 과 같습니다.
+enum MatchingState {
+  kMatchingNone = 0,
+  kMatchingDoing,
+  kMatchingDone,
+  kMatchingFailed,
+  kMatchingCancel
+};
+
+
+// 같은 플레이어 아이디는 문자열 한 벌을 나눠 씁니다. 마지막으로 쥔 쪽이
+// 놓으면 사라집니다. 빈 아이디는 NULL 입니다.
+typedef Ptr<const string> InternedId;
+
+InternedId InternPlayerId(const string &id);
+
+
+// session 마다 두는 상태입니다. Session Context(Json) 대신 씁니다.
+//
+// session id 로 찾는 표에 따로 두므로 session lock 을 잡거나 Json 을
+// 뒤지지 않습니다. 로그인하거나 다른 서버에서 옮겨 올 때 만들어지고
+// 세션을 정리할 때 지웁니다. 서버를 옮길 때의 형식은 redirect_state.h 를
+// 참고하세요.
+class PongSessionState : private boost::noncopyable {
+ public:
+  PongSessionState();
+
+  // 없으면 NULL 입니다.
+  static Ptr<PongSessionState> Find(const Ptr<Session> &session);
+  static Ptr<PongSessionState> FindOrCreate(const Ptr<Session> &session);
+  static void Set(const Ptr<Session> &session,
+                  const Ptr<PongSessionState> &state);
+  // 지운 상태를 반환합니다. 없었으면 NULL 입니다.
+  static Ptr<PongSessionState> Remove(const Ptr<Session> &session);
+
+  // 로그인하지 않았으면 빈 문자열입니다.
+  static string GetId(const Ptr<Session> &session);
+
+  string id() const;
+  void set_id(const string &id);
+  string opponent() const;
+  void set_opponent(const string &opponent);
+  MatchingState matching() const;
+  void set_matching(MatchingState matching);
+  bool ready() const;
+  void set_ready(bool ready);
+
+  // 다른 서버에서 옮겨 왔다고 표시합니다. 로그인 대기열에서 먼저 진행하는
+  // 데 씁니다. 서버를 옮길 때 넘기지 않습니다.
+  void MarkRedirected();
+  // 옮겨 온 뒤 처음 한 번만 true 를 반환하고 표시를 지웁니다.
+  bool TakeRedirected();
+
+ private:
+  mutable boost::mutex mutex_;
+  InternedId id_;
+  InternedId opponent_;
+  MatchingState matching_;
+  bool ready_;
+  bool redirected_;
+};
+
+}  // namespace pong
+
+#endif  // SRC_SESSION_STATE_H_
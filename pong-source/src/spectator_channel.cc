@@ -0,0 +1,226 @@
+﻿#include "spectator_channel.h"
+
+#include <funapi.h>
+#include <glog/logging.h>
+
+#include "pong_codec.h"
+#include "relay_channel.h"
+#include "response_pool.h"
+
+
+namespace pong {
+
+// 모든 관전자가 공유하므로 만든 뒤에는 바꾸지 않습니다.
+struct SpectatorChannel::Frame {
+  Frame() : encoding(kJsonEncoding), side(kSideA), is_relay(false) {}
+
+  EncodingScheme encoding;
+  PongSide side;
+  // true 면 relay 만 보내고 아래 메시지는 비어 있습니다.
+  bool is_relay;
+  // SetLatest() 에서 한 번 직렬화한 relay 입니다.
+  string relay;
+
+  string type;
+  // 보낼 때 엔진이 FunMessage 를 고치므로 이 메시지는 보내지 않고 관전자마다
+  // 복사해서 보냅니다.
+  Ptr<FunMessage> pbuf_message;
+  Json json_message;
+};
+
+
+struct SpectatorChannel::Subscriber {
+  explicit Subscriber(const Ptr<Session> &session)
+      : session(session), scheduled(false) {
+  }
+
+  const weak_ptr<Session> session;
+  boost::mutex mutex;
+  // 아직 보내지 않은 가장 최근 프레임입니다.
+  Ptr<const Frame> latest;
+  // SendLatest() 가 관전자의 event tag 에 걸려 있습니다.
+  bool scheduled;
+};
+
+
+SpectatorChannel::SpectatorChannel()
+    : tag_(RandomGenerator::GenerateUuid()), subscriber_count_(0),
+      published_frames_(0), replaced_frames_(0) {
+  has_latest_[kSideA] = false;
+  has_latest_[kSideB] = false;
+}
+
+
+bool SpectatorChannel::Subscribe(const Ptr<Session> &session,
+                                 size_t max_subscribers) {
+  BOOST_ASSERT(session);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  for (size_t i = 0; i < subscribers_.size(); ++i) {
+    if (subscribers_[i]->session.lock() == session) {
+      return true;
+    }
+  }
+  if (subscribers_.size() >= max_subscribers) {
+    return false;
+  }
+  subscribers_.push_back(Ptr<Subscriber>(new Subscriber(session)));
+  subscriber_count_.store(subscribers_.size(), boost::memory_order_relaxed);
+  return true;
+}
+
+
+void SpectatorChannel::SetLatest(PongSide side,
+                                 const Ptr<FunMessage> &message) {
+  if (subscriber_count() == 0) {
+    return;
+  }
+  // message 는 곧 상대에게 보내므로 지금 직렬화해 둡니다.
+  string relay = PongCodec<kProtobufEncoding>::SerializeRelay(message);
+  boost::mutex::scoped_lock lock(mutex_);
+  has_latest_[side] = true;
+  latest_[side].swap(relay);
+}
+
+
+void SpectatorChannel::SetLatest(PongSide side, const Json &message) {
+  if (subscriber_count() == 0) {
+    return;
+  }
+  string relay = PongCodec<kJsonEncoding>::SerializeRelay(message);
+  boost::mutex::scoped_lock lock(mutex_);
+  has_latest_[side] = true;
+  latest_[side].swap(relay);
+}
+
+
+bool SpectatorChannel::TakeLatest(PongSide side, string *relay) {
+  BOOST_ASSERT(relay);
+  boost::mutex::scoped_lock lock(mutex_);
+  if (not has_latest_[side]) {
+    return false;
+  }
+  has_latest_[side] = false;
+  relay->clear();
+  relay->swap(latest_[side]);
+  return true;
+}
+
+
+void SpectatorChannel::PublishRelay(EncodingScheme encoding, PongSide side,
+                                    const string &relay) {
+  Ptr<Frame> frame(new Frame);
+  frame->encoding = encoding;
+  frame->side = side;
+  frame->is_relay = true;
+  frame->relay = relay;
+  Publish(frame);
+}
+
+
+void SpectatorChannel::Publish(const string &type,
+                               const Ptr<FunMessage> &message) {
+  Ptr<Frame> frame(new Frame);
+  frame->type = type;
+  frame->pbuf_message = message;
+  Publish(frame);
+}
+
+
+void SpectatorChannel::Publish(const string &type, const Json &message) {
+  Ptr<Frame> frame(new Frame);
+  frame->type = type;
+  frame->json_message = message;
+  Publish(frame);
+}
+
+
+void SpectatorChannel::Publish(const Ptr<const Frame> &frame) {
+  published_frames_.fetch_add(1, boost::memory_order_relaxed);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  size_t live = 0;
+  for (size_t i = 0; i < subscribers_.size(); ++i) {
+    const Ptr<Subscriber> &subscriber = subscribers_[i];
+    Ptr<Session> session = subscriber->session.lock();
+    if (not session) {
+      continue;
+    }
+    subscribers_[live++] = subscriber;
+
+    bool schedule = false;
+    {
+      boost::mutex::scoped_lock subscriber_lock(subscriber->mutex);
+      if (subscriber->latest) {
+        replaced_frames_.fetch_add(1, boost::memory_order_relaxed);
+      }
+      subscriber->latest = frame;
+      if (not subscriber->scheduled) {
+        subscriber->scheduled = true;
+        schedule = true;
+      }
+    }
+    if (schedule) {
+      Event::Invoke(bind(&SpectatorChannel::SendLatest, subscriber),
+                    session->tag());
+    }
+  }
+  subscribers_.resize(live);
+  subscriber_count_.store(live, boost::memory_order_relaxed);
+}
+
+
+void SpectatorChannel::SendLatest(const Ptr<Subscriber> &subscriber) {
+  Ptr<const Frame> frame;
+  {
+    boost::mutex::scoped_lock lock(subscriber->mutex);
+    frame.swap(subscriber->latest);
+    subscriber->scheduled = false;
+  }
+
+  Ptr<Session> session = subscriber->session.lock();
+  if (not frame || not session || not session->IsTransportAttached()) {
+    return;
+  }
+  if (frame->is_relay) {
+    if (frame->encoding == kJsonEncoding) {
+      session->SendMessage(
+          "spectate_relay",
+          PongCodec<kJsonEncoding>::SpectateFrame(frame->side, frame->relay),
+          kDefaultEncryption, GetRelayProtocol(session));
+    } else {
+      session->SendMessage(
+          "spectate_relay",
+          PongCodec<kProtobufEncoding>::SpectateFrame(frame->side,
+                                                      frame->relay),
+          kDefaultEncryption, GetRelayProtocol(session));
+    }
+  } else if (frame->pbuf_message) {
+    Ptr<FunMessage> message = ResponsePool::Acquire();
+    message->CopyFrom(*frame->pbuf_message);
+    session->SendMessage(frame->type, message, kDefaultEncryption,
+                         GetRelayProtocol(session));
+  } else {
+    session->SendMessage(frame->type, frame->json_message, kDefaultEncryption,
+                         GetRelayProtocol(session));
+  }
+}
+
+
+void SpectatorChannel::Close() {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (subscribers_.empty()) {
+    return;
+  }
+  LOG(INFO) << "Spectator channel closed: spectators=" << subscribers_.size()
+            << ", frames=" << published_frames_.load()
+            << ", replaced_frames=" << replaced_frames_.load();
+  subscribers_.clear();
+  subscriber_count_.store(0, boost::memory_order_relaxed);
+  for (int i = kSideA; i <= kSideB; ++i) {
+    has_latest_[i] = false;
+    latest_[i].clear();
+  }
+}
+
+}  // namespace pong
@@ -0,0 +1,83 @@
+﻿#ifndef SRC_SPECTATOR_CHANNEL_H_
+#define SRC_SPECTATOR_CHANNEL_H_
+
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <funapi.h>
+
+#include "pong_simulation.h"
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 매치 하나의 관전자들입니다.
+//
+// 플레이어 쪽(relay 처리, 서버 권한 tick)은 SetLatest() 로 최신 상태만 한
+// 칸에 맡기므로 관전자 수와 상관없이 비용이 일정합니다. 관전자에게 보내는
+// 일은 MatchTicker 가 tag() 에서 부르는 PublishRelay() 가 합니다. relay 는
+// SetLatest() 에서 한 번 직렬화하고 모든 관전자가 그 바이트를 공유합니다.
+// Session::SendMessage() 는 직렬화한 바이트를 받지 않으므로 관전자마다 side
+// 와 relay 바이트만 담은 작은 메시지를 새로 만들어 보냅니다.
+//
+// 관전자마다 보낼 프레임도 한 칸만 둡니다. 앞 프레임을 아직 보내지 못한
+// 관전자의 프레임은 새 프레임으로 교체되므로 느린 관전자는 최신 프레임만
+// 받습니다.
+class SpectatorChannel : private boost::noncopyable {
+ public:
+  SpectatorChannel();
+
+  // 이미 관전 중이면 true, 자리가 없으면 false 를 반환합니다.
+  bool Subscribe(const Ptr<Session> &session, size_t max_subscribers);
+  // 닫힌 관전자는 다음 Publish() 에서 빠집니다.
+  size_t subscriber_count() const {
+    return subscriber_count_.load(boost::memory_order_relaxed);
+  }
+
+  // side 가 보낸 최신 relay 를 직렬화해서 맡깁니다. 서버 권한 모드에서는
+  // kSideA 시점의 snapshot 을 맡깁니다. 관전자가 없으면 아무것도 하지
+  // 않습니다. 엔진이 FunMessage 를 고치기 전에 직렬화해야 하므로 보내기 전에
+  // 불러야 합니다.
+  void SetLatest(PongSide side, const Ptr<FunMessage> &message);
+  void SetLatest(PongSide side, const Json &message);
+  bool TakeLatest(PongSide side, string *relay);
+
+  // TakeLatest() 로 꺼낸 relay 를 모든 관전자에게 보냅니다. encoding 은
+  // SetLatest() 에 넘긴 메시지의 인코딩입니다.
+  void PublishRelay(EncodingScheme encoding, PongSide side,
+                    const string &relay);
+  // 매치 종료처럼 드문 메시지를 모든 관전자에게 보냅니다. 넘긴 메시지는
+  // 이후에 바꾸면 안 됩니다.
+  void Publish(const string &type, const Ptr<FunMessage> &message);
+  void Publish(const string &type, const Json &message);
+  // 관전자를 모두 뺍니다. 매치가 끝나면 부릅니다.
+  void Close();
+
+  // Publish() 를 실행할 event tag 입니다. 매치의 tag 와 다르므로 관전자에게
+  // 보내는 동안 플레이어의 ready, result, tick 처리가 밀리지 않습니다.
+  const EventTag &tag() const { return tag_; }
+
+ private:
+  struct Frame;
+  struct Subscriber;
+
+  void Publish(const Ptr<const Frame> &frame);
+  static void SendLatest(const Ptr<Subscriber> &subscriber);
+
+  const EventTag tag_;
+  mutable boost::mutex mutex_;
+  std::vector<Ptr<Subscriber> > subscribers_;
+  boost::atomic<size_t> subscriber_count_;
+
+  bool has_latest_[2];
+  string latest_[2];
+
+  boost::atomic<int64_t> published_frames_;
+  // 보내기 전에 새 프레임으로 교체된 수입니다.
+  boost::atomic<int64_t> replaced_frames_;
+};
+
+}  // namespace pong
+
+#endif  // SRC_SPECTATOR_CHANNEL_H_
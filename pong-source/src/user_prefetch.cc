@@ -0,0 +1,207 @@
+﻿#include "user_prefetch.h"
+
+#include <deque>
+#include <utility>
+
+#include <boost/atomic.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+
+#include "pong_rpc_messages.pb.h"
+
+
+DEFINE_bool(user_prefetch, true,
+            "Asks the target server to load the User object before a client "
+            "is redirected to it");
+DEFINE_int32(user_prefetch_window_in_ms, 3000,
+             "Counts a User fetch as a prefetch hit when it comes within "
+             "this time after the prefetch. Keep it equal to the Object "
+             "cache_expiration_in_ms");
+
+
+namespace pong {
+
+namespace {
+
+const char kPrefetchRpcType[] = "user_prefetch";
+
+
+struct PrefetchStats {
+  PrefetchStats()
+      : requested(0), received(0), loaded(0), not_found(0), expired(0),
+        hits(0), misses(0), hit_age_in_ms(0), hit_fetch_usec(0),
+        miss_fetch_usec(0) {
+  }
+
+  // 보내는 쪽입니다.
+  boost::atomic<int64_t> requested;
+  // 받는 쪽입니다.
+  boost::atomic<int64_t> received;
+  boost::atomic<int64_t> loaded;
+  boost::atomic<int64_t> not_found;
+  // 읽어 두었지만 window 안에 쓰이지 않았습니다.
+  boost::atomic<int64_t> expired;
+  boost::atomic<int64_t> hits;
+  boost::atomic<int64_t> misses;
+  // hit 일 때 prefetch 부터 실제로 읽을 때까지 걸린 시간의 합입니다.
+  boost::atomic<int64_t> hit_age_in_ms;
+  // 실제로 읽을 때 FetchById() 에 걸린 시간의 합입니다.
+  boost::atomic<int64_t> hit_fetch_usec;
+  boost::atomic<int64_t> miss_fetch_usec;
+};
+
+PrefetchStats the_stats;
+
+
+// prefetch 를 마친 아이디와 시각입니다. 같은 아이디를 다시 읽으면 시각만
+// 바꾸고, 만료는 the_prefetch_order 앞에서부터 지웁니다.
+typedef boost::unordered_map<string, WallClock::Value> PrefetchMap;
+typedef std::deque<std::pair<WallClock::Value, string> > PrefetchQueue;
+
+boost::mutex the_prefetch_mutex;
+PrefetchMap the_prefetched;
+PrefetchQueue the_prefetch_order;
+
+
+// the_prefetch_mutex 를 잡고 불러야 합니다.
+void ExpirePrefetched(const WallClock::Value &now) {
+  const WallClock::Duration window =
+      WallClock::FromMsec(FLAGS_user_prefetch_window_in_ms);
+  while (not the_prefetch_order.empty() &&
+         the_prefetch_order.front().first + window < now) {
+    PrefetchMap::iterator itr =
+        the_prefetched.find(the_prefetch_order.front().second);
+    if (itr != the_prefetched.end() &&
+        itr->second == the_prefetch_order.front().first) {
+      the_prefetched.erase(itr);
+      the_stats.expired.fetch_add(1, boost::memory_order_relaxed);
+    }
+    the_prefetch_order.pop_front();
+  }
+}
+
+
+// 이벤트 스레드에서 불립니다.
+void LoadUser(const string &id) {
+  Ptr<User> user = User::FetchById(id);
+  if (not user) {
+    // 처음 로그인하는 유저입니다.
+    the_stats.not_found.fetch_add(1, boost::memory_order_relaxed);
+    return;
+  }
+  the_stats.loaded.fetch_add(1, boost::memory_order_relaxed);
+
+  const WallClock::Value now = WallClock::Now();
+  boost::mutex::scoped_lock lock(the_prefetch_mutex);
+  ExpirePrefetched(now);
+  the_prefetched[id] = now;
+  the_prefetch_order.push_back(std::make_pair(now, id));
+}
+
+
+void OnPrefetchRequested(const Rpc::PeerId &/*sender*/,
+                         const Rpc::Xid &/*xid*/,
+                         const Ptr<const FunRpcMessage> &request,
+                         const Rpc::ReadyBack &finisher) {
+  // 응답은 보내지 않습니다.
+  finisher(Ptr<FunRpcMessage>());
+
+  if (not request->HasExtension(user_prefetch)) {
+    return;
+  }
+  the_stats.received.fetch_add(1, boost::memory_order_relaxed);
+  Event::Invoke(bind(&LoadUser, request->GetExtension(user_prefetch).id()));
+}
+
+
+// GET /v1/user_prefetch/
+void OnUserPrefetchRequested(Ptr<http::Response> response,
+                             const http::Request &/*request*/,
+                             const ApiService::MatchResult &/*params*/) {
+  response->status_code = http::kOk;
+  response->body = UserPrefetch::Dump().ToString();
+}
+
+}  // unnamed namespace
+
+
+void UserPrefetch::Install() {
+  Rpc::RegisterHandler(kPrefetchRpcType, OnPrefetchRequested);
+  ApiService::RegisterHandler(
+      http::kGet, boost::regex("/v1/user_prefetch/"), OnUserPrefetchRequested);
+}
+
+
+void UserPrefetch::Request(const Rpc::PeerId &target, const string &id) {
+  if (not FLAGS_user_prefetch || id.empty()) {
+    return;
+  }
+  the_stats.requested.fetch_add(1, boost::memory_order_relaxed);
+
+  if (target == Rpc::GetSelfId()) {
+    the_stats.received.fetch_add(1, boost::memory_order_relaxed);
+    Event::Invoke(bind(&LoadUser, id));
+    return;
+  }
+
+  Ptr<FunRpcMessage> request(new FunRpcMessage);
+  request->set_type(kPrefetchRpcType);
+  request->MutableExtension(user_prefetch)->set_id(id);
+  Rpc::Call(target, request);
+}
+
+
+Ptr<User> UserPrefetch::FetchById(const string &id) {
+  const WallClock::Value now = WallClock::Now();
+  bool hit = false;
+  {
+    boost::mutex::scoped_lock lock(the_prefetch_mutex);
+    ExpirePrefetched(now);
+    PrefetchMap::iterator itr = the_prefetched.find(id);
+    if (itr != the_prefetched.end()) {
+      hit = true;
+      the_stats.hit_age_in_ms.fetch_add(
+          (now - itr->second).total_milliseconds(),
+          boost::memory_order_relaxed);
+      // 한 번 쓰면 hit 으로 세지 않습니다.
+      the_prefetched.erase(itr);
+    }
+  }
+
+  Ptr<User> user = User::FetchById(id);
+
+  const int64_t fetch_usec = (WallClock::Now() - now).total_microseconds();
+  if (hit) {
+    the_stats.hits.fetch_add(1, boost::memory_order_relaxed);
+    the_stats.hit_fetch_usec.fetch_add(fetch_usec,
+                                       boost::memory_order_relaxed);
+  } else {
+    the_stats.misses.fetch_add(1, boost::memory_order_relaxed);
+    the_stats.miss_fetch_usec.fetch_add(fetch_usec,
+                                        boost::memory_order_relaxed);
+  }
+  return user;
+}
+
+
+Json UserPrefetch::Dump() {
+  Json dump;
+  dump["requested"] = the_stats.requested.load();
+  dump["received"] = the_stats.received.load();
+  dump["loaded"] = the_stats.loaded.load();
+  dump["not_found"] = the_stats.not_found.load();
+  dump["expired"] = the_stats.expired.load();
+  dump["hits"] = the_stats.hits.load();
+  dump["misses"] = the_stats.misses.load();
+  dump["hit_age_in_ms"] = the_stats.hit_age_in_ms.load();
+  dump["hit_fetch_usec"] = the_stats.hit_fetch_usec.load();
+  dump["miss_fetch_usec"] = the_stats.miss_fetch_usec.load();
+  dump["window_in_ms"] = FLAGS_user_prefetch_window_in_ms;
+  {
+    boost::mutex::scoped_lock lock(the_prefetch_mutex);
+    dump["pending"] = static_cast<int64_t>(the_prefetched.size());
+  }
+  return dump;
+}
+
+}  // namespace pong
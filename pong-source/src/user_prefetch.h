@@ -0,0 +1,35 @@
+﻿#ifndef SRC_USER_PREFETCH_H_
+#define SRC_USER_PREFETCH_H_
+
+#include <funapi.h>
+
+#include "pong_object.h"
+#include "pong_types.h"
+
+
+namespace pong {
+
+// 서버를 옮기는 유저의 User 객체를 옮겨 갈 서버에서 미리 읽어 둡니다.
+//
+// 클라이언트를 옮기기 전에 target 서버에 RPC 로 아이디를 알리면 target
+// 서버는 이벤트 스레드에서 User::FetchById() 를 불러 ORM cache 에 올려
+// 둡니다. 그 뒤 FetchById() 로 읽을 때 prefetch 가 맞았는지 셉니다.
+// 통계는 API 서비스의 GET /v1/user_prefetch/ 로 볼 수 있으며, Object 의
+// cache_expiration_in_ms 를 정할 때 참고합니다.
+class UserPrefetch {
+ public:
+  static void Install();
+
+  // target 서버가 id 를 미리 읽도록 알립니다.
+  static void Request(const Rpc::PeerId &target, const string &id);
+
+  // User::FetchById() 와 같습니다. prefetch 가 끝난 지
+  // --user_prefetch_window_in_ms 안이면 hit, 아니면 miss 로 셉니다.
+  static Ptr<User> FetchById(const string &id);
+
+  static Json Dump();
+};
+
+}  // namespace pong
+
+#endif  // SRC_USER_PREFETCH_H_
@@ -0,0 +1,421 @@
+﻿#include "user_record_cache.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <funapi.h>
+#include <glog/logging.h>
+
+#include "pong_object.h"
+#include "user_prefetch.h"
+
+
+DEFINE_int32(user_record_flush_interval_in_ms, 1000,
+             "Writes the accumulated win/lose counts to the ORM at this "
+             "interval");
+DEFINE_int32(user_record_flush_size, 256,
+             "Writes the accumulated win/lose counts early once this many "
+             "players have pending counts");
+DEFINE_int32(user_record_redirect_flush_window_in_ms, 10,
+             "Collects the counts of players leaving for another server for "
+             "this long and writes them together before redirecting");
+
+
+namespace pong {
+
+namespace {
+
+struct PendingRecord {
+  UserRecordDelta delta;
+  // 쓰지 않은 값이 처음 생긴 시각입니다. flush 지연을 잽니다.
+  WallClock::Value added_time;
+};
+
+typedef boost::unordered_map<string, PendingRecord> PendingRecordMap;
+typedef std::vector<std::pair<string, PendingRecord> > RecordBatch;
+
+
+// ORM 에 쓰기 시작했지만 아직 commit 되지 않은 값입니다. commit 전에는 ORM 의
+// 값이 예전 값이므로 GetPending() 이 이 값도 더해 줍니다.
+struct InFlightRecord {
+  InFlightRecord() : batch_count(0) {}
+
+  UserRecordDelta delta;
+  // 이 플레이어가 들어 있는 commit 되지 않은 batch 수입니다.
+  int batch_count;
+  // batch 가 모두 commit 되면 부를 Flush() 의 committed 들입니다.
+  std::vector<boost::function<void()> > waiters;
+};
+
+typedef boost::unordered_map<string, InFlightRecord> InFlightRecordMap;
+
+// 이벤트 하나에서 쓰는 최대 플레이어 수입니다. 한 명이라도 lock 이 겹치면
+// 이벤트 전체를 다시 돌리므로 작게 나누어 씁니다.
+const size_t kMaxPlayersPerWrite = 32;
+// 서버를 내릴 때 쓰기를 이만큼만 기다립니다.
+const int64_t kShutdownFlushTimeoutInMs = 5000;
+
+boost::mutex the_record_mutex;
+PendingRecordMap the_pending_records;
+InFlightRecordMap the_in_flight_records;
+// 다른 서버로 옮기는 플레이어들의 값입니다. 모아서 함께 씁니다.
+RecordBatch the_redirect_records;
+bool the_redirect_flush_scheduled = false;
+
+
+struct FlushStats {
+  FlushStats()
+      : batches(0), players(0), max_batch_size(0), missing_users(0),
+        lag_in_ms(0), max_lag_in_ms(0) {
+  }
+
+  boost::atomic<int64_t> batches;
+  boost::atomic<int64_t> players;
+  boost::atomic<int64_t> max_batch_size;
+  // User 가 없어서 버린 값입니다.
+  boost::atomic<int64_t> missing_users;
+  // 값이 생긴 뒤 ORM 에 쓸 때까지 걸린 시간의 합과 최댓값입니다.
+  boost::atomic<int64_t> lag_in_ms;
+  boost::atomic<int64_t> max_lag_in_ms;
+};
+
+FlushStats the_stats;
+
+
+void AddDelta(UserRecordDelta *target, const UserRecordDelta &delta,
+              int64_t sign) {
+  target->win_count += sign * delta.win_count;
+  target->lose_count += sign * delta.lose_count;
+  target->win_count_single += sign * delta.win_count_single;
+  target->lose_count_single += sign * delta.lose_count_single;
+}
+
+
+// the_pending_records 에서 떼어 낸 값을 commit 될 때까지 기억합니다.
+// the_record_mutex 를 잡고 불러야 합니다.
+void MarkInFlight(const string &id, const PendingRecord &pending) {
+  InFlightRecord &in_flight = the_in_flight_records[id];
+  AddDelta(&in_flight.delta, pending.delta, 1);
+  ++in_flight.batch_count;
+}
+
+
+void UpdateMax(boost::atomic<int64_t> *target, int64_t value) {
+  int64_t current = target->load(boost::memory_order_relaxed);
+  while (current < value &&
+         not target->compare_exchange_weak(current, value,
+                                           boost::memory_order_relaxed)) {
+  }
+}
+
+
+// 나누어 쓴 batch 가 모두 commit 되면 committed 를 부릅니다.
+struct WriteJoin {
+  WriteJoin(size_t count, const boost::function<void()> &callback)
+      : remaining(count), committed(callback) {
+  }
+
+  boost::atomic<size_t> remaining;
+  boost::function<void()> committed;
+};
+
+
+void OnBatchCommitted(const Ptr<RecordBatch> &batch,
+                      const Ptr<WriteJoin> &join) {
+  std::vector<boost::function<void()> > waiters;
+  {
+    boost::mutex::scoped_lock lock(the_record_mutex);
+    for (size_t i = 0; i < batch->size(); ++i) {
+      InFlightRecordMap::iterator itr =
+          the_in_flight_records.find((*batch)[i].first);
+      BOOST_ASSERT(itr != the_in_flight_records.end());
+      AddDelta(&itr->second.delta, (*batch)[i].second.delta, -1);
+      if (--itr->second.batch_count == 0) {
+        waiters.insert(waiters.end(), itr->second.waiters.begin(),
+                       itr->second.waiters.end());
+        the_in_flight_records.erase(itr);
+      }
+    }
+  }
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    waiters[i]();
+  }
+
+  if (join->remaining.fetch_sub(1, boost::memory_order_acq_rel) == 1 &&
+      join->committed) {
+    join->committed();
+  }
+}
+
+
+// 이벤트 스레드에서 불립니다. 이벤트가 끝날 때 ORM 이 한꺼번에 씁니다.
+void WriteRecords(const Ptr<RecordBatch> &batch, const Ptr<WriteJoin> &join) {
+  const WallClock::Value now = WallClock::Now();
+  for (size_t i = 0; i < batch->size(); ++i) {
+    const string &id = (*batch)[i].first;
+    const PendingRecord &pending = (*batch)[i].second;
+
+    const int64_t lag_in_ms = (now - pending.added_time).total_milliseconds();
+    the_stats.lag_in_ms.fetch_add(lag_in_ms, boost::memory_order_relaxed);
+    UpdateMax(&the_stats.max_lag_in_ms, lag_in_ms);
+
+    Ptr<User> user = UserPrefetch::FetchById(id);
+    if (not user) {
+      LOG(ERROR) << "Cannot find user's id in db: id=" << id;
+      the_stats.missing_users.fetch_add(1, boost::memory_order_relaxed);
+      continue;
+    }
+
+    const UserRecordDelta &delta = pending.delta;
+    if (delta.win_count) {
+      user->SetWinCount(user->GetWinCount() + delta.win_count);
+    }
+    if (delta.lose_count) {
+      user->SetLoseCount(user->GetLoseCount() + delta.lose_count);
+    }
+    if (delta.win_count_single) {
+      user->SetWinCountSingle(
+          user->GetWinCountSingle() + delta.win_count_single);
+    }
+    if (delta.lose_count_single) {
+      user->SetLoseCountSingle(
+          user->GetLoseCountSingle() + delta.lose_count_single);
+    }
+  }
+
+  the_stats.batches.fetch_add(1, boost::memory_order_relaxed);
+  the_stats.players.fetch_add(batch->size(), boost::memory_order_relaxed);
+  UpdateMax(&the_stats.max_batch_size, batch->size());
+
+  // 이 이벤트가 끝나야 ORM 이 commit 합니다. 같은 tag 의 다음 이벤트는
+  // 그 뒤에 불리므로 거기서 알립니다.
+  Event::Invoke(bind(&OnBatchCommitted, batch, join),
+                Event::GetCurrentEventTag());
+}
+
+
+// records 를 kMaxPlayersPerWrite 명씩 나누어 각자의 event tag 에서 씁니다.
+// 모두 commit 되면 committed 를 부릅니다. records 는 MarkInFlight() 로
+// 기억해 둔 값이어야 합니다.
+void WriteInBatches(const RecordBatch &records,
+                    const boost::function<void()> &committed) {
+  if (records.empty()) {
+    if (committed) {
+      committed();
+    }
+    return;
+  }
+
+  const size_t batch_count =
+      (records.size() + kMaxPlayersPerWrite - 1) / kMaxPlayersPerWrite;
+  Ptr<WriteJoin> join(new WriteJoin(batch_count, committed));
+  for (size_t begin = 0; begin < records.size();
+       begin += kMaxPlayersPerWrite) {
+    const size_t end = std::min(begin + kMaxPlayersPerWrite, records.size());
+    Ptr<RecordBatch> batch(
+        new RecordBatch(records.begin() + begin, records.begin() + end));
+    Event::Invoke(bind(&WriteRecords, batch, join),
+                  RandomGenerator::GenerateUuid());
+  }
+}
+
+
+// 모아 둔 값을 모두 떼어 내서 씁니다.
+void FlushPending(const boost::function<void()> &committed) {
+  RecordBatch records;
+  {
+    boost::mutex::scoped_lock lock(the_record_mutex);
+    records.swap(the_redirect_records);
+    for (PendingRecordMap::const_iterator itr = the_pending_records.begin();
+         itr != the_pending_records.end(); ++itr) {
+      MarkInFlight(itr->first, itr->second);
+      records.push_back(*itr);
+    }
+    the_pending_records.clear();
+  }
+  WriteInBatches(records, committed);
+}
+
+
+void OnRedirectFlushTimerExpired(const Timer::Id &/*timer_id*/,
+                                 const WallClock::Value &/*now*/) {
+  RecordBatch records;
+  {
+    boost::mutex::scoped_lock lock(the_record_mutex);
+    the_redirect_flush_scheduled = false;
+    records.swap(the_redirect_records);
+  }
+  WriteInBatches(records, boost::function<void()>());
+}
+
+
+// 서버를 내릴 때 쓰기가 끝나기를 기다립니다.
+class FlushWaiter {
+ public:
+  FlushWaiter() : done_(false) {}
+
+  void Notify() {
+    boost::mutex::scoped_lock lock(mutex_);
+    done_ = true;
+    condition_.notify_all();
+  }
+
+  bool Wait(const boost::posix_time::time_duration &timeout) {
+    const boost::system_time deadline = boost::get_system_time() + timeout;
+    boost::mutex::scoped_lock lock(mutex_);
+    while (not done_) {
+      if (not condition_.timed_wait(lock, deadline)) {
+        return done_;
+      }
+    }
+    return true;
+  }
+
+ private:
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  bool done_;
+};
+
+
+void OnFlushTimerExpired(const Timer::Id &/*timer_id*/,
+                         const WallClock::Value &/*now*/) {
+  FlushPending(boost::function<void()>());
+}
+
+
+// GET /v1/user_record_cache/
+void OnUserRecordCacheRequested(Ptr<http::Response> response,
+                                const http::Request &/*request*/,
+                                const ApiService::MatchResult &/*params*/) {
+  response->status_code = http::kOk;
+  response->body = UserRecordCache::Dump().ToString();
+}
+
+}  // unnamed namespace
+
+
+void UserRecordCache::Install() {
+  Timer::ExpireRepeatedly(
+      WallClock::FromMsec(FLAGS_user_record_flush_interval_in_ms),
+      OnFlushTimerExpired);
+  ApiService::RegisterHandler(
+      http::kGet, boost::regex("/v1/user_record_cache/"),
+      OnUserRecordCacheRequested);
+}
+
+
+void UserRecordCache::Add(const string &id, const UserRecordDelta &delta) {
+  bool full = false;
+  {
+    boost::mutex::scoped_lock lock(the_record_mutex);
+    std::pair<PendingRecordMap::iterator, bool> inserted =
+        the_pending_records.insert(std::make_pair(id, PendingRecord()));
+    PendingRecord &pending = inserted.first->second;
+    if (inserted.second) {
+      pending.added_time = WallClock::Now();
+    }
+    pending.delta.win_count += delta.win_count;
+    pending.delta.lose_count += delta.lose_count;
+    pending.delta.win_count_single += delta.win_count_single;
+    pending.delta.lose_count_single += delta.lose_count_single;
+    full = the_pending_records.size() >=
+           static_cast<size_t>(FLAGS_user_record_flush_size);
+  }
+
+  if (full) {
+    FlushPending(boost::function<void()>());
+  }
+}
+
+
+UserRecordDelta UserRecordCache::GetPending(const string &id) {
+  UserRecordDelta delta;
+  boost::mutex::scoped_lock lock(the_record_mutex);
+  PendingRecordMap::const_iterator pending = the_pending_records.find(id);
+  if (pending != the_pending_records.end()) {
+    AddDelta(&delta, pending->second.delta, 1);
+  }
+  InFlightRecordMap::const_iterator in_flight =
+      the_in_flight_records.find(id);
+  if (in_flight != the_in_flight_records.end()) {
+    AddDelta(&delta, in_flight->second.delta, 1);
+  }
+  return delta;
+}
+
+
+void UserRecordCache::Flush(const string &id,
+                            const boost::function<void()> &committed) {
+  RecordBatch records;
+  bool schedule = false;
+  bool wait = false;
+  {
+    boost::mutex::scoped_lock lock(the_record_mutex);
+    PendingRecordMap::iterator itr = the_pending_records.find(id);
+    if (itr != the_pending_records.end()) {
+      MarkInFlight(itr->first, itr->second);
+      the_redirect_records.push_back(*itr);
+      the_pending_records.erase(itr);
+
+      // 한 batch 가 차면 바로 쓰고, 아니면 잠시 모읍니다.
+      if (the_redirect_records.size() >= kMaxPlayersPerWrite) {
+        records.swap(the_redirect_records);
+      } else if (not the_redirect_flush_scheduled) {
+        the_redirect_flush_scheduled = true;
+        schedule = true;
+      }
+    }
+
+    // 앞서 쓰기 시작한 값까지 commit 되어야 옮길 수 있습니다.
+    InFlightRecordMap::iterator in_flight = the_in_flight_records.find(id);
+    if (in_flight != the_in_flight_records.end() && committed) {
+      in_flight->second.waiters.push_back(committed);
+      wait = true;
+    }
+  }
+
+  if (schedule) {
+    Timer::ExpireAfter(
+        WallClock::FromMsec(FLAGS_user_record_redirect_flush_window_in_ms),
+        OnRedirectFlushTimerExpired);
+  }
+  WriteInBatches(records, boost::function<void()>());
+  if (not wait && committed) {
+    committed();
+  }
+}
+
+
+void UserRecordCache::FlushAll() {
+  Ptr<FlushWaiter> waiter(new FlushWaiter);
+  FlushPending(bind(&FlushWaiter::Notify, waiter));
+  if (not waiter->Wait(
+          boost::posix_time::milliseconds(kShutdownFlushTimeoutInMs))) {
+    LOG(ERROR) << "Timed out writing win/lose counts at shutdown. Some "
+               << "counts may be lost: timeout_in_ms="
+               << kShutdownFlushTimeoutInMs;
+  }
+}
+
+
+Json UserRecordCache::Dump() {
+  Json dump;
+  dump["batches"] = the_stats.batches.load();
+  dump["players"] = the_stats.players.load();
+  dump["max_batch_size"] = the_stats.max_batch_size.load();
+  dump["missing_users"] = the_stats.missing_users.load();
+  dump["lag_in_ms"] = the_stats.lag_in_ms.load();
+  dump["max_lag_in_ms"] = the_stats.max_lag_in_ms.load();
+  {
+    boost::mutex::scoped_lock lock(the_record_mutex);
+    dump["pending"] = static_cast<int64_t>(the_pending_records.size());
+    dump["in_flight"] = static_cast<int64_t>(the_in_flight_records.size());
+  }
+  return dump;
+}
+
+}  // namespace pong
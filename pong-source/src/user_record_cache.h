@@ -0,0 +1,58 @@
+﻿#ifndef SRC_USER_RECORD_CACHE_H_
+#define SRC_USER_RECORD_CACHE_H_
+
+#include <funapi.h>
+
+#include "pong_types.h"
+
+
+namespace pong {
+
+// User 의 승/패 수에 더할 값입니다.
+struct UserRecordDelta {
+  UserRecordDelta()
+      : win_count(0), lose_count(0), win_count_single(0),
+        lose_count_single(0) {
+  }
+
+  int64_t win_count;
+  int64_t lose_count;
+  int64_t win_count_single;
+  int64_t lose_count_single;
+};
+
+
+// 승/패 수를 게임마다 ORM 에 쓰지 않고 플레이어별로 모아 두었다가 한꺼번에
+// 씁니다.
+//
+// --user_record_flush_interval_in_ms 마다, 또는 모인 플레이어가
+// --user_record_flush_size 를 넘으면 모아 둔 값을 User 에 더합니다. lock 이
+// 겹쳐 이벤트를 다시 돌리는 비용을 줄이려고 이벤트 하나에서는 32 명까지만
+// 씁니다. 클라이언트를 다른 서버로 옮길 때와 서버를 내릴 때도 씁니다.
+// 통계는 API 서비스의 GET /v1/user_record_cache/ 로 볼 수 있습니다.
+class UserRecordCache {
+ public:
+  static void Install();
+
+  static void Add(const string &id, const UserRecordDelta &delta);
+
+  // 아직 ORM 에 commit 되지 않은 값입니다. 쓰는 중인 값도 포함합니다. 없으면
+  // 모두 0 입니다.
+  static UserRecordDelta GetPending(const string &id);
+
+  // 다른 서버로 옮기는 id 의 값만 씁니다. 같은 때 옮기는 플레이어들의 값은
+  // --user_record_redirect_flush_window_in_ms 동안 모아서 함께 씁니다. id 의
+  // 값이 모두 commit 된 뒤에 committed 를 부르며, 쓸 값이 없으면 바로
+  // 부릅니다.
+  static void Flush(const string &id,
+                    const boost::function<void()> &committed);
+  // 모아 둔 값을 모두 쓰고 commit 될 때까지 기다립니다. 서버를 내릴 때
+  // 부릅니다.
+  static void FlushAll();
+
+  static Json Dump();
+};
+
+}  // namespace pong
+
+#endif  // SRC_USER_RECORD_CACHE_H_